@@ -0,0 +1,60 @@
+# forwards connections to a local port, holding back every read for a fixed
+# delay in each direction to stand in for a link's latency, and optionally
+# capping each direction's rate
+# python3 delay_proxy.py <listen port> <target port> <delay ms> [MiB/s]
+import asyncio
+import sys
+
+listen_port = int(sys.argv[1])
+target_port = int(sys.argv[2])
+delay = int(sys.argv[3]) / 1000
+rate = float(sys.argv[4]) * 1024 * 1024 if len(sys.argv) > 4 else 0
+
+
+async def forward(reader, writer):
+    loop = asyncio.get_running_loop()
+    queue = asyncio.Queue()
+
+    async def send():
+        start = loop.time()
+        sent = 0
+        while True:
+            received, data = await queue.get()
+            if not data:
+                writer.close()
+                return
+            wait = received + delay - loop.time()
+            if wait > 0:
+                await asyncio.sleep(wait)
+            # the cap only holds while data keeps coming
+            if rate and start + sent / rate < loop.time():
+                start, sent = loop.time(), 0
+            writer.write(data)
+            await writer.drain()
+            sent += len(data)
+            if rate and start + sent / rate > loop.time():
+                await asyncio.sleep(start + sent / rate - loop.time())
+
+    sender = asyncio.create_task(send())
+    while True:
+        data = await reader.read(1 << 16)
+        queue.put_nowait((loop.time(), data))
+        if not data:
+            break
+    await sender
+
+
+async def handle(client_reader, client_writer):
+    target_reader, target_writer = await asyncio.open_connection(
+        "127.0.0.1", target_port)
+    await asyncio.gather(forward(client_reader, target_writer),
+                         forward(target_reader, client_writer),
+                         return_exceptions=True)
+
+
+async def main():
+    server = await asyncio.start_server(handle, "127.0.0.1", listen_port)
+    await server.serve_forever()
+
+
+asyncio.run(main())
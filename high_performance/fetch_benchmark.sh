@@ -0,0 +1,75 @@
+#!/bin/bash
+
+# whole package FETCH of a SIZE package in CHUNKSZ chunks through proxies
+# adding DELAY ms each way, run from this directory after
+# make btide pkgbuild
+#   ./fetch_benchmark.sh         one seeder, several fetch_window sizes
+#   ./fetch_benchmark.sh peers   1 to 3 seeders capped at RATE MiB/s each
+SIZE=64M
+CHUNKSZ=16384
+DELAY=${DELAY:-5}
+RATE=${RATE:-4}
+PORT=${PORT:-9341}
+DIR=fetch_bench
+MODE=${1:-window}
+
+if [ ! -f "$DIR/fetch.bpkg" ]; then
+    echo "Generating $DIR/fetch.data..."
+    mkdir -p $DIR/receiver
+    ../pkgbuild $DIR/fetch.data --generate $SIZE --chunksz $CHUNKSZ \
+        --output $DIR/fetch.bpkg --seed 1 > /dev/null
+    sed -i 's#^filename:.*#filename:fetch.data#' $DIR/fetch.bpkg
+fi
+
+# seeder i listens on PORT + 10 * i behind a proxy on the port after it
+SEEDERS=1
+if [ "$MODE" = peers ]; then
+    SEEDERS=3
+fi
+PIDS=""
+for i in $(seq 0 $((SEEDERS - 1))); do
+    mkdir -p $DIR/seeder$i
+    ln -sf ../fetch.data $DIR/seeder$i/fetch.data
+    printf "directory:$DIR/seeder$i/\nmax_peers:4\nport:$((PORT + 10 * i))\n" \
+        > $DIR/seeder$i.cfg
+    # each seeder loads the package, then serves until the runs are done
+    (echo "ADDPACKAGE $DIR/fetch.bpkg"; sleep 300; echo QUIT) \
+        | ../btide $DIR/seeder$i.cfg > /dev/null &
+    PIDS="$PIDS $!"
+    if [ "$MODE" = peers ]; then
+        python3 delay_proxy.py $((PORT + 10 * i + 1)) $((PORT + 10 * i)) \
+            $DELAY $RATE &
+    else
+        python3 delay_proxy.py $((PORT + 10 * i + 1)) $((PORT + 10 * i)) \
+            $DELAY &
+    fi
+    PIDS="$PIDS $!"
+done
+sleep 5
+
+# fetches with the given fetch_window from the proxies on the given ports
+receive() {
+    local window=$1
+    shift
+    rm -f $DIR/receiver/fetch.data
+    printf "directory:$DIR/receiver/\nmax_peers:4\nport:$((PORT + 100))\n" \
+        > $DIR/receiver.cfg
+    printf "fetch_window:$window\n" >> $DIR/receiver.cfg
+    python3 fetch_receiver.py $DIR/receiver.cfg $DIR/fetch.bpkg "$@"
+}
+
+if [ "$MODE" = peers ]; then
+    PROXIES=""
+    for i in 0 1 2; do
+        PROXIES="$PROXIES $((PORT + 10 * i + 1))"
+        echo -n "$((i + 1)) seeders at $RATE MiB/s: "
+        receive 64 $PROXIES
+    done
+else
+    for window in 1 4 16 64 256; do
+        echo -n "fetch_window $window: "
+        receive $window $((PORT + 1))
+    done
+fi
+kill $PIDS $(jobs -p) 2>/dev/null
+wait 2>/dev/null
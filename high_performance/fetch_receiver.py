@@ -0,0 +1,39 @@
+# runs a btide that connects to local peers, fetches a whole package naming
+# the first and prints what its FETCH reports
+# python3 fetch_receiver.py <config> <manifest.bpkg> <peer port>...
+import subprocess
+import sys
+import time
+
+config = sys.argv[1]
+manifest = sys.argv[2]
+ports = [int(port) for port in sys.argv[3:]]
+ident = open(manifest).readline().split(":", 1)[1].strip()
+
+btide = subprocess.Popen(["stdbuf", "-i0", "-o0", "../btide", config],
+                         stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                         text=True)
+
+
+def command(line):
+    btide.stdin.write(line + "\n")
+    btide.stdin.flush()
+
+
+# the package is usable once its background build registers it
+command("ADDPACKAGE " + manifest)
+while True:
+    time.sleep(0.5)
+    command("PACKAGES")
+    if "INCOMPLETE" in btide.stdout.readline():
+        break
+for port in ports:
+    command(f"CONNECT 127.0.0.1:{port}")
+time.sleep(0.5)
+command(f"FETCH 127.0.0.1:{ports[0]} {ident}")
+for line in btide.stdout:
+    if line.startswith("Fetched") or line.startswith("Unable"):
+        print(line.strip())
+        break
+command("QUIT")
+btide.wait()
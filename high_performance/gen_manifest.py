@@ -0,0 +1,23 @@
+# generates a synthetic .bpkg manifest with random hashes for parser
+# benchmarks, the data file it names does not exist
+# python3 gen_manifest.py <nchunks> <output.bpkg>
+import os
+import sys
+
+nchunks = int(sys.argv[1])
+output = sys.argv[2]
+chunk_size = 1024
+
+with open(output, "w") as f:
+    f.write("ident:" + os.urandom(512).hex()[:1023] + "\n")
+    f.write("filename:synthetic.data\n")
+    f.write("size:%d\n" % (nchunks * chunk_size))
+    f.write("nhashes:%d\n" % (nchunks - 1))
+    f.write("hashes:\n")
+    for _ in range(nchunks - 1):
+        f.write("\t" + os.urandom(32).hex() + "\n")
+    f.write("nchunks:%d\n" % nchunks)
+    f.write("chunks:\n")
+    for i in range(nchunks):
+        f.write("\t%s,%d,%d\n" % (os.urandom(32).hex(), i * chunk_size, 
+            chunk_size))
@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# parse throughput of bpkg_load on benchmark1.bpkg and a synthetic
+# manifest with NCHUNKS chunk lines, run from this directory after
+# make parsebench
+NCHUNKS=1048576
+SYNTHETIC="synthetic_1m.bpkg"
+
+if [ ! -f "$SYNTHETIC" ]; then
+    echo "Generating $SYNTHETIC..."
+    python3 gen_manifest.py $NCHUNKS $SYNTHETIC
+fi
+
+../parsebench benchmark1.bpkg 200
+../parsebench $SYNTHETIC 5
+
+# the same manifests compiled to the binary format, loaded without parsing
+for manifest in benchmark1.bpkg $SYNTHETIC; do
+    if [ ! -f "${manifest}b" ] || [ "$manifest" -nt "${manifest}b" ]; then
+        ../pkgmain $manifest -compile ${manifest}b
+    fi
+done
+../parsebench benchmark1.bpkgb 200
+../parsebench ${SYNTHETIC}b 5
@@ -0,0 +1,98 @@
+#define _POSIX_C_SOURCE 200112L
+#include <chk/pkgchk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static double seconds_between(const struct timespec *a, 
+    const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+// parse throughput benchmark for bpkg_load
+// ./parsebench <file.bpkg> [iterations] [parse threads]
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: ./parsebench <file.bpkg> [iterations] "
+            "[parse threads]\n");
+        return 1;
+    }
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+    if (iterations < 1)
+    {
+        iterations = 1;
+    }
+    if (argc > 3)
+    {
+        bpkg_set_parse_threads(atoi(argv[3]));
+    }
+    struct stat st;
+    if (stat(argv[1], &st) != 0)
+    {
+        perror("stat");
+        return 1;
+    }
+    uint32_t nchunks = 0;
+    // header is bpkg_load alone, full also loads the sections
+    double header = 0, full = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        struct timespec start, loaded, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bpkg_obj *obj = bpkg_load(argv[1]);
+        clock_gettime(CLOCK_MONOTONIC, &loaded);
+        if (!obj || bpkg_load_sections(obj))
+        {
+            fprintf(stderr, "Failed to load %s\n", argv[1]);
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        nchunks = obj->nchunks;
+        bpkg_obj_destroy(obj);
+        header += seconds_between(&start, &loaded);
+        full += seconds_between(&start, &end);
+    }
+    double per_load = full / iterations;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%s: %u chunks, %.2f MiB, header %.2f ms/load, "
+        "full %.2f ms/load, %.1f MiB/s, %.2f M chunk lines/s, "
+        "peak rss %.1f MiB\n", argv[1], nchunks, 
+        st.st_size / (1024.0 * 1024.0), header / iterations * 1000, 
+        per_load * 1000, st.st_size / (1024.0 * 1024.0) / per_load, 
+        nchunks / per_load / 1e6, usage.ru_maxrss / 1024.0);
+
+    // chunk lookups by hash as a peer serving REQs does them, the first
+    // one also builds the lookup table
+    bpkg_obj *obj = bpkg_load(argv[1]);
+    if (!obj || bpkg_load_sections(obj) || obj->nchunks == 0)
+    {
+        bpkg_obj_destroy(obj);
+        return 0;
+    }
+    enum { LOOKUPS = 1000 };
+    char hex[HASHLENGTH];
+    struct timespec start, first, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bpkg_chunk_hash_hex(obj, obj->nchunks - 1, hex);
+    int64_t found = bpkg_find_chunk(obj, hex) >= 0;
+    clock_gettime(CLOCK_MONOTONIC, &first);
+    uint32_t seed = 1;
+    for (int i = 0; i < LOOKUPS; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        bpkg_chunk_hash_hex(obj, seed % obj->nchunks, hex);
+        found += bpkg_find_chunk(obj, hex) >= 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("first lookup %.2f ms, then %.2f us/lookup (%lld found)\n",
+        seconds_between(&start, &first) * 1000,
+        seconds_between(&first, &end) / LOOKUPS * 1e6, (long long)found);
+    bpkg_obj_destroy(obj);
+    return 0;
+}
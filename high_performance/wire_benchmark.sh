@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# loopback transfer of a SIZE package in NCHUNKS chunks from a btide
+# seeder in each wire encoding, run from this directory after
+# make btide pkgbuild
+SIZE=256M
+NCHUNKS=256
+PORT=${PORT:-9321}
+DIR=wire_bench
+
+if [ ! -f "$DIR/wire.bpkg" ]; then
+    echo "Generating $DIR/wire.data..."
+    mkdir -p $DIR
+    ../pkgbuild $DIR/wire.data --generate $SIZE --nchunks $NCHUNKS \
+        --output $DIR/wire.bpkg --seed 1 > /dev/null
+    sed -i 's#^filename:.*#filename:wire.data#' $DIR/wire.bpkg
+fi
+printf "directory:$DIR/\nmax_peers:4\nport:$PORT\n" > $DIR/seeder.cfg
+
+# the seeder loads the package, then serves until the runs are done
+(echo "ADDPACKAGE $DIR/wire.bpkg"; sleep 30; echo QUIT) \
+    | ../btide $DIR/seeder.cfg > /dev/null &
+sleep 5
+for run in 1 2 3; do
+    for mode in legacy compact jumbo; do
+        python3 wire_client.py $PORT $DIR/wire.bpkg $mode
+    done
+done
+wait
@@ -0,0 +1,80 @@
+# fetches every chunk of a package from a btide seeder as fast as the wire
+# allows and reports the throughput, without writing or hashing the data
+# python3 wire_client.py <port> <manifest.bpkg> <legacy|compact|jumbo>
+import socket
+import struct
+import sys
+import time
+
+port = int(sys.argv[1])
+manifest = sys.argv[2]
+mode = sys.argv[3]
+flags = {"legacy": 0, "compact": 1, "jumbo": 3}[mode]
+
+lines = open(manifest).read().split("\n")
+ident = lines[0].split(":", 1)[1].encode()
+start = lines.index("chunks:") + 1
+chunks = [l.strip().split(",") for l in lines[start:] if l.startswith("\t")]
+total = sum(int(c[2]) for c in chunks)
+
+sock = socket.create_connection(("127.0.0.1", port))
+buffer = bytearray()
+
+
+def fill(n):
+    while len(buffer) < n:
+        data = sock.recv(1 << 20)
+        if not data:
+            sys.exit("seeder hung up")
+        buffer.extend(data)
+
+
+# the ACP, then an ACK accepting the encoding to test (net/wire.h)
+fill(4096)
+del buffer[:4096]
+ack = struct.pack("<HH", 0x0c, 0)
+if flags:
+    ack += b"BTWIRE1\0" + struct.pack("<II", flags, 1 << 20)
+sock.sendall(ack.ljust(4096, b"\0"))
+
+began = time.time()
+requests = bytearray()
+for chunk_hash, offset, size in chunks:
+    payload = struct.pack("<II", int(offset), int(size)) + chunk_hash.encode() \
+        + ident.ljust(1024, b"\0")
+    if flags:
+        requests += struct.pack("<HHI", 0x06, 0, len(payload)) + payload
+    else:
+        requests += struct.pack("<HH", 0x06, 0) + payload.ljust(4092, b"\0")
+sock.sendall(requests)
+
+received = 0
+frames = 0
+wire = 0
+while received < total:
+    if flags:
+        fill(8)
+        code, error, length = struct.unpack_from("<HHI", buffer)
+        fill(8 + length)
+        if code == 0x107:
+            received += struct.unpack_from("<I", buffer, 12)[0]
+        else:
+            received += struct.unpack_from("<H", buffer, 12)[0]
+        frame = 8 + length
+    else:
+        fill(4096)
+        received += struct.unpack_from("<H", buffer, 4 + 4 + 2998)[0]
+        frame = 4096
+    if struct.unpack_from("<H", buffer, 2)[0]:
+        sys.exit("seeder sent an error RES")
+    wire += frame
+    frames += 1
+    del buffer[:frame]
+elapsed = time.time() - began
+
+print("%-8s %7.3f s %8.1f MiB/s %7d frames %5.1f%% headers" % (mode, elapsed,
+    total / elapsed / 2**20, frames, 100 * (wire - total) / wire))
+if flags:
+    sock.sendall(struct.pack("<HHI", 0x03, 0, 0))
+else:
+    sock.sendall(struct.pack("<HH", 0x03, 0).ljust(4096, b"\0"))
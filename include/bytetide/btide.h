@@ -1,23 +1,35 @@
 #include <arpa/inet.h>
 #include <config/config.h>
+#include <net/packet.h>
+#include <net/wire.h>
+#include <peer/peertable.h>
 
-void *server_function(void *arg);
+int start_server(Config *cfg);
 
 void *client_function(void *arg);
 
-void *handle_connection(void *arg);
+int handle_packet(int socket, struct btide_packet *packet);
+
+int peer_ready(int socket, struct sockaddr_in address);
 
 void add_peer(int socket, struct sockaddr_in address, Config *cfg);
 
-void remove_peer(int socket);
+int remove_peer(int socket);
+
+/**
+ * Takes a peer out of the peer table and out of its downloads, copying it
+ * to peer if that is not NULL, the caller closes its socket
+ * @return 0 on success, 1 if the peer had already left
+ */
+int remove_peer_id(Peer_id id, Peer *peer);
 
 void send_acp_packet(int socket);
 
-void send_ack_packet(int socket);
+void send_ack_packet(int socket, Wire_mode mode);
 
 void send_dsn_packet(int socket);
 
-void *handle_connection(void *arg);
+int recv_packet(int socket, struct btide_packet *packet);
 
 int connect_to_peer(const char *ip, int port);
 
@@ -0,0 +1,66 @@
+#ifndef BPKGBIN_H
+#define BPKGBIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chk/pkgchk.h>
+
+// first bytes of a compiled manifest, text manifests start with a key
+#define BPKG_BIN_MAGIC "BPKGBIN"
+#define BPKG_BIN_VERSION (2)
+// written in host order, a file from a host with other endianness fails
+#define BPKG_BIN_BYTE_ORDER (0x01020304u)
+// every section starts on this boundary
+#define BPKG_BIN_ALIGN (8)
+
+/**
+ * Header of a compiled (.bpkgb) manifest, followed by the sections it points
+ * to: nhashes digests, nchunks digests, nchunks offsets, nchunks sizes and
+ * the raw hash table
+ * Offsets are from the start of the file and BPKG_BIN_ALIGN aligned
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    // none are defined yet, written as 0
+    uint32_t flags;
+    uint32_t size;
+    uint32_t nhashes;
+    uint32_t nchunks;
+    uint32_t nraw_hashes;
+    uint64_t file_length;
+    uint64_t hashes_off;
+    uint64_t chunk_digests_off;
+    uint64_t chunk_offsets_off;
+    uint64_t chunk_sizes_off;
+    uint64_t raw_hashes_off;
+    char ident[1024];
+    char filename[256];
+} Bpkg_bin_header;
+
+// true if the mapped data starts like a compiled manifest
+int bpkg_bin_detect(const void *data, size_t length);
+
+/**
+ * Creates a package over a mapped compiled manifest, only the header,
+ * section bounds and raw hash table are checked, nothing is parsed or copied
+ * On success the object owns the mapping and unmaps it when destroyed
+ * @return package, or NULL if the header is invalid (data is not unmapped)
+ */
+bpkg_obj *bpkg_bin_load(void *data, size_t length);
+
+/**
+ * Writes the package as a compiled manifest
+ * @return 0 on success, 1 on failure
+ */
+int bpkg_bin_write(bpkg_obj *obj, const char *path);
+
+/**
+ * Writes the package in the text .bpkg format
+ * @return 0 on success, 1 on failure
+ */
+int bpkg_text_write(bpkg_obj *obj, const char *path);
+
+#endif
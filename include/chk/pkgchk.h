@@ -3,6 +3,10 @@
 #define HASHLENGTH 65
 #include <stddef.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <crypt/sha256.h>
 #include <tree/merkletree.h>
 
 /**
@@ -18,27 +22,152 @@ typedef struct bpkg_query
 	size_t len;
 } bpkg_query;
 
+/**
+ * A hash from the manifest that is not valid hex, e.g. a corrupted entry
+ * Its digest slot is zeroed and the text is kept so it prints unchanged
+ */
 typedef struct
 {
-	char hash[65];
-	uint32_t offset;
-	uint32_t size;
-} Chunk;
+	uint32_t index;
+	// 0 for the hashes section, 1 for the chunks section
+	int is_chunk;
+	char hex[HASHLENGTH];
+} Bpkg_raw_hash;
+
+// longest ident and filename the manifests may hold, including the null
+#define BPKG_IDENT_SIZE 1024
+#define BPKG_FILENAME_SIZE 256
 
 typedef struct bpkg_obj
 {
-	// max 1024 chars + null
-	char ident[1024];
-	// max 256 chars + null
-	char filename[256];
+	// interned (see chk/strpool.h), only change them through the setters
+	const char *ident;
+	const char *filename;
 	uint32_t size;
 	uint32_t nhashes;
-	char **hashes;
+	// nhashes binary digests back to back, in level order
+	uint8_t *hashes;
 	uint32_t nchunks;
-	Chunk *chunks;
+	// chunk table as a structure of arrays, the three arrays share
+	// one allocation owned by chunk_digests
+	uint8_t *chunk_digests;
+	uint32_t *chunk_offsets;
+	uint32_t *chunk_sizes;
+	// normally empty, see Bpkg_raw_hash
+	Bpkg_raw_hash *raw_hashes;
+	uint32_t nraw_hashes;
+	// a compiled manifest, whose arrays point into map instead of owning
+	// their memory, otherwise the text manifest kept until the sections
+	// are loaded
+	void *map;
+	size_t map_length;
+	int compiled;
+	// where the hashes: and chunks: sections start in the text manifest
+	size_t hashes_pos;
+	size_t chunks_pos;
+	// BPKG_SECTIONS_*, see bpkg_load_sections
+	atomic_int sections_state;
+	pthread_mutex_t sections_lock;
+	// digest to chunk table, built under sections_lock by the first
+	// bpkg_find_chunk, open addressed slots of chunk index + 1, 0 if empty
+	_Atomic(uint32_t *) chunk_index;
+	uint32_t chunk_index_mask;
+	// NULL before the tree is built and while it is evicted
 	Merkle_tree *merkle;
+	// set by bpkg_evict_merkle, the package was complete when evicted
+	int merkle_evicted;
+	// last time bpkg_merkle handed out the tree
+	time_t merkle_used;
+	// open data file while btide manages the package, read without a
+	// lock, see package/datafile.h
+	struct Package_file *_Atomic file;
+	// held by btide's package table and each transfer using the package,
+	// see package_get
+	atomic_int refs;
 } bpkg_obj;
 
+/**
+ * Heap bytes held by a package, see bpkg_memory_usage
+ * Compiled manifests and text manifests whose sections are not loaded yet
+ * are counted in mapped instead of hashes and chunks
+ */
+typedef struct
+{
+	size_t object;
+	// this package's share of the interned ident and filename
+	size_t strings;
+	size_t hashes;
+	size_t chunks;
+	size_t raw_hashes;
+	size_t tree;
+	size_t mapped;
+	// everything but mapped
+	size_t total;
+} Bpkg_memory;
+
+#define BPKG_SECTIONS_PENDING 0
+#define BPKG_SECTIONS_LOADED 1
+#define BPKG_SECTIONS_FAILED 2
+
+/**
+ * Checks and loads the hashes and chunks sections, bpkg_load only reads
+ * the header fields and notes where the sections start
+ * Safe to call from several threads, the sections are loaded once
+ * The accessors below may only be used after this has returned 0
+ * @return 0 on success, 1 if the sections are malformed or could not be
+ *     loaded
+ */
+int bpkg_load_sections(bpkg_obj *obj);
+
+// binary digest of the i-th non leaf hash in the manifest
+static inline const uint8_t *bpkg_hash_digest(const bpkg_obj *obj, 
+	uint32_t i)
+{
+	return obj->hashes + (size_t)i * SHA256_DIGEST_SZ;
+}
+
+// binary digest of the i-th chunk
+static inline const uint8_t *bpkg_chunk_digest(const bpkg_obj *obj, 
+	uint32_t i)
+{
+	return obj->chunk_digests + (size_t)i * SHA256_DIGEST_SZ;
+}
+
+static inline uint32_t bpkg_chunk_offset(const bpkg_obj *obj, uint32_t i)
+{
+	return obj->chunk_offsets[i];
+}
+
+static inline uint32_t bpkg_chunk_size(const bpkg_obj *obj, uint32_t i)
+{
+	return obj->chunk_sizes[i];
+}
+
+// null terminated hex string of the i-th non leaf hash
+void bpkg_hash_hex(const bpkg_obj *obj, uint32_t i, char out[HASHLENGTH]);
+
+// null terminated hex string of the i-th chunk hash
+void bpkg_chunk_hash_hex(const bpkg_obj *obj, uint32_t i, 
+	char out[HASHLENGTH]);
+
+/**
+ * Finds the chunk with the given hex hash, loading the sections if needed
+ * The first call builds a table of the chunk digests, later ones look the
+ * hash up in it rather than comparing against every chunk
+ * @return index of the chunk, or -1 if the package has no such chunk
+ */
+int64_t bpkg_find_chunk(bpkg_obj *obj, const char *hash);
+
+// builds bpkg_find_chunk's table ahead of the first lookup
+void bpkg_index_chunks(bpkg_obj *obj);
+
+/**
+ * Digest of the root hash, read straight from the manifest while the
+ * sections are not loaded, so it does not load them
+ * @return 0 on success, 1 if the root hash is not hex
+ */
+int bpkg_root_digest(bpkg_obj *obj, uint8_t digest[SHA256_DIGEST_SZ]);
+
 typedef struct
 {
 	int ident;
@@ -51,13 +180,61 @@ typedef struct
 } ParseFlags;
 
 /**
- * Loads the package for when a value path is given
+ * Loads the package for when a value path is given, either a text .bpkg
+ * or a compiled manifest (see chk/bpkgbin.h)
  */
 bpkg_obj *bpkg_load(const char *path);
 
+/**
+ * Threads used to parse the sections of large manifests, 0 (the default)
+ * uses one per cpu and 1 parses on the calling thread
+ */
+void bpkg_set_parse_threads(int nthreads);
+
+/**
+ * Replace the ident or filename, truncated to the manifest limits
+ * @return 0 on success, 1 if the string could not be interned
+ */
+int bpkg_set_ident(bpkg_obj *obj, const char *ident, size_t len);
+
+int bpkg_set_filename(bpkg_obj *obj, const char *filename, size_t len);
+
 // intialises the merkle tree
 int bpkg_intialise_merkle(bpkg_obj *obj);
 
+/**
+ * Tree of the package, rebuilt from the manifest digests if it was evicted
+ * @return tree, or NULL if it was never built or could not be rebuilt
+ */
+Merkle_tree *bpkg_merkle(bpkg_obj *obj);
+
+/**
+ * Treats a package known to be complete as if its tree had been evicted,
+ * so bpkg_merkle builds it from the manifest digests on first use
+ */
+void bpkg_defer_merkle(bpkg_obj *obj);
+
+/**
+ * Frees the tree of a complete package, every computed hash then equals
+ * the expected one so bpkg_merkle can rebuild it without reading the data
+ * @return 1 if the tree was evicted, 0 if the package is incomplete
+ */
+int bpkg_evict_merkle(bpkg_obj *obj);
+
+// true if the root computed hash matches the manifest, an evicted tree
+// counts as complete
+int bpkg_is_complete(bpkg_obj *obj);
+
+// fills in the heap bytes held by the package
+void bpkg_memory_usage(const bpkg_obj *obj, Bpkg_memory *mem);
+
+/**
+ * Intialises the merkle tree reporting progress through job, which can be
+ * cancelled from another thread; job may be NULL
+ * Like bpkg_intialise_merkle, obj is destroyed if this returns 1
+ */
+int bpkg_intialise_merkle_job(bpkg_obj *obj, Merkle_build_job *job);
+
 /**
  * Checks to see if the referenced filename in the bpkg file
  * exists or not.
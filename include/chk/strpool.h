@@ -0,0 +1,25 @@
+#ifndef STRPOOL_H
+#define STRPOOL_H
+
+#include <stddef.h>
+
+/**
+ * Process wide table of interned, reference counted strings
+ * Equal strings share one allocation sized to their length, so packages
+ * only pay for the idents and filenames they actually hold
+ * Every function is safe to call from several threads
+ */
+
+/**
+ * Interns the first len bytes of s, taking a reference
+ * @return shared null terminated copy, or NULL if allocation failed
+ */
+const char *strpool_intern(const char *s, size_t len);
+
+// drops a reference taken by strpool_intern, NULL is ignored
+void strpool_release(const char *s);
+
+// heap bytes of an interned string divided between its references
+size_t strpool_share(const char *s);
+
+#endif
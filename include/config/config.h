@@ -5,11 +5,28 @@
 
 #define MAXLINELENGTH 128
 
+// autoload value that scans the package directory itself
+#define AUTOLOAD_DIRECTORY "directory"
+
+#define DEFAULT_FETCH_WINDOW 64
+#define MAXFETCHWINDOW 4096
+
 typedef struct
 {
     char directory[MAXLINELENGTH];
     int max_peers;
     uint16_t port;
+    // optional, AUTOLOAD_DIRECTORY or a file listing one .bpkg per line,
+    // empty when packages are only added with ADDPACKAGE
+    char autoload[MAXLINELENGTH];
+    // optional, 1 saves the managed packages and their verified chunks
+    // under directory and restores them on startup (package/registry.h)
+    int persist;
+    // optional, number of network event loops (net/reactor.h), default 1
+    int reactors;
+    // optional, REQs kept outstanding per download (package/download.h),
+    // default DEFAULT_FETCH_WINDOW
+    int fetch_window;
 } Config;
 
 int parse_config(char *filename, Config *cfg);
@@ -6,6 +6,7 @@
 #define SHA256_CHUNK_SZ (64)
 #define SHA256_INT_SZ (8)
 #define SHA256_DFTLEN (1024)
+#define SHA256_DIGEST_SZ (32)
 
 //Original: https://github.com/LekKit/sha256/blob/master/sha256.h
 struct sha256_compute_data {
@@ -30,5 +31,15 @@ void sha256_finalize(struct sha256_compute_data* data,
 void sha256_output_hex(struct sha256_compute_data* data, 
 	char hexbuf[SHA256_CHUNK_SZ]);
 
+void sha256_output(struct sha256_compute_data* data, uint8_t* hash);
+
+// writes the 64 lowercase hex characters of a digest, not null terminated
+void sha256_digest_to_hex(const uint8_t digest[SHA256_DIGEST_SZ], 
+	char hexbuf[SHA256_CHUNK_SZ]);
+
+// parses 64 lowercase hex characters, returns 0 on success
+// hex must have 64 readable bytes, a shorter string fails at its null
+int sha256_hex_to_digest(const char* hex, uint8_t digest[SHA256_DIGEST_SZ]);
+
 #endif
 
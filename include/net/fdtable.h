@@ -0,0 +1,42 @@
+#ifndef NET_FDTABLE_H
+#define NET_FDTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/**
+ * A value per socket, indexed by fd, for the state every REQ served looks
+ * up (the agreed encoding, the send queue)
+ * Reads take no lock: the slots are atomic and the array they live in is
+ * only replaced when it grows, under the table's lock, and freed once no
+ * reader can still see it (pool/epoch.h)
+ */
+
+typedef struct Fd_slots Fd_slots;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    _Atomic(Fd_slots *) slots;
+} Fd_table;
+
+#define FD_TABLE_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, NULL }
+
+// the value stored for fd, 0 if none was
+uint64_t fd_table_get(Fd_table *table, int fd);
+
+/**
+ * Stores a value for fd, growing the table to fit it
+ * @return 0 on success, 1 if fd is negative or memory ran out
+ */
+int fd_table_set(Fd_table *table, int fd, uint64_t value);
+
+// one more than the highest fd a value can be stored for without growing
+size_t fd_table_size(Fd_table *table);
+
+// frees the table once nothing reads or writes it any more
+void fd_table_free(Fd_table *table);
+
+#endif
@@ -15,10 +15,10 @@
 #define PKT_MSG_PNG 0xFF
 #define PKT_MSG_POG 0x00
 
+// a connected peer, its socket is watched by a reactor (net/reactor.h)
 typedef struct
 {
     int socket;
-    pthread_t id;
     struct sockaddr_in address;
 } Peer;
 
@@ -0,0 +1,58 @@
+#ifndef NET_REACTOR_H
+#define NET_REACTOR_H
+
+#include <arpa/inet.h>
+#include <net/packet.h>
+#include <net/wire.h>
+
+#define MAXREACTORS 64
+
+/**
+ * Epoll event loops that own the listening socket and every peer socket
+ * Each reactor is one thread with its own epoll set, connections are spread
+ * over them round robin and their packets are handled on that thread
+ * Accepted connections are sent an ACP and only become peers once their
+ * ACK arrives
+ */
+typedef struct
+{
+    // an accepted connection sent its ACK, nonzero refuses it
+    int (*ready)(int socket, struct sockaddr_in address);
+    // a packet from a peer, nonzero closes the connection
+    int (*packet)(int socket, struct btide_packet *packet);
+    // a RES in a jumbo frame (net/wire.h), nonzero closes the connection
+    int (*res)(int socket, const Wire_res *res);
+    // a peer hung up, its socket stays open until it is disconnected
+    void (*hangup)(int socket);
+} Reactor_handlers;
+
+/**
+ * Starts nreactors event loops, pinned to one cpu each when there are
+ * several, the first also accepts on listen_fd
+ * @return 0 on success, 1 if they could not be started
+ */
+int reactor_start(int listen_fd, int nreactors,
+    const Reactor_handlers *handlers);
+
+// hands a connected peer, whose handshake is done, to a reactor
+int reactor_add(int socket);
+
+/**
+ * Closes a socket, asking its reactor to drop it first if it still watches
+ * it, safe to call from any thread
+ */
+void reactor_close(int socket);
+
+/**
+ * The socket's send queue (net/sendq.h) has frames, its reactor writes
+ * them once the socket is writable, safe to call from any thread
+ */
+void reactor_want_write(int socket);
+
+/**
+ * Stops and joins the reactors, peer sockets are left open for the caller
+ * to close, the listener is left open too
+ */
+void reactor_stop(void);
+
+#endif
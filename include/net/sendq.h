@@ -0,0 +1,65 @@
+#ifndef NET_SENDQ_H
+#define NET_SENDQ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Outbound queue of every peer socket, drained by the socket's reactor
+ * (net/reactor.h) when the socket is writable
+ * Pushing never blocks: frames are appended and the reactor is asked to
+ * write, batching whatever has queued up into one writev. File ranges are
+ * queued by descriptor and go out with sendfile
+ * A queue holding more than SENDQ_HIGH bytes makes its reactor stop
+ * reading from the peer until it is back under SENDQ_LOW, so a peer that
+ * reads slowly only holds back the REQs it sends itself
+ * Frames pushed as one call are never interleaved with another thread's
+ */
+
+// bytes queued for a socket before its reactor stops reading from it
+#define SENDQ_HIGH (4 * 1024 * 1024)
+// bytes it drains to before reading resumes
+#define SENDQ_LOW (1024 * 1024)
+
+// starts accepting frames for a socket, once a reactor watches it
+void sendq_open(int socket);
+
+/**
+ * Drops what is still queued for a socket about to be closed, later
+ * pushes are refused until it is opened again
+ */
+void sendq_close(int socket);
+
+/**
+ * Queues length bytes of data
+ * @return 0 on success, -1 if the socket is not open (errno is EPIPE) or
+ * memory ran out
+ */
+int sendq_push(int socket, const void *data, size_t length);
+
+/**
+ * Queues head, then length bytes of fd from position, then tail, done is
+ * called with arg once the file range is sent or dropped
+ * The file is padded with zeros if it turns out shorter
+ * @return 0 on success, -1 if the socket is not open or memory ran out,
+ * done has been called then
+ */
+int sendq_file(int socket, const void *head, size_t head_length, int fd,
+    off_t position, size_t length, const void *tail, size_t tail_length,
+    void (*done)(void *), void *arg);
+
+/**
+ * Writes as much of the queue as the socket takes without blocking, called
+ * by the reactor and at shutdown
+ * @return bytes still queued, or -1 if the socket failed and the queue was
+ * dropped
+ */
+long sendq_flush(int socket);
+
+// bytes queued for a socket
+size_t sendq_pending(int socket);
+
+// frees every queue once the reactors have stopped
+void sendq_free(void);
+
+#endif
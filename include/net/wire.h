@@ -0,0 +1,136 @@
+#ifndef NET_WIRE_H
+#define NET_WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <net/packet.h>
+
+/**
+ * Encoding of packets on a socket
+ * Legacy peers send every packet as a whole struct btide_packet. Peers that
+ * both advertise WIRE_COMPACT in the ACP/ACK handshake switch to compact
+ * frames instead, a Wire_header followed by only the payload bytes in use
+ * The handshake packets themselves are always sent at the legacy size
+ */
+
+// frames carry a length, trailing zeros of the payload are left out
+#define WIRE_COMPACT 0x1u
+// RES data may go past WIRE_RES_DATA in jumbo frames, needs WIRE_COMPACT
+#define WIRE_JUMBO 0x2u
+
+// peers answer have queries, see package/have.h
+#define WIRE_HAVE 0x4u
+
+// capabilities this build advertises
+#define WIRE_SUPPORTED (WIRE_COMPACT | WIRE_JUMBO | WIRE_HAVE)
+
+// RES data carried by a legacy packet
+#define WIRE_RES_DATA 2998
+// most RES data this build takes in one jumbo frame
+#define WIRE_JUMBO_DATA (1024 * 1024)
+
+/**
+ * Code of a jumbo RES frame, never sent to a legacy peer, its payload is the
+ * offset and size as uint32_t, the hash, the identifier then size bytes of
+ * data
+ */
+#define WIRE_MSG_JUMBO_RES 0x107
+
+/**
+ * Codes of the have set exchange, only sent to peers that agreed to
+ * WIRE_HAVE, the payload layouts are in package/have.h
+ */
+#define WIRE_MSG_HAVE_QUERY 0x108
+#define WIRE_MSG_HAVE_REPLY 0x109
+
+typedef struct
+{
+    uint16_t msg_code;
+    uint16_t error;
+    // payload bytes after the header
+    uint32_t length;
+} Wire_header;
+
+// largest frame either encoding produces, apart from jumbo RES frames
+#define WIRE_MAX_FRAME (sizeof(Wire_header) + PAYLOAD_MAX)
+
+// encoding agreed for a socket
+typedef struct
+{
+    uint32_t flags;
+    // most RES data per frame, WIRE_RES_DATA unless WIRE_JUMBO is agreed
+    uint32_t max_data;
+} Wire_mode;
+
+// the legacy encoding every socket starts in
+#define WIRE_LEGACY ((Wire_mode){ 0, WIRE_RES_DATA })
+// everything this build supports, what an ACP offers
+#define WIRE_LOCAL ((Wire_mode){ WIRE_SUPPORTED, WIRE_JUMBO_DATA })
+
+/**
+ * A received RES, from a packet or a jumbo frame, data points into the
+ * packet or the receive buffer and is only valid while it is handled
+ */
+typedef struct
+{
+    uint16_t error;
+    uint32_t offset;
+    uint32_t size;
+    const uint8_t *data;
+    char hash[65];
+    char ident[1025];
+} Wire_res;
+
+// writes the encoding offered or accepted into an ACP or ACK payload
+void wire_hello(struct btide_packet *packet, Wire_mode mode);
+
+/**
+ * The encoding in a received ACP or ACK, limited to what this build
+ * supports, WIRE_LEGACY from a legacy peer
+ */
+Wire_mode wire_hello_mode(const struct btide_packet *packet);
+
+// records the encoding agreed for a socket
+void wire_set_mode(int socket, Wire_mode mode);
+
+// the encoding agreed for a socket, looked up without a lock
+Wire_mode wire_mode(int socket);
+
+/**
+ * Encodes a packet into out, which holds at least WIRE_MAX_FRAME bytes
+ * @return number of bytes to send
+ */
+size_t wire_encode(const struct btide_packet *packet, const Wire_mode *mode,
+    uint8_t *out);
+
+/**
+ * Length of the first frame of len buffered bytes, so a receive buffer can
+ * grow to hold it
+ * @return frame length, 0 if its header is not complete yet, -1 if it is
+ * malformed
+ */
+long wire_frame_length(const uint8_t *in, size_t len, const Wire_mode *mode);
+
+/**
+ * Decodes the first frame of len buffered bytes, a jumbo RES is decoded
+ * into res instead and packet only gets its WIRE_MSG_JUMBO_RES code
+ * @return bytes used, 0 if the frame is not complete yet, -1 if it is
+ * malformed
+ */
+long wire_decode(const uint8_t *in, size_t len, const Wire_mode *mode,
+    struct btide_packet *packet, Wire_res *res);
+
+// reads the fields of a RES packet
+void wire_res(const struct btide_packet *packet, Wire_res *res);
+
+/**
+ * Encodes a RES whose length bytes of data are sent separately, e.g. with
+ * sendfile, as before, the data, then after, both buffers hold at least
+ * WIRE_MAX_FRAME bytes, the packet's data is ignored, length is at most
+ * mode->max_data and goes in a jumbo frame past WIRE_RES_DATA
+ */
+void wire_split_res(const struct btide_packet *packet, uint32_t length,
+    const Wire_mode *mode, uint8_t *before, size_t *before_length,
+    uint8_t *after, size_t *after_length);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef PACKAGE_DATAFILE_H
+#define PACKAGE_DATAFILE_H
+
+#include <stdatomic.h>
+#include <chk/pkgchk.h>
+
+/**
+ * One open descriptor per managed package's data file, opened when the
+ * package is registered and closed when it is removed, rather than opened
+ * for every REQ served and every chunk received
+ * Transfers only use positional I/O (pread, pwrite, sendfile with an
+ * offset) so any number of reactor threads can share it. Each holds a
+ * reference while it uses the descriptor, so removing the package while
+ * transfers are in flight only closes it once the last one is done
+ * Taking a reference is lock free, so REQs served on every reactor do not
+ * contend for it
+ */
+typedef struct Package_file
+{
+    int fd;
+    // the package's own reference plus one per transfer using it
+    atomic_int refs;
+} Package_file;
+
+/**
+ * Opens the data file of a package being registered for reading and
+ * writing
+ * @return 0 on success, 1 if it could not be opened
+ */
+int datafile_open(bpkg_obj *obj);
+
+// the package's open file with a reference taken, NULL if it has none,
+// takes no lock
+Package_file *datafile_get(bpkg_obj *obj);
+
+// takes another reference on a file that is already held
+void datafile_hold(Package_file *file);
+
+// gives back a reference from datafile_get or datafile_hold
+void datafile_put(Package_file *file);
+
+/**
+ * Detaches the open file from a package being removed, it is closed once
+ * the transfers still using it put it back
+ */
+void datafile_close(bpkg_obj *obj);
+
+#endif
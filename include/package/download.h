@@ -0,0 +1,83 @@
+#ifndef PACKAGE_DOWNLOAD_H
+#define PACKAGE_DOWNLOAD_H
+
+#include <stdint.h>
+#include <chk/pkgchk.h>
+
+/**
+ * Download engine behind FETCH, it spreads the chunks of a package over
+ * every peer in the download, rarest first, keeping up to a window of REQs
+ * outstanding to each and sending the next as each chunk arrives
+ * Chunks that time out or arrive corrupted are requested again, a peer's
+ * window shrinks when it lets REQs time out and, once nothing is left to
+ * hand out, idle peers also request what slow peers still hold
+ * Peers that agreed to WIRE_HAVE are first asked which chunks they have, so
+ * none is requested from a peer that lacks it
+ * The received, refused and peer calls come from the reactor threads,
+ * download_tick from the command thread
+ */
+
+// seconds a REQ may go unanswered before the chunk is requested again
+#define DOWNLOAD_TIMEOUT 10
+// times a chunk is requested before the download gives up on it
+#define DOWNLOAD_ATTEMPTS 3
+
+// REQs kept outstanding by each download, see Config.fetch_window
+void download_set_window(int window);
+
+/**
+ * Starts fetching chunks of obj from the peers on sockets, chunks holds
+ * count chunk indices in increasing order and is freed by the download
+ * A quiet download stays with the peers it starts with and does not report
+ * when it finishes, as for the FETCH of a single chunk, other downloads
+ * also take in peers that connect later
+ * @return 0 on success, 1 if it could not be started
+ */
+int download_start(bpkg_obj *obj, const int *sockets, int nsockets,
+    uint32_t *chunks, uint32_t count, int quiet);
+
+// 1 if obj has a download that is not quiet
+int download_active(const bpkg_obj *obj);
+
+/**
+ * The last piece of chunk arrived from socket and was hashed, every
+ * download of obj is done with it if it matched
+ */
+void download_chunk_received(bpkg_obj *obj, int socket, uint32_t chunk,
+    int verified);
+
+/**
+ * The peer on socket answered a REQ for chunk with an error RES, the other
+ * peers in the download are asked instead
+ * @return 1 if a download that reports when it finishes took the refusal
+ */
+int download_chunk_refused(bpkg_obj *obj, int socket, uint32_t chunk);
+
+// 1 if a download of obj awaits have answers from the peer on socket
+int download_peer_probing(bpkg_obj *obj, int socket);
+
+/**
+ * The peer on socket answered a have query for obj (see package/have.h),
+ * it has none of the chunks in the nranges first and last chunk pairs of
+ * ranges and queries more were sent to look further down its tree
+ * A peer that can answer have queries is sent REQs once all are answered
+ */
+void download_peer_lacks(bpkg_obj *obj, int socket, const uint32_t *ranges,
+    int nranges, int queries);
+
+/**
+ * Requests timed out chunks again, puts the chunks still to hand out
+ * rarest first and reports finished downloads
+ */
+void download_tick(void);
+
+// a peer connected, it joins every download that is not quiet
+void download_peer_joined(int socket);
+
+// a peer disconnected, others take over the chunks it was asked for
+void download_peer_left(int socket);
+
+// drops the downloads of a package before it is removed
+void download_cancel_package(bpkg_obj *obj);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef PACKAGE_HAVE_H
+#define PACKAGE_HAVE_H
+
+#include <stdint.h>
+#include <chk/pkgchk.h>
+#include <net/packet.h>
+
+/**
+ * Have set exchange between peers that agreed to WIRE_HAVE
+ * A peer joining a download is asked what it has of the root of the
+ * package's tree, it answers none, all or part of it for each node asked,
+ * as bpkg_get_min_completed_hashes would, and the asking side descends
+ * only into the nodes held in part that it is missing itself. A peer that
+ * differs in d chunks is so learnt in about d times the tree's height of
+ * nodes, in batches of up to HAVE_BATCH per round trip
+ *
+ * Nodes are named by their index in the block of the package's tree, which
+ * merkle_tree_link lays out the same way for every peer
+ * A WIRE_MSG_HAVE_QUERY payload is a uint16_t count, count uint32_t nodes
+ * then the identifier, a WIRE_MSG_HAVE_REPLY has a MERKLE_HAVE_* byte after
+ * each node
+ */
+
+// most nodes in one have packet
+#define HAVE_BATCH 600
+
+// longest identifier a have packet carries, without the null
+#define HAVE_IDENT 1024
+
+// reads the identifier of a have packet into ident, of HAVE_IDENT + 1
+void have_ident(const struct btide_packet *packet, char *ident);
+
+/**
+ * Asks the peer on socket what it has of obj, the answers go to
+ * download_peer_lacks
+ * @return 0 on success, 1 if obj has no tree to ask about
+ */
+int have_start(int socket, bpkg_obj *obj);
+
+// answers a have query for obj, NULL if the package is unknown
+void have_answer(int socket, bpkg_obj *obj,
+    const struct btide_packet *packet);
+
+// takes in the answer to a have query for obj and asks further down
+void have_reply(int socket, bpkg_obj *obj,
+    const struct btide_packet *packet);
+
+#endif
@@ -1,4 +1,6 @@
+#include <stdio.h>
 #include <chk/pkgchk.h>
+#include <config/config.h>
 
 void handle_add_package(char command[], int *current_length, 
     int *max_size, bpkg_obj ***list, char directory[]);
@@ -9,6 +11,94 @@ void handle_remove_package(char command[], int *current_length,
 void handle_view_package(char command[], int *current_length, 
     int *max_size, bpkg_obj **list);
 
-bpkg_obj *check_ident(char ident[], int current_length, bpkg_obj **list);
+void handle_progress(char command[]);
 
-Chunk *request_hash(char hash[], bpkg_obj *obj);
+void handle_memory(char command[], int *current_length, bpkg_obj **list);
+
+void evict_idle_trees(int current_length, bpkg_obj **list);
+
+void reap_package_builds(int *current_length, int *max_size, 
+    bpkg_obj ***list);
+
+void cancel_package_builds(void);
+
+/**
+ * Starts loading the packages saved by the registry (see
+ * package/registry.h) and the ones named by cfg->autoload on a worker pool,
+ * reap_package_scan registers them as they become ready
+ * @return 0 on success or when autoload is not set
+ */
+int start_package_scan(Config *cfg);
+
+void reap_package_scan(int *current_length, int *max_size, 
+    bpkg_obj ***list);
+
+/**
+ * Managed package with exactly this identifier, with a reference taken
+ * that package_put gives back, NULL if there is none
+ * Looked up in a hash table without taking any lock, reactor threads call
+ * it for every packet, ident may be the full MAXIDENTLENGTH bytes without
+ * a null. A package removed while a transfer holds a reference is only
+ * freed once it is put back
+ */
+bpkg_obj *package_get(const char ident[]);
+
+// takes another reference on a package that is already held
+void package_hold(bpkg_obj *obj);
+
+// gives back a reference, the last one frees the package
+void package_put(bpkg_obj *obj);
+
+// empties the identifier table once every package is put back
+void package_index_clear(void);
+
+// bpkg_is_complete under the lock received chunks update the tree with
+int package_is_complete(bpkg_obj *obj);
+
+/**
+ * Sets the bit of every chunk whose data matches the manifest in bitmap,
+ * which has room for nchunks bits and starts zeroed
+ * @return 0 on success, 1 if the tree could not be built
+ */
+int package_verified_chunks(bpkg_obj *obj, uint8_t *bitmap);
+
+int64_t request_hash(char hash[], bpkg_obj *obj);
+
+/**
+ * Writes a received chunk whose digest matches the manifest into the
+ * package's file, then records it in the package's tree and the registry,
+ * which syncs the file in batches, see package/receive.h
+ * @return 1 if the chunk was written, 0 if it could not be
+ */
+int package_commit_chunk(bpkg_obj *obj, uint32_t chunk, const uint8_t *data,
+    const uint8_t digest[SHA256_DIGEST_SZ]);
+
+/**
+ * Chunks under the node with hash, or every chunk if hash is NULL, whose
+ * data does not match the manifest yet
+ * @return 0 with the indices in order in *chunks to free (NULL if none),
+ * 1 if the hash is not in the package or its tree is not built
+ */
+int package_missing_chunks(bpkg_obj *obj, const char *hash, 
+    uint32_t **chunks, uint32_t *count);
+
+/**
+ * Have set exchange, see package/have.h, nodes are named by their index in
+ * the block of the package's tree, the same in every peer's tree
+ * @return index of the root, -1 if the tree is not built
+ */
+int64_t package_have_root(bpkg_obj *obj);
+
+// what this side has under each of count nodes, MERKLE_HAVE_* into have
+void package_have(bpkg_obj *obj, const uint32_t *nodes, uint8_t *have,
+    int count);
+
+/**
+ * Reads a peer's answer for count nodes: the first and last chunk under
+ * each node it has none of go in pairs into lacking, the children of those
+ * it has in part go into next unless this side already has them
+ * next has room for 2 * count nodes, lacking for count pairs
+ */
+void package_have_reply(bpkg_obj *obj, const uint32_t *nodes,
+    const uint8_t *have, int count, uint32_t *next, int *nnext,
+    uint32_t *lacking, int *nlacking);
@@ -0,0 +1,59 @@
+#ifndef PACKAGE_RECEIVE_H
+#define PACKAGE_RECEIVE_H
+
+#include <stdint.h>
+#include <chk/pkgchk.h>
+
+/**
+ * Receive path for RES data. The slices of a chunk from one peer are
+ * gathered in memory and hashed as they arrive. The chunk reaches the
+ * package's file only once its digest matches the manifest, so corrupt data
+ * never overwrites what is on disk and nothing is read back to verify it
+ * A slice out of order drops what the peer sent of that chunk so far, the
+ * download requests it again once the REQ times out
+ * Slices from one socket come in on one reactor thread. A chunk that matched
+ * is written by a pool of writer threads, which tell the download, so the
+ * reactor goes back to its sockets rather than waiting on the disk
+ */
+
+// writer threads committing verified chunks
+#define RECEIVE_WRITERS 4
+// bytes of chunks waiting for a writer before reactors write them themselves
+#define RECEIVE_QUEUE_MAX (64 * 1024 * 1024)
+
+// the chunk still needs more slices, or its slices were dropped
+#define RECEIVE_PENDING (-1)
+// the chunk did not match the manifest and was discarded
+#define RECEIVE_CORRUPT 0
+// the chunk matched and is on disk
+#define RECEIVE_COMMITTED 1
+// the chunk matched and was handed to a writer, which reports it to the
+// download with download_chunk_received
+#define RECEIVE_QUEUED 2
+
+/**
+ * Starts the writer threads, until then chunks are written by the thread
+ * that received them
+ * @return 0 on success, 1 if the threads could not be started
+ */
+int receive_start(void);
+
+// writes the chunks still queued and stops the writer threads
+void receive_stop(void);
+
+/**
+ * Takes in size bytes of chunk at offset in the package's file, received
+ * from the peer on socket
+ * @return RECEIVE_PENDING, or RECEIVE_CORRUPT, RECEIVE_COMMITTED or
+ * RECEIVE_QUEUED once the chunk's last slice is in
+ */
+int receive_slice(bpkg_obj *obj, int socket, uint32_t chunk,
+    uint32_t offset, const uint8_t *data, uint32_t size);
+
+// drops the chunks a peer was part way through sending
+void receive_drop_socket(int socket);
+
+// drops every chunk being received for a package before it is removed
+void receive_drop_package(bpkg_obj *obj);
+
+#endif
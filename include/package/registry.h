@@ -0,0 +1,66 @@
+#ifndef PACKAGE_REGISTRY_H
+#define PACKAGE_REGISTRY_H
+
+#include <stdint.h>
+#include <chk/pkgchk.h>
+
+/**
+ * Persisted list of managed packages and their verified chunks, kept in
+ * REGISTRY_DIRECTORY under the package directory so a restart can restore
+ * both without hashing the data files again
+ * Every function does nothing until registry_open succeeds and is safe to
+ * call from the peer threads
+ */
+
+#define REGISTRY_DIRECTORY ".btide"
+// verified chunks a package collects before its data file is synced
+#define REGISTRY_SYNC_CHUNKS 256
+
+/**
+ * Enables the registry, reading the packages saved by the last run
+ * @return 0 on success, 1 if the state directory cannot be created
+ */
+int registry_open(const char *directory);
+
+// file listing the saved manifests one per line, NULL if there are none
+const char *registry_manifests(void);
+
+/**
+ * Bitmap of the chunks recorded as verified, only if the data file still
+ * has the size, inode, mtime and ctime it was stamped with after the last
+ * sync (see Merkle_build_job.verified)
+ * @return bitmap to free, or NULL if every chunk has to be hashed
+ */
+uint8_t *registry_verified_chunks(bpkg_obj *obj);
+
+// records a newly managed package with the chunks its tree has complete
+void registry_add(bpkg_obj *obj, const char *manifest);
+
+// forgets a package before it is destroyed
+void registry_remove(bpkg_obj *obj);
+
+// drops saved packages that were not restored by the startup scan
+void registry_drop_pending(void);
+
+// clears the chunk's verified bit before its data is overwritten
+void registry_chunk_written(bpkg_obj *obj, uint32_t chunk);
+
+/**
+ * Records the result of hashing a received chunk written to the held
+ * package's data file. A mismatch clears the chunk's bit at once. A match
+ * is batched, its bit is set once the data file has been synced, by
+ * registry_sync or when REGISTRY_SYNC_CHUNKS matches are waiting
+ */
+void registry_chunk_checked(bpkg_obj *obj, uint32_t chunk, int verified);
+
+// syncs the data files with batched chunks and records them, called on
+// the command thread's tick
+void registry_sync(void);
+
+/**
+ * Syncs and stamps every data file and closes the state files, they are
+ * kept for the next run. Called once nothing writes to the data files
+ */
+void registry_close(void);
+
+#endif
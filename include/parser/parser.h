@@ -4,5 +4,4 @@
 
 void handle_connect(char command[], char ip[], int *port, Config *cfg);
 
-void handle_disconnect(char command[], char ip[], int *port, 
-    pthread_mutex_t *peer_list_lock, int *peer_count, Peer *peer_list);
\ No newline at end of file
+void handle_disconnect(char command[], char ip[], int *port);
\ No newline at end of file
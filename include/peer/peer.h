@@ -1,27 +1,56 @@
 #include "config/config.h"
 #include <pthread.h>
 #include <net/packet.h>
+#include <net/wire.h>
+#include <package/datafile.h>
 
 void send_dsn_packet(int socket);
 
 void send_pog_packet(int socket);
 
+// the handshake packets are written straight to the socket, only before a
+// reactor watches it
 void send_acp_packet(int socket);
 
-void send_ack_packet(int socket);
+void send_ack_packet(int socket, Wire_mode mode);
 
 void send_png_packet(int socket);
 
-void send_req_packet(int socket, const char *identifier, 
+/**
+ * Queues a REQ for a chunk
+ * @return 0 on success, -1 if it could not be queued, e.g. the peer hung up
+ */
+int send_req_packet(int socket, const char *identifier, 
     const char *chunk_hash, uint32_t offset, uint32_t size);
 
+/**
+ * Sends a have query, or a reply if have is given, for count nodes of the
+ * package, count is at most HAVE_BATCH, see package/have.h
+ */
+void send_have_packet(int socket, const char *identifier,
+    const uint32_t *nodes, const uint8_t *have, uint16_t count);
+
+/**
+ * Blocks until one whole packet has been read, for handshakes on sockets
+ * no reactor watches yet
+ * @return 0 on success, -1 on error or if the peer hung up
+ */
+int recv_packet(int socket, struct btide_packet *packet);
+
 void send_res_packet(int socket, const char *identifier, 
     const char *chunk_hash, uint32_t offset, const char* buffer, 
     uint16_t read, uint16_t error);
 
-void handle_peers(pthread_mutex_t peer_list_lock, 
-    int* peer_count, Peer *peer_list);
-
-void *handle_connection(void *arg);
+/**
+ * Queues a RES packet carrying length bytes of a package's file from
+ * position, moved with sendfile rather than read into a buffer, length is
+ * at most the socket's Wire_mode.max_data
+ * @return 0 on success, -1 if the socket is closed
+ */
+int send_res_file(int socket, const char *identifier, const char *chunk_hash,
+    uint32_t offset, Package_file *file, off_t position, uint32_t length);
+
+// lists up to max_peers connected peers and pings each
+void handle_peers(int max_peers);
 
 int connect_to_peer(const char *ip, int port);
@@ -0,0 +1,55 @@
+#ifndef PEER_PEERTABLE_H
+#define PEER_PEERTABLE_H
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <net/packet.h>
+
+/**
+ * Connected peers, each in a slot that stays put until the peer leaves
+ * A peer is named by a Peer_id, its slot and the generation the slot was
+ * filled in, so an id kept after the peer left no longer matches once
+ * the slot is reused. Peers are found by binary address and port through
+ * a hash index, and by socket through a table indexed by fd
+ * Every call is safe from any thread
+ */
+
+// slot in the low 32 bits, generation above, 0 is never a peer
+typedef uint64_t Peer_id;
+
+/**
+ * Makes room for max_peers peers
+ * @return 0 on success, 1 if it could not be allocated
+ */
+int peer_table_init(int max_peers);
+
+void peer_table_free(void);
+
+/**
+ * Adds a connected peer
+ * @return its id, 0 if the table is full or the address is already a peer
+ */
+Peer_id peer_table_add(int socket, struct sockaddr_in address);
+
+/**
+ * Removes a peer, copying it to peer if that is not NULL
+ * @return 0 on success, 1 if the id is stale because the peer already left
+ */
+int peer_table_remove(Peer_id id, Peer *peer);
+
+// the peer with this address and port (host order), 0 if there is none
+Peer_id peer_table_find(struct in_addr address, uint16_t port);
+
+// the peer on a socket, 0 if there is none
+Peer_id peer_table_socket(int socket);
+
+// copies out a peer, 1 if the id is stale
+int peer_table_get(Peer_id id, Peer *peer);
+
+/**
+ * Copies up to max peers, in slot order, into peers
+ * @return how many were copied
+ */
+int peer_table_list(Peer *peers, int max);
+
+#endif
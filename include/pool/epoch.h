@@ -0,0 +1,23 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/**
+ * Epoch based reclamation for data read without locks
+ * A reader brackets its reads with epoch_enter and epoch_exit, which only
+ * store to a slot of its own thread. A writer that has unpublished
+ * something calls epoch_synchronize before freeing it, which waits until
+ * every reader that could still see it has left
+ * Read sections must be short and must not nest
+ */
+
+// slots for reader threads, more readers share a slower counter
+#define EPOCH_SLOTS 128
+
+void epoch_enter(void);
+
+void epoch_exit(void);
+
+// waits for the readers that entered before the call to exit
+void epoch_synchronize(void);
+
+#endif
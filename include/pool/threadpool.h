@@ -0,0 +1,51 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+typedef void (*pool_task_fn)(void *arg);
+
+typedef struct Pool_task
+{
+    pool_task_fn fn;
+    void *arg;
+    struct Pool_task *next;
+} Pool_task;
+
+/**
+ * Fixed size pool of worker threads pulling tasks off a FIFO queue
+ */
+typedef struct
+{
+    pthread_t *threads;
+    int nthreads;
+    Pool_task *head;
+    Pool_task *tail;
+    // tasks queued or currently running
+    size_t pending;
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t all_done;
+} Thread_pool;
+
+// number of online cpus, at least 1
+int pool_default_threads(void);
+
+/**
+ * Creates a pool with nthreads workers, nthreads <= 0 uses one per cpu
+ * @return pool, or NULL if the threads could not be started
+ */
+Thread_pool *pool_create(int nthreads);
+
+// queues fn(arg) to run on a worker, returns 0 on success
+int pool_submit(Thread_pool *pool, pool_task_fn fn, void *arg);
+
+// blocks until every submitted task has finished running
+void pool_wait(Thread_pool *pool);
+
+// finishes queued tasks, joins the workers and frees the pool
+void pool_destroy(Thread_pool *pool);
+
+#endif
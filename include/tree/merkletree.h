@@ -2,33 +2,172 @@
 #define MERKLE_TREE_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
 // forward declaration due to circular dependency
 typedef struct bpkg_obj bpkg_obj;
 typedef struct bpkg_query bpkg_query;
 #define SHA256_HEXLEN (64)
+#define MERKLE_DIGEST_SZ (32)
+// chunks hashed between checks of the cancellation token
+#define MERKLE_JOB_BATCH (64)
+// Merkle_tree_node.expected of a node the manifest has no hash for
+#define MERKLE_NO_EXPECTED UINT32_MAX
 
+/**
+ * Tree node, the expected hash is not copied out of the package but
+ * referenced by index: below nhashes it is that non leaf hash, from there
+ * on chunk (expected - nhashes)
+ */
 typedef struct Merkle_tree_node
 {
     struct Merkle_tree_node *left;
     struct Merkle_tree_node *right;
+    uint32_t expected;
     int is_leaf;
-    char expected_hash[SHA256_HEXLEN + 1];
-    char computed_hash[SHA256_HEXLEN + 1];
+    uint8_t computed_hash[MERKLE_DIGEST_SZ];
 } Merkle_tree_node;
 
 typedef struct
 {
     Merkle_tree_node *root;
     size_t n_nodes;
+    // every node lives in this one block of 2 * nchunks - 1 nodes
+    Merkle_tree_node *nodes;
+    size_t nodes_used;
+    size_t nodes_size;
 } Merkle_tree;
 
-Merkle_tree_node *create_merkle_tree_node(const char *hash, int is_leaf);
+/**
+ * Progress and cancellation state of a tree build, the counters are updated
+ * by the building thread(s) and can be read from any other thread
+ */
+typedef struct
+{
+    _Atomic uint64_t bytes_hashed;
+    _Atomic uint32_t chunks_hashed;
+    uint64_t bytes_total;
+    uint32_t chunks_total;
+    // cancellation token, checked every MERKLE_JOB_BATCH chunks
+    atomic_int cancelled;
+    struct timespec started;
+    // optional bitmap of chunks already known to match the manifest, bit
+    // i % 8 of byte i / 8, their leaves take the manifest digest unread
+    const uint8_t *verified;
+} Merkle_build_job;
+
+// snapshot of a build job taken by merkle_job_progress
+typedef struct
+{
+    uint64_t bytes_hashed;
+    uint64_t bytes_total;
+    uint32_t chunks_hashed;
+    uint32_t chunks_total;
+    double elapsed;
+    // seconds remaining, negative while still unknown
+    double eta;
+} Merkle_progress;
+
+void merkle_job_init(Merkle_build_job *job, bpkg_obj *obj);
+
+void merkle_job_cancel(Merkle_build_job *job);
+
+int merkle_job_cancelled(Merkle_build_job *job);
+
+// called by the builders after every leaf has been hashed
+void merkle_job_chunk_done(Merkle_build_job *job, uint32_t size);
+
+void merkle_job_progress(Merkle_build_job *job, Merkle_progress *progress);
+
+// true if the job's verified bitmap has chunk i, job may be NULL
+int merkle_job_chunk_verified(Merkle_build_job *job, uint32_t i);
+
+/**
+ * Allocates a tree with room for every node over nchunks leaves, the
+ * first nchunks nodes are meant for the leaves
+ * @return tree without a root, or NULL on allocation failure
+ */
+Merkle_tree *merkle_tree_alloc(uint32_t nchunks);
+
+// takes the next unused node out of the tree's block
+Merkle_tree_node *merkle_tree_node(Merkle_tree *tree, uint32_t expected, 
+    int is_leaf);
 
 void compute_parent_hash(Merkle_tree_node *node);
 
+/**
+ * Pairs up the nchunks leaves at the start of the block level by level,
+ * carrying an odd node up, then assigns the manifest hashes in level order
+ * Used by both builders once every leaf hash is computed
+ */
+int merkle_tree_link(Merkle_tree *tree, bpkg_obj *obj);
+
+/**
+ * Rebuilds the tree of a complete package from its manifest digests, with
+ * every computed hash set to the expected one
+ */
+Merkle_tree *merkle_tree_from_digests(bpkg_obj *obj);
+
+// null terminated expected hash, empty if the manifest has none
+void merkle_expected_hex(const bpkg_obj *obj, const Merkle_tree_node *node, 
+    char out[SHA256_HEXLEN + 1]);
+
+// true if the computed hash matches the expected hash
+int merkle_node_complete(const bpkg_obj *obj, const Merkle_tree_node *node);
+
+/**
+ * Replaces the computed hash of leaf i (the i-th chunk) and recomputes
+ * every ancestor on its path to the root
+ */
+void merkle_tree_set_leaf(Merkle_tree *tree, uint32_t i, 
+    const uint8_t digest[MERKLE_DIGEST_SZ]);
+
+// node whose expected hash is the hex hash, NULL if the tree has none
+Merkle_tree_node *merkle_tree_find(const bpkg_obj *obj, Merkle_tree *tree,
+    const char *hash);
+
+/**
+ * Writes the indices of the chunks under node whose computed hash does not
+ * match the manifest yet into chunks, in order, room for every chunk under
+ * node is needed
+ * @return number of chunks written
+ */
+uint32_t merkle_tree_missing(const bpkg_obj *obj, const Merkle_tree *tree,
+    const Merkle_tree_node *node, uint32_t *chunks);
+
+// first and last chunk under node
+void merkle_tree_leaves(const Merkle_tree *tree, const Merkle_tree_node *node,
+    uint32_t *first, uint32_t *last);
+
+// how much of a subtree matches the manifest, see merkle_tree_have
+#define MERKLE_HAVE_NONE 0
+#define MERKLE_HAVE_FULL 1
+#define MERKLE_HAVE_PARTIAL 2
+// not known, e.g. the tree is not built
+#define MERKLE_HAVE_UNKNOWN 3
+
+/**
+ * Whether none, all or only some of the chunks under node match the
+ * manifest, a complete node answers at once, otherwise its leaves are
+ * scanned until both kinds are seen
+ */
+int merkle_tree_have(const bpkg_obj *obj, const Merkle_tree *tree,
+    const Merkle_tree_node *node);
+
+// heap bytes of the tree
+size_t merkle_tree_memory(const Merkle_tree *tree);
+
 Merkle_tree *intialise_merkle_tree(bpkg_obj *obj);
 
-void destroy_merkle_tree(Merkle_tree_node *node);
+/**
+ * Same as intialise_merkle_tree but reports progress through job and stops
+ * early, freeing everything built so far, once the job is cancelled
+ * job may be NULL
+ */
+Merkle_tree *intialise_merkle_tree_job(bpkg_obj *obj, Merkle_build_job *job);
+
+void destroy_merkle_tree(Merkle_tree *tree);
 
 char **levelOrderTraversal(bpkg_obj *bpkg);
 
@@ -6,6 +6,7 @@
 # https://stackoverflow.com/questions/10523415/execute-command-on-all-files-in-a-directory
 
 PKGMAIN="../../pkgmain"
+PKGBUILD="../../pkgbuild"
 # need to go inside this directory first
 cd p1tests
 # loops over all the tests in the directory
@@ -37,6 +38,20 @@ for testdir in $test_dirs; do
             FLAG="-hashes_of 4953053bbaf5f5ab3de26242fa78610aaa7ffb7957c0bb45247228fffdf54166"
         elif [[ "$testdir" == "test13" || "$testdir" == "test14" ]]; then
             FLAG="-file_check"
+        elif [[ "$testdir" == "test15" ]]; then
+            # batch mode takes a list of packages instead of a single .bpkg
+            BPKGFILE="${testdir}.txt"
+            FLAG="-batch -j 4 -min_hashes -chunk_check"
+        elif [[ "$testdir" == "test16" ]]; then
+            # same package as test8, queried through its compiled manifest
+            "$PKGMAIN" "$BPKGFILE" -compile "${testdir}.bpkgb"
+            BPKGFILE="${testdir}.bpkgb"
+            FLAG="-chunk_check"
+        elif [[ "$testdir" == "test17" ]]; then
+            # the expected output is the manifest resources/pkgmake wrote
+            # for this data file with the time seeded to 12345
+            "$PKGBUILD" "${testdir}.dat" --nchunks 8 --seed 12345 --output "$BPKGFILE"
+            FLAG="-manifest"
         else
             FLAG="-all_hashes"
         fi
@@ -44,7 +59,11 @@ for testdir in $test_dirs; do
         # if file exists
         if [ -x "$PKGMAIN" ]; then
             # run file with flag -all_hashes
-            OUTPUT=$("$PKGMAIN" "$BPKGFILE" $FLAG)
+            if [[ "$FLAG" == "-manifest" ]]; then
+                OUTPUT=$(cat "$BPKGFILE")
+            else
+                OUTPUT=$("$PKGMAIN" "$BPKGFILE" $FLAG)
+            fi
             echo "$PKGMAIN" "$BPKGFILE" $FLAG
             echo "$OUTPUT" > temp_output.txt
             diff temp_output.txt "$OUTFILE" > /dev/null
@@ -60,6 +79,9 @@ for testdir in $test_dirs; do
             if [[ "$testdir" == "test13" ]]; then
                 rm nonexistent.dat
             fi
+            if [[ "$testdir" == "test16" || "$testdir" == "test17" ]]; then
+                rm "$BPKGFILE"
+            fi
         else
             # something went wrong
             echo "Error: '$PKGMAIN' does not exist or is not executable."
@@ -11,4 +11,8 @@
 cd p2tests/test1
 python3 test1.py
 cd ../test2
-python3 test2.py
\ No newline at end of file
+python3 test2.py
+cd ../test3
+python3 test3.py
+cd ../test4
+python3 test4.py
@@ -0,0 +1,83 @@
+# USYD CODE CITATION ACKNOWLEDGEMENT
+# I declare that the majority of the python3 script and inspiration comes from the following two links
+# https://stackoverflow.com/questions/12605498/how-to-use-subprocess-popen-python
+# https://stackoverflow.com/questions/89228/how-do-i-execute-a-program-or-call-a-system-command
+
+# a peer connects in to a node that is already fetching: the leecher asks a
+# peer that has stopped answering, then the seeder connects to the leecher,
+# joins the download and has to send every chunk
+
+import subprocess
+import filecmp
+import os
+import re
+import signal
+import tempfile
+import time
+
+IDENT = open('file1.bpkg').readline().split(':')[1].strip()
+
+def run_btide(config_file, output_file):
+    outfile = open(output_file, 'w')
+    return subprocess.Popen(['../../btide', config_file], stdin=subprocess.PIPE,
+        stdout=outfile, stderr=subprocess.DEVNULL, text=True)
+
+def command(process, line, wait=0.5):
+    process.stdin.write(line + '\n')
+    process.stdin.flush()
+    time.sleep(wait)
+
+def compare_output(output, expected):
+    # the time a download took changes from run to run
+    with open(output) as f:
+        text = re.sub(r' in [0-9.]+s$', ' in <time>', f.read(), flags=re.M)
+    with open(expected) as f:
+        matched = text == f.read()
+    if matched:
+        print(f"The outputs match for {output} and {expected}!")
+    else:
+        print(f"The outputs do not match for {output} and {expected}.")
+
+def compare_data(file1, file2):
+    if filecmp.cmp(file1, file2, shallow=False):
+        print(f"The data matches for {file1} and {file2}!")
+    else:
+        print(f"The data does not match for {file1} and {file2}.")
+
+def main():
+    os.makedirs('fetched', exist_ok=True)
+    if os.path.exists('fetched/file1.data'):
+        os.remove('fetched/file1.data')
+    outputs = []
+    for _ in range(3):
+        with tempfile.NamedTemporaryFile(delete=False) as temp_out:
+            outputs.append(temp_out.name)
+    try:
+        seeder = run_btide('seeder.cfg', outputs[0])
+        stalled = run_btide('stalled.cfg', outputs[1])
+        leecher = run_btide('leecher.cfg', outputs[2])
+        time.sleep(0.5)
+        command(seeder, 'ADDPACKAGE file1.bpkg')
+        command(stalled, 'ADDPACKAGE file1.bpkg')
+        command(leecher, 'ADDPACKAGE file1.bpkg')
+        command(leecher, 'CONNECT 127.0.0.1:9031')
+        # its REQs wait in the socket buffers until the end of the test
+        stalled.send_signal(signal.SIGSTOP)
+        command(leecher, 'FETCH 127.0.0.1:9031 ' + IDENT)
+        command(seeder, 'CONNECT 127.0.0.1:9032', 3)
+        command(leecher, 'PACKAGES')
+        stalled.send_signal(signal.SIGCONT)
+        for process in (seeder, leecher, stalled):
+            command(process, 'QUIT', 0.5)
+            process.wait()
+
+        compare_output(outputs[2], 'test3leecher.out')
+        compare_data('fetched/file1.data', 'tests/file1.data')
+    finally:
+        for output in outputs:
+            os.remove(output)
+        if os.path.exists('fetched/file1.data'):
+            os.remove('fetched/file1.data')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,87 @@
+# USYD CODE CITATION ACKNOWLEDGEMENT
+# I declare that the majority of the python3 script and inspiration comes from the following two links
+# https://stackoverflow.com/questions/12605498/how-to-use-subprocess-popen-python
+# https://stackoverflow.com/questions/89228/how-do-i-execute-a-program-or-call-a-system-command
+
+# restarts of a node with persist:1, a package it fetched itself comes back
+# with its recorded chunks trusted, the tree is left evicted as nothing had
+# to be hashed, while the same file edited in place by another program
+# comes back incomplete
+
+import subprocess
+import os
+import re
+import shutil
+import tempfile
+import time
+
+IDENT = open('file1.bpkg').readline().split(':')[1].strip()
+
+def run_btide(config_file, output_file):
+    outfile = open(output_file, 'a')
+    return subprocess.Popen(['../../btide', config_file], stdin=subprocess.PIPE,
+        stdout=outfile, stderr=subprocess.DEVNULL, text=True)
+
+def command(process, line, wait=0.5):
+    process.stdin.write(line + '\n')
+    process.stdin.flush()
+    time.sleep(wait)
+
+def quit(process):
+    command(process, 'QUIT')
+    process.wait()
+
+def compare_output(output, expected):
+    with open(output) as f:
+        text = f.read()
+    # the time a download took and the bytes a package holds change
+    text = re.sub(r' in [0-9.]+s$', ' in <time>', text, flags=re.M)
+    text = re.sub(r' : [0-9]+ bytes \(.*?( evicted)?\), [0-9]+ mapped$',
+        r' :\1', text, flags=re.M)
+    text = re.sub(r'^Total: [0-9]+ bytes$', 'Total', text, flags=re.M)
+    with open(expected) as f:
+        matched = text == f.read()
+    if matched:
+        print(f"The outputs match for {output} and {expected}!")
+    else:
+        print(f"The outputs do not match for {output} and {expected}.")
+
+def main():
+    shutil.rmtree('node', ignore_errors=True)
+    os.makedirs('node')
+    with tempfile.NamedTemporaryFile(delete=False) as temp_out:
+        output = temp_out.name
+    try:
+        seeder = run_btide('seeder.cfg', os.devnull)
+        node = run_btide('node.cfg', output)
+        time.sleep(0.5)
+        command(seeder, 'ADDPACKAGE file1.bpkg')
+        command(node, 'ADDPACKAGE file1.bpkg')
+        command(node, 'CONNECT 127.0.0.1:9040')
+        command(node, 'FETCH 127.0.0.1:9040 ' + IDENT, 2)
+        quit(node)
+        quit(seeder)
+
+        # its own writes do not count as a change
+        node = run_btide('node.cfg', output)
+        time.sleep(1)
+        command(node, 'PACKAGES')
+        command(node, 'MEMORY')
+        quit(node)
+
+        # 4 bytes of the first chunk overwritten, the size and inode stay
+        with open('node/file1.data', 'r+b') as f:
+            f.seek(1000)
+            f.write(b'\xde\xad\xbe\xef')
+        node = run_btide('node.cfg', output)
+        time.sleep(1)
+        command(node, 'PACKAGES')
+        quit(node)
+
+        compare_output(output, 'test4node.out')
+    finally:
+        os.remove(output)
+        shutil.rmtree('node', ignore_errors=True)
+
+if __name__ == '__main__':
+    main()
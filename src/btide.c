@@ -7,7 +7,15 @@
 #include "chk/pkgchk.h"
 #include "parser/parser.h"
 #include "package/package.h"
+#include "package/registry.h"
+#include "package/download.h"
+#include "package/have.h"
+#include "package/receive.h"
+#include "package/datafile.h"
 #include "peer/peer.h"
+#include "peer/peertable.h"
+#include "net/reactor.h"
+#include "net/sendq.h"
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -15,6 +23,8 @@
 #include <sys/select.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #define MAXLINELENGTH 128
 #define MAXCOMMANDLENGTH 5520
@@ -30,25 +40,26 @@
 //
 // Contains the main function, starting point of the program.
 
-// global variables holding list of peers and mutexes
-Peer *peer_list = NULL;
-int peer_count = 0;
-pthread_mutex_t peer_list_lock;
+// global variables holding list of packages, peers are in peer/peertable.h
 bpkg_obj **list;
 int current_length = 0;
 int max_size = INITIALPACKAGELENGTH;
 
-int server_fd;
+int server_fd = -1;
+int max_peers;
 volatile int terminate_flag = 0;
 pthread_mutex_t terminate_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t terminate_cond = PTHREAD_COND_INITIALIZER;
-pthread_t server_thread, client_thread;
+pthread_t client_thread;
 
 // forward declaration
-void *server_function(void *arg);
+int start_server(Config *cfg);
 void *client_function(void *arg);
-void *handle_connection(void *arg);
-void add_peer(int socket, struct sockaddr_in address, Config *cfg);
+int handle_packet(int socket, struct btide_packet *packet);
+int handle_res(int socket, const Wire_res *res);
+int peer_ready(int socket, struct sockaddr_in address);
+int remove_peer(int socket);
+void peer_hung_up(int socket);
 
 void signal_termination()
 {
@@ -59,23 +70,37 @@ void signal_termination()
 }
 
 void cleanup() {
-    for (int i = 0; i < peer_count; i++)
+    cancel_package_builds();
+    // no packets are handled once the reactors have stopped
+    reactor_stop();
+    // the chunks still waiting for a writer are written, then the registry
+    // stamps the data files as the node leaves them
+    receive_stop();
+    registry_close();
+    if (server_fd >= 0)
     {
-        send_dsn_packet(peer_list[i].socket);
-        close(peer_list[i].socket);
-        // printf("cancelling thread %ld\n", peer_list[i].id);
-        // pthread_cancel(peer_list[i].id);
-        pthread_join(peer_list[i].id, NULL);
+        close(server_fd);
     }
-    free(peer_list);
+    Peer *peers = malloc(max_peers * sizeof(Peer));
+    int npeers = peers ? peer_table_list(peers, max_peers) : 0;
+    for (int i = 0; i < npeers; i++)
+    {
+        // no reactor is left to send it, so it goes now if it fits
+        send_dsn_packet(peers[i].socket);
+        sendq_flush(peers[i].socket);
+        close(peers[i].socket);
+    }
+    free(peers);
+    peer_table_free();
+    sendq_free();
     for (int i = 0; i < current_length; i++)
     {
-        bpkg_obj_destroy(list[i]);
+        package_put(list[i]);
         list[i] = NULL;
     }
+    package_index_clear();
     free(list);
     list = NULL;
-    pthread_mutex_destroy(&peer_list_lock); 
     pthread_mutex_destroy(&terminate_mutex);
     pthread_cond_destroy(&terminate_cond);
 }
@@ -133,27 +158,39 @@ int main(int argc, char **argv)
     // printf("%d\n", cfg.max_peers);
     // printf("%d\n", cfg.port);
 
-    // peer list
-    peer_list = calloc(cfg.max_peers, sizeof(Peer));
-    if (!peer_list)
+    // peer table
+    max_peers = cfg.max_peers;
+    if (peer_table_init(cfg.max_peers))
     {
-        perror("Memory allocation failed for peer_list");
+        fprintf(stderr, "Memory allocation failed for peer table\n");
         return 1;
     }
     list = malloc(INITIALPACKAGELENGTH * sizeof(bpkg_obj *));
     if (!list)
     {
         perror("Malloc failed");
-        free(peer_list);
+        peer_table_free();
         return 1;
     }
-    pthread_mutex_init(&peer_list_lock, NULL);
+    // restore the packages managed by the last run
+    if (cfg.persist && registry_open(cfg.directory))
+    {
+        fprintf(stderr, "Failed to open package registry\n");
+    }
+    // load the saved and configured packages in the background
+    if (start_package_scan(&cfg))
+    {
+        fprintf(stderr, "Failed to start package scan\n");
+    }
 
-    // server thread
-    if (pthread_create(&server_thread, NULL, 
-        server_function, (void *)&cfg) != 0)
+    // the reactors own the listener and every peer socket
+    download_set_window(cfg.fetch_window);
+    Reactor_handlers handlers = { peer_ready, handle_packet, handle_res,
+        peer_hung_up };
+    if (start_server(&cfg) || receive_start()
+        || reactor_start(server_fd, cfg.reactors, &handlers))
     {
-        perror("Failed to create server thread");
+        cleanup();
         return 1;
     }
     // client thread
@@ -161,25 +198,24 @@ int main(int argc, char **argv)
         client_function, (void *)&cfg) != 0)
     {
         perror("Failed to create client thread");
+        cleanup();
         return 1;
     }
     // join and return
-    pthread_join(server_thread, NULL);
-    signal_termination();
     pthread_join(client_thread, NULL);
     cleanup();
     return 0;
 }
 
 // code from resources section with minor modifications -> server.c
-void *server_function(void *arg)
+// opens the listening socket, accepting is done by the first reactor
+int start_server(Config *cfg)
 {
-    Config *cfg = (Config *)arg;
     struct sockaddr_in address;
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
         perror("Socket creation failed");
-        return NULL;
+        return 1;
     }
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
@@ -187,357 +223,283 @@ void *server_function(void *arg)
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
     {
         perror("Bind failed");
-        return NULL;
+        return 1;
     }
     if (listen(server_fd, 3) < 0)
     {
         perror("Listen failed");
-        return NULL;
+        return 1;
     }
     // printf("S: Server listening on port %d...\n", cfg->port);
+    return 0;
+}
 
-    // inf loop
-    fd_set readfds;
-    struct timeval timeout;
-
-    int new_socket;
-    while (1)
+// puts a peer in the peer table, 1 if it is full or has the address
+static int insert_peer(int socket, struct sockaddr_in address)
+{
+    // refused if there are no spaces left for connections or duplicates
+    if (!peer_table_add(socket, address))
     {
-        FD_ZERO(&readfds);
-        FD_SET(server_fd, &readfds);
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
-        pthread_mutex_lock(&terminate_mutex);
-        if (terminate_flag)
-        {
-            pthread_mutex_unlock(&terminate_mutex);
-            break;
-        }
-        pthread_mutex_unlock(&terminate_mutex);
-
-        int activity = select(server_fd + 1, &readfds, NULL, NULL, &timeout);
-        if (activity < 0 && errno != EINTR)
-        {
-            perror("Select error");
-        }
-
-        if (activity == 0)
-        {
-            continue;
-        }
-
-        if (FD_ISSET(server_fd, &readfds))
-        {
-            // printf("S: Waiting for connections\n");
-            socklen_t addrlen = sizeof(struct sockaddr);
-            if ((new_socket = accept(server_fd, (struct sockaddr *)&address, 
-                (socklen_t *)&addrlen)) < 0)
-            {
-                perror("Accept failed");
-                continue;
-            }
-            // printf("S: New connection, socket fd is %d, IP is : %s,
-            // port : %d\n", new_socket, inet_ntoa(address.sin_addr), 
-            // ntohs(address.sin_port));
-            // send acp packet
-            send_acp_packet(new_socket);
-
-            // wait for ACK before adding the peer
-            struct btide_packet packet;
-            if (read(new_socket, &packet, sizeof(packet)) > 0 
-                && packet.msg_code == PKT_MSG_ACK)
-            {
-                add_peer(new_socket, address, cfg);
-                // printf("S: ACK received\n");
-            }
-            else
-            {
-                // printf("S: ACK not received - Terminating\n");
-                close(new_socket);
-            }
-        }
+        return 1;
     }
-    // printf("S: Terminating server...\n");
-    close(server_fd);
-    return NULL;
+    // printf("G: Added peer...\n");
+    // it can serve the packages being fetched as well
+    download_peer_joined(socket);
+    return 0;
+}
+
+// called by a reactor once an accepted connection has sent its ACK
+int peer_ready(int socket, struct sockaddr_in address)
+{
+    return insert_peer(socket, address);
 }
 
-// function to add a peer to the peer list
+// function to add a peer we connected to, its socket is handed to a reactor
 void add_peer(int socket, struct sockaddr_in address, Config *cfg)
 {
-    // mutex lock prevent race condition / undefined behaviour
-    pthread_mutex_lock(&peer_list_lock);
-    // if there are still spaces left for connections
-    if (peer_count < cfg->max_peers)
+    // downloads it joins queue REQs before its reactor watches it
+    sendq_open(socket);
+    if (insert_peer(socket, address))
     {
-        pthread_t thread_id;
-
-        if (pthread_create(&thread_id, NULL, handle_connection, 
-            &peer_list[peer_count]) != 0)
-        {
-            perror("Thread creation failed");
-            close(socket);
-        } else {
-            peer_list[peer_count].socket = socket;
-            peer_list[peer_count].address = address;
-            peer_list[peer_count].id = thread_id;
-            peer_count++;
-            // printf("new thread id %ld", thread_id);
-        }
+        sendq_close(socket);
+        close(socket);
+        return;
     }
-    else
+    if (reactor_add(socket))
     {
-        fprintf(stderr, "Max peers reached, connection refused\n");
+        remove_peer(socket);
+        sendq_close(socket);
         close(socket);
     }
-    // printf("G: Added peer...\n");
-    pthread_mutex_unlock(&peer_list_lock);
 }
 
-// function to remove a peer from the peer list
-void remove_peer(int socket)
+// takes a peer out of the peer table, 1 if it had already left
+int remove_peer_id(Peer_id id, Peer *peer)
 {
-    // make thread safe
-    pthread_mutex_lock(&peer_list_lock);
-    for (int i = 0; i < peer_count; i++)
+    Peer removed;
+    if (peer_table_remove(id, &removed))
     {
-        if (peer_list[i].socket == socket)
-        {
-            close(peer_list[i].socket);
-            // move last peer to empty spot so theres no holes
-            peer_list[i] = peer_list[peer_count - 1];
-            // dont forget to decrement the count
-            (peer_count)--;
-            break;
-        }
+        return 1;
     }
     // printf("G: Removed peer...\n");
-    pthread_mutex_unlock(&peer_list_lock);
+    // the other peers in its downloads take over its chunks
+    download_peer_left(removed.socket);
+    receive_drop_socket(removed.socket);
+    if (peer)
+    {
+        *peer = removed;
+    }
+    return 0;
+}
+
+// function to remove a peer from the peer list, the reactor that received
+// its DSN closes the socket
+int remove_peer(int socket)
+{
+    return remove_peer_id(peer_table_socket(socket), NULL);
 }
 
-// check if a certain port is already connected
-// preventing duplicate connections
+// called by a reactor when a peer hangs up, it stays in the peer table
+// until DISCONNECT but its downloads stop asking it for chunks
+void peer_hung_up(int socket)
+{
+    download_peer_left(socket);
+    receive_drop_socket(socket);
+}
+
+// check if a certain address is already connected
+// preventing duplicate connections, returns its socket or -1
 int is_already_connected(const char *ip, int port)
 {
-    pthread_mutex_lock(&peer_list_lock);
-    for (int i = 0; i < peer_count; i++)
+    struct in_addr address;
+    if (inet_pton(AF_INET, ip, &address) <= 0 || port < 0 
+        || port > UINT16_MAX)
     {
-        char connected_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &peer_list[i].address.sin_addr, 
-            connected_ip, INET_ADDRSTRLEN);
-        int connected_port = ntohs(peer_list[i].address.sin_port);
-        // check if ip and port match so theres already a connection
-        if (strcmp(connected_ip, ip) == 0 && connected_port == port)
-        {
-            pthread_mutex_unlock(&peer_list_lock);
-            return peer_list->socket;
-        }
+        return -1;
     }
-    pthread_mutex_unlock(&peer_list_lock);
-    return -1;
+    Peer peer;
+    if (peer_table_get(peer_table_find(address, port), &peer))
+    {
+        return -1;
+    }
+    return peer.socket;
 }
 
-// function which threads use when incoming connection
-void *handle_connection(void *arg)
+// handles a packet from a peer on its reactor thread, nonzero closes the
+// connection
+int handle_packet(int socket, struct btide_packet *packet)
 {
-    Peer *peer = (Peer *)arg;
-    struct btide_packet packet;
-    ssize_t num_bytes;
-
     char identifier[MAX_IDENTIFIER_LENGTH];
     char chunk_hash[MAX_HASH_LENGTH];
     uint32_t offset;
     uint32_t size;
     // handle which sort of packet
-    // printf("G: Listening for packets\n");
-    // keep receiving packets, until nothing is received
-    while (1)
+    switch (packet->msg_code)
     {
-        pthread_mutex_lock(&terminate_mutex);
-        if (terminate_flag)
+    case PKT_MSG_DSN:
+        // Disconnect and cleanup
+        // printf("G: DSN received, disconnecting peer.\n");
+        if (remove_peer(socket))
         {
-            pthread_mutex_unlock(&terminate_mutex);
-            pthread_exit(NULL);
+            // DISCONNECT took it first and closes the socket itself
+            return 0;
         }
-        pthread_mutex_unlock(&terminate_mutex);
-
-        fd_set readfds;
-        struct timeval timeout;
-        FD_ZERO(&readfds);
-        FD_SET(peer->socket, &readfds);
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
-        int activity = select(peer->socket + 1, &readfds, NULL, NULL, &timeout);
-        if (activity < 0 && errno != EINTR)
-        {
-            perror("Select error on connecting thread");
-            continue;
-        }
-
-        if (activity == 0)
+        return 1;
+    case PKT_MSG_ACK:
+        // Process ACK packet
+        // printf("G: ACK received from peer\n");
+        break;
+    case PKT_MSG_ACP:
+        // the handshake is over and the encoding settled, a late ACP has
+        // nothing left to negotiate and is ignored like a late ACK
+        break;
+    case PKT_MSG_REQ:
+        // Handle data request
+        memcpy(&offset, packet->pl.data, sizeof(uint32_t));
+        memcpy(&size, packet->pl.data + sizeof(uint32_t), 
+                sizeof(uint32_t));
+        memcpy(chunk_hash, packet->pl.data + 2 * sizeof(uint32_t), 
+                MAX_HASH_LENGTH);
+        memcpy(identifier, packet->pl.data + 2 * sizeof(uint32_t) 
+                + MAX_HASH_LENGTH, MAX_IDENTIFIER_LENGTH);
+
+        // printf("offset: %d\n", offset);
+        // printf("size: %d\n", size);
+        // printf("chunk_hash: %.64s\n", chunk_hash);
+        // printf("identifier: %.1024s\n", identifier);
+
+        int sent = 0;
+        // check if there exists a bpkg obj with certain identifier
+        bpkg_obj *obj = package_get(identifier);
+        if (obj != NULL)
         {
-            continue;
-        }
-
-        if (FD_ISSET(peer->socket, &readfds)) {
-            num_bytes = recv(peer->socket, &packet, 
-                sizeof(struct btide_packet), 0);
-            if (num_bytes > 0)
+            // check if there exists a certain Chunk with chunk hash
+            int64_t chunk = request_hash(chunk_hash, obj);
+            if (chunk >= 0)
             {
-                switch (packet.msg_code)
+                // keep sending, keeping track of the offset sent
+                // and splitting the packet into multiple until
+                // no bytes remaining, the data goes from the
+                // package's open file to the socket with sendfile
+                Package_file *file = datafile_get(obj);
+                int fd = file ? file->fd : -1;
+                struct stat st;
+                if (fd >= 0 && fstat(fd, &st) == 0)
                 {
-                case PKT_MSG_DSN:
-                    // Disconnect and cleanup
-                    // printf("G: DSN received, disconnecting peer.\n");
-                    remove_peer(peer->socket);
-                    pthread_exit(NULL);
-                    break;
-                case PKT_MSG_ACK:
-                    // Process ACK packet
-                    // printf("G: ACK received from peer\n");
-                    break;
-                case PKT_MSG_ACP:
-                    // Process ACP packet
-                    // printf("G: About to send packet\n");
-                    send_acp_packet(peer->socket);
-                    break;
-                case PKT_MSG_REQ:
-                    // Handle data request
-                    memcpy(&offset, packet.pl.data, sizeof(uint32_t));
-                    memcpy(&size, packet.pl.data + sizeof(uint32_t), 
-                            sizeof(uint32_t));
-                    memcpy(chunk_hash, packet.pl.data + 2 * sizeof(uint32_t), 
-                            MAX_HASH_LENGTH);
-                    memcpy(identifier, packet.pl.data + 2 * sizeof(uint32_t) 
-                            + MAX_HASH_LENGTH, MAX_IDENTIFIER_LENGTH);
-
-                    // printf("offset: %d\n", offset);
-                    // printf("size: %d\n", size);
-                    // printf("chunk_hash: %.64s\n", chunk_hash);
-                    // printf("identifier: %.1024s\n", identifier);
-
-                    int sent = 0;
-                    // check if there exists a bpkg obj with certain identifier
-                    bpkg_obj *obj = 
-                        check_ident(identifier, current_length, list);
-                    if (obj != NULL)
+                    off_t position = offset;
+                    size_t remaining_size = size;
+                    // jumbo frames if the peer agreed to them
+                    size_t max_data = wire_mode(socket).max_data;
+                    uint32_t offset = 
+                        bpkg_chunk_offset(obj, chunk);
+                    while (remaining_size > 0 && position < st.st_size)
                     {
-                        // check if there exists a certain Chunk with chunk hash
-                        Chunk *chunk = request_hash(chunk_hash, obj);
-                        if (chunk != NULL)
+                        size_t to_send = remaining_size > max_data 
+                            ? max_data : remaining_size;
+                        if ((off_t)to_send > st.st_size - position)
                         {
-                            // keep reading, keeping track of the offset read
-                            // and splitting the packet into multiple until
-                            // no bytes remaining
-                            FILE *file = fopen(obj->filename, "rb");
-                            if (file)
-                            {
-                                fseek(file, offset, SEEK_SET);
-                                size_t remaining_size = size;
-                                char buffer[MAXDATA];
-                                uint32_t offset = chunk->offset;
-                                while (remaining_size > 0)
-                                {
-                                    size_t to_read = remaining_size > MAXDATA 
-                                        ? MAXDATA : remaining_size;
-                                    size_t read_bytes = 
-                                    fread(buffer, 1, to_read, file);
-                                    if (read_bytes != 0)
-                                    {
-                                        // send the res packet with information
-                                        send_res_packet(peer->socket, 
-                                            identifier, chunk_hash, 
-                                            offset, buffer, read_bytes, 0);
-
-                                        remaining_size -= read_bytes;
-                                        offset += read_bytes;
-                                        sent = 1;
-                                    }
-                                    else
-                                    {
-                                        break;
-                                    }
-                                }
-                                fclose(file);
-                            }
+                            to_send = st.st_size - position;
                         }
+                        // send the res packet with information
+                        if (send_res_file(socket, identifier, chunk_hash,
+                            offset, file, position, to_send) < 0)
+                        {
+                            break;
+                        }
+                        remaining_size -= to_send;
+                        position += to_send;
+                        offset += to_send;
+                        sent = 1;
                     }
-                    if (!sent)
-                    {
-                        // send an error res packet
-                        send_res_packet(peer->socket, identifier, chunk_hash, 
-                            offset, NULL, 0, 1);
-                    }
-                    break;
-                case PKT_MSG_RES:
-                    // Receive requested data
-                    if (packet.error)
-                    {
-                        printf("Error in RES packet\n");
-                        continue;
-                    }
-                    uint16_t new_size;
-                    char buffer[MAXDATA];
-                    // store the payload information into variables
-                    memcpy(&offset, packet.pl.data, sizeof(uint32_t));
-                    memcpy(&buffer, packet.pl.data + sizeof(uint32_t), MAXDATA);
-                    memcpy(&new_size, packet.pl.data + sizeof(uint32_t) 
-                        + MAXDATA, sizeof(uint16_t));
-                    memcpy(chunk_hash, packet.pl.data + sizeof(uint32_t) 
-                        + MAXDATA + sizeof(uint16_t), MAX_HASH_LENGTH);
-                    memcpy(identifier, packet.pl.data + sizeof(uint32_t) 
-                        + MAXDATA + sizeof(uint16_t) 
-                        + MAX_HASH_LENGTH, MAX_IDENTIFIER_LENGTH);
-
-                    // printf("offset: %d\n", offset);
-                    // printf("size: %d\n", new_size);
-                    // printf("chunk_hash: %.64s\n", chunk_hash);
-                    // printf("identifier: %.1024s\n", identifier);
-                    // printf("buffer: %.2998s\n", buffer);
-                    bpkg_obj *new_obj = check_ident(identifier, current_length, 
-                        list);
-                    if (new_obj == NULL)
-                    {
-                        printf("Identifier was not part of a package\n");
-                        continue;
-                    }
-                    // open the file to write the new data into
-                    FILE *file = fopen(new_obj->filename, "r+b");
-                    if (file == NULL)
-                    {
-                        printf("File specified does not exist\n");
-                        continue;
-                    }
-                    fseek(file, offset, SEEK_SET);
-                    fwrite(buffer, 1, new_size, file);
-                    fclose(file);
-                    break;
-                case PKT_MSG_PNG:
-                    // Send a POG in response
-                    send_pog_packet(peer->socket);
-                    break;
-                case PKT_MSG_POG:
-                    // Process POG packet
-                    // do nothing
-                    break;
-                default:
-                    fprintf(stderr, "Unhandled packet type: %d\n", 
-                        packet.msg_code);
                 }
+                datafile_put(file);
             }
-            else
-            {
-                // The peer has closed the connection
-                // printf("G: Connection closed by peer\n");
-                // dont remove to pass testcase
-                // remove_peer(peer->socket);
-                pthread_exit(NULL);
-            }
         }
+        package_put(obj);
+        if (!sent)
+        {
+            // send an error res packet
+            send_res_packet(socket, identifier, chunk_hash, 
+                offset, NULL, 0, 1);
+        }
+        break;
+    case PKT_MSG_RES:
+        // Receive requested data
+        Wire_res res;
+        wire_res(packet, &res);
+        return handle_res(socket, &res);
+    case WIRE_MSG_HAVE_QUERY:
+    case WIRE_MSG_HAVE_REPLY:
+        // which chunks of a package either side has, see package/have.h
+        char have_ident_buf[HAVE_IDENT + 1];
+        have_ident(packet, have_ident_buf);
+        bpkg_obj *have_obj = package_get(have_ident_buf);
+        if (packet->msg_code == WIRE_MSG_HAVE_QUERY)
+        {
+            have_answer(socket, have_obj, packet);
+        }
+        else
+        {
+            have_reply(socket, have_obj, packet);
+        }
+        package_put(have_obj);
+        break;
+    case PKT_MSG_PNG:
+        // Send a POG in response
+        send_pog_packet(socket);
+        break;
+    case PKT_MSG_POG:
+        // Process POG packet
+        // do nothing
+        break;
+    default:
+        fprintf(stderr, "Unhandled packet type: %d\n", 
+            packet->msg_code);
+    }
+    return 0;
+}
+
+// writes the data of a RES, from a packet or a jumbo frame, into its package
+int handle_res(int socket, const Wire_res *res)
+{
+    if (res->error)
+    {
+        // newer peers name the refused chunk, so a download can ask
+        // another peer rather than wait for it to time out
+        bpkg_obj *obj = package_get(res->ident);
+        int64_t chunk = obj ? request_hash((char *)res->hash, obj) : -1;
+        // a whole package FETCH counts them in its report instead
+        if (chunk < 0 || !download_chunk_refused(obj, socket, chunk))
+        {
+            printf("Error in RES packet\n");
+        }
+        package_put(obj);
+        return 0;
     }
-    pthread_exit(NULL);
+    bpkg_obj *new_obj = package_get(res->ident);
+    if (new_obj == NULL)
+    {
+        printf("Identifier was not part of a package\n");
+        return 0;
+    }
+    // data for a chunk the manifest does not name cannot be verified
+    int64_t chunk = request_hash((char *)res->hash, new_obj);
+    if (chunk < 0)
+    {
+        package_put(new_obj);
+        return 0;
+    }
+    // nothing reaches the file until the whole chunk has been hashed, a
+    // writer reports a queued chunk once it is on disk
+    int result = receive_slice(new_obj, socket, chunk, res->offset, 
+        res->data, res->size);
+    if (result != RECEIVE_PENDING && result != RECEIVE_QUEUED)
+    {
+        download_chunk_received(new_obj, socket, chunk, 
+            result == RECEIVE_COMMITTED);
+    }
+    package_put(new_obj);
+    return 0;
 }
 
 // code from resources section with minor modifications -> client.c
@@ -572,6 +534,15 @@ void *client_function(void *arg)
             continue;
         }
 
+        // register packages whose background build has finished
+        reap_package_builds(&current_length, &max_size, &list);
+        reap_package_scan(&current_length, &max_size, &list);
+        evict_idle_trees(current_length, list);
+        // request timed out chunks again and report finished FETCHes
+        download_tick();
+        // record the chunks received since the last tick
+        registry_sync();
+
         if (activity == 0)
         {
             continue;
@@ -586,6 +557,7 @@ void *client_function(void *arg)
                 if (strncmp(command, "QUIT", 4) == 0)
                 {
                     // printf("C: Terminating program\n");
+                    cancel_package_builds();
                     signal_termination();
                     break;
                 }
@@ -597,8 +569,7 @@ void *client_function(void *arg)
                 else if (strncmp(command, "DISCONNECT", 10) == 0)
                 {
                     // Handle DISCONNECT command
-                    handle_disconnect(command, ip, &port, &peer_list_lock, 
-                    &peer_count, peer_list);
+                    handle_disconnect(command, ip, &port);
                 }
                 else if (strncmp(command, "ADDPACKAGE", 10) == 0)
                 {
@@ -612,6 +583,16 @@ void *client_function(void *arg)
                     handle_remove_package(command, &current_length, 
                         &max_size, list);
                 }
+                else if (strncmp(command, "PROGRESS", 8) == 0)
+                {
+                    // Handle PROGRESS command
+                    handle_progress(command);
+                }
+                else if (strncmp(command, "MEMORY", 6) == 0)
+                {
+                    // Handle MEMORY command
+                    handle_memory(command, &current_length, list);
+                }
                 else if (strncmp(command, "PACKAGES", 8) == 0)
                 {
                     // Handle PACKAGES command
@@ -626,7 +607,7 @@ void *client_function(void *arg)
                         printf("Invalid Input\n");
                         continue;
                     }
-                    handle_peers(peer_list_lock, &peer_count, peer_list);
+                    handle_peers(max_peers);
                 }
                 else if (strncmp(command, "FETCH", 5) == 0)
                 {
@@ -641,13 +622,16 @@ void *client_function(void *arg)
                     char ident[MAXIDENTLENGTH];
                     char hash[MAXHASHLENGTH];
                     int offset = 0;
-                    // make sure input is in the correct format
-                    int args = sscanf(command + 6, "%127[^:]:%d %s %s %d%c", 
-                    ip, &port, ident, hash, &offset, &remainder);
-
-                    // should be at least 4 accounting for the optional argument
-                    if (args < 4 || (remainder != '\n' && remainder != '\r' 
-                    && remainder != '\0'))
+                    // make sure input is in the correct format, the widths
+                    // keep to the ident and hash buffers
+                    int args = sscanf(command + 6, 
+                        "%127[^:]:%d %1024s %64s %d%c", 
+                        ip, &port, ident, hash, &offset, &remainder);
+
+                    // the hash is optional, without it the whole package
+                    // is fetched
+                    if (args < 3 || (args > 3 && remainder != '\n' 
+                    && remainder != '\r' && remainder != '\0'))
                     {
                         printf("Missing arguments from command\n");
                         continue;
@@ -660,24 +644,83 @@ void *client_function(void *arg)
                         continue;
                     }
                     // check if ident is being managed
-                    bpkg_obj *obj = check_ident(ident, current_length, list);
+                    bpkg_obj *obj = package_get(ident);
                     if (obj == NULL)
                     {
                         printf("Unable to request chunk, package "
                             "is not managed\n");
                         continue;
                     }
-                    // check if hash provided is valid
-                    Chunk *chunk = request_hash(hash, obj);
-                    if (chunk == NULL)
+                    uint32_t *chunks = NULL;
+                    uint32_t count = 0;
+                    // a chunk hash is requested as before, quietly
+                    int64_t chunk = args > 3 ? request_hash(hash, obj) : -1;
+                    if (chunk >= 0)
+                    {
+                        chunks = malloc(sizeof(uint32_t));
+                        if (!chunks)
+                        {
+                            perror("Malloc failed");
+                            package_put(obj);
+                            continue;
+                        }
+                        chunks[0] = chunk;
+                        count = 1;
+                    }
+                    // the package or a subtree, only what is missing
+                    else if (package_missing_chunks(obj, 
+                        args > 3 ? hash : NULL, &chunks, &count))
                     {
                         printf("Unable to request chunk, chunk hash does not "
                                 "belong to package\n");
+                        package_put(obj);
+                        continue;
+                    }
+                    else if (count == 0)
+                    {
+                        printf("No chunks to fetch, package already "
+                            "has them\n");
+                        package_put(obj);
                         continue;
                     }
-                    // finally send the req packet to the connection
-                    send_req_packet(socket, ident, hash, 
-                        chunk->offset, chunk->size);
+                    else if (download_active(obj))
+                    {
+                        free(chunks);
+                        printf("Package is already being fetched\n");
+                        package_put(obj);
+                        continue;
+                    }
+                    // the named peer is asked first, the whole package or
+                    // a subtree comes from every connected peer
+                    int *sockets = malloc((max_peers + 1) * sizeof(int));
+                    Peer *peers = malloc(max_peers * sizeof(Peer));
+                    if (!sockets || !peers)
+                    {
+                        perror("Malloc failed");
+                        free(sockets);
+                        free(peers);
+                        free(chunks);
+                        package_put(obj);
+                        continue;
+                    }
+                    int nsockets = 1;
+                    sockets[0] = socket;
+                    int npeers = chunk < 0 
+                        ? peer_table_list(peers, max_peers) : 0;
+                    for (int i = 0; i < npeers; i++)
+                    {
+                        if (peers[i].socket != socket)
+                        {
+                            sockets[nsockets++] = peers[i].socket;
+                        }
+                    }
+                    free(peers);
+                    // keeps fetch_window REQs outstanding to each peer
+                    // until every chunk has arrived
+                    download_start(obj, sockets, nsockets, chunks, count, 
+                        chunk >= 0);
+                    free(sockets);
+                    package_put(obj);
                 }
                 else
                 {
@@ -0,0 +1,250 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "chk/bpkgbin.h"
+
+static uint64_t align_up(uint64_t off)
+{
+    return (off + BPKG_BIN_ALIGN - 1) & ~(uint64_t)(BPKG_BIN_ALIGN - 1);
+}
+
+int bpkg_bin_detect(const void *data, size_t length)
+{
+    return length >= sizeof(BPKG_BIN_MAGIC)
+        && memcmp(data, BPKG_BIN_MAGIC, sizeof(BPKG_BIN_MAGIC)) == 0;
+}
+
+// true if count elements of elem bytes at off are inside the file
+static int section_ok(uint64_t off, uint64_t count, size_t elem,
+    size_t length)
+{
+    return off % BPKG_BIN_ALIGN == 0 && off <= length
+        && count <= (length - off) / elem;
+}
+
+/**
+ * True if every raw hash is null terminated and names an entry of its
+ * section, and the table is sorted by (is_chunk, index) without repeats
+ * as the lookups expect
+ */
+static int raw_hashes_ok(const Bpkg_bin_header *h, const uint8_t *base)
+{
+    const Bpkg_raw_hash *raw = (const Bpkg_raw_hash *)(base
+        + h->raw_hashes_off);
+    for (uint32_t r = 0; r < h->nraw_hashes; r++)
+    {
+        if (memchr(raw[r].hex, '\0', HASHLENGTH) == NULL
+            || (raw[r].is_chunk != 0 && raw[r].is_chunk != 1)
+            || raw[r].index >= (raw[r].is_chunk ? h->nchunks : h->nhashes))
+        {
+            return 0;
+        }
+        if (r > 0 && (raw[r - 1].is_chunk > raw[r].is_chunk
+            || (raw[r - 1].is_chunk == raw[r].is_chunk
+            && raw[r - 1].index >= raw[r].index)))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+bpkg_obj *bpkg_bin_load(void *data, size_t length)
+{
+    const Bpkg_bin_header *h = (const Bpkg_bin_header *)data;
+    if (!bpkg_bin_detect(data, length))
+    {
+        fprintf(stderr, "Not a compiled package\n");
+        return NULL;
+    }
+    if (length < sizeof(Bpkg_bin_header))
+    {
+        fprintf(stderr, "Invalid compiled package header\n");
+        return NULL;
+    }
+    if (h->byte_order != BPKG_BIN_BYTE_ORDER
+        || h->version != BPKG_BIN_VERSION)
+    {
+        fprintf(stderr, "Unsupported compiled package version\n");
+        return NULL;
+    }
+    // same required fields as the text format
+    if (h->file_length != length || h->size == 0 || h->nhashes == 0
+        || h->nchunks == 0
+        || memchr(h->ident, '\0', sizeof(h->ident)) == NULL
+        || memchr(h->filename, '\0', sizeof(h->filename)) == NULL)
+    {
+        fprintf(stderr, "Invalid compiled package header\n");
+        return NULL;
+    }
+    if (!section_ok(h->hashes_off, h->nhashes, SHA256_DIGEST_SZ, length)
+        || !section_ok(h->chunk_digests_off, h->nchunks, SHA256_DIGEST_SZ,
+            length)
+        || !section_ok(h->chunk_offsets_off, h->nchunks, sizeof(uint32_t),
+            length)
+        || !section_ok(h->chunk_sizes_off, h->nchunks, sizeof(uint32_t),
+            length)
+        || !section_ok(h->raw_hashes_off, h->nraw_hashes,
+            sizeof(Bpkg_raw_hash), length))
+    {
+        fprintf(stderr, "Compiled package section out of bounds\n");
+        return NULL;
+    }
+    // raw hashes are copied out as strings, the rest are plain numbers
+    if (!raw_hashes_ok(h, (const uint8_t *)data))
+    {
+        fprintf(stderr, "Invalid compiled package raw hash table\n");
+        return NULL;
+    }
+
+    bpkg_obj *obj = calloc(1, sizeof(bpkg_obj));
+    if (!obj)
+    {
+        fprintf(stderr, "Error allocating memory\n");
+        return NULL;
+    }
+    pthread_mutex_init(&obj->sections_lock, NULL);
+    if (bpkg_set_ident(obj, h->ident, strlen(h->ident))
+        || bpkg_set_filename(obj, h->filename, strlen(h->filename)))
+    {
+        bpkg_obj_destroy(obj);
+        return NULL;
+    }
+    uint8_t *base = (uint8_t *)data;
+    obj->size = h->size;
+    obj->nhashes = h->nhashes;
+    obj->hashes = base + h->hashes_off;
+    obj->nchunks = h->nchunks;
+    obj->chunk_digests = base + h->chunk_digests_off;
+    obj->chunk_offsets = (uint32_t *)(base + h->chunk_offsets_off);
+    obj->chunk_sizes = (uint32_t *)(base + h->chunk_sizes_off);
+    obj->nraw_hashes = h->nraw_hashes;
+    obj->raw_hashes = h->nraw_hashes
+        ? (Bpkg_raw_hash *)(base + h->raw_hashes_off) : NULL;
+    obj->map = data;
+    obj->map_length = length;
+    obj->compiled = 1;
+    // nothing to load later
+    atomic_init(&obj->sections_state, BPKG_SECTIONS_LOADED);
+    return obj;
+}
+
+// writes len bytes then pads the file to the next section boundary
+static int write_section(FILE *file, const void *data, size_t len,
+    uint64_t *pos)
+{
+    static const uint8_t zeros[BPKG_BIN_ALIGN] = {0};
+    if (len > 0 && fwrite(data, 1, len, file) != len)
+    {
+        return 1;
+    }
+    *pos += len;
+    size_t pad = align_up(*pos) - *pos;
+    if (pad > 0 && fwrite(zeros, 1, pad, file) != pad)
+    {
+        return 1;
+    }
+    *pos += pad;
+    return 0;
+}
+
+int bpkg_bin_write(bpkg_obj *obj, const char *path)
+{
+    if (bpkg_load_sections(obj))
+    {
+        return 1;
+    }
+    Bpkg_bin_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BPKG_BIN_MAGIC, sizeof(BPKG_BIN_MAGIC));
+    h.version = BPKG_BIN_VERSION;
+    h.byte_order = BPKG_BIN_BYTE_ORDER;
+    h.size = obj->size;
+    h.nhashes = obj->nhashes;
+    h.nchunks = obj->nchunks;
+    h.nraw_hashes = obj->nraw_hashes;
+    // the setters keep both short enough to leave a null in the header
+    memcpy(h.ident, obj->ident, strlen(obj->ident) + 1);
+    memcpy(h.filename, obj->filename, strlen(obj->filename) + 1);
+    // lay the sections out one after another
+    uint64_t off = align_up(sizeof(h));
+    h.hashes_off = off;
+    off = align_up(off + (uint64_t)obj->nhashes * SHA256_DIGEST_SZ);
+    h.chunk_digests_off = off;
+    off = align_up(off + (uint64_t)obj->nchunks * SHA256_DIGEST_SZ);
+    h.chunk_offsets_off = off;
+    off = align_up(off + (uint64_t)obj->nchunks * sizeof(uint32_t));
+    h.chunk_sizes_off = off;
+    off = align_up(off + (uint64_t)obj->nchunks * sizeof(uint32_t));
+    h.raw_hashes_off = off;
+    off = align_up(off + (uint64_t)obj->nraw_hashes * sizeof(Bpkg_raw_hash));
+    h.file_length = off;
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error opening file\n");
+        return 1;
+    }
+    uint64_t pos = 0;
+    if (write_section(file, &h, sizeof(h), &pos)
+        || write_section(file, obj->hashes,
+            (size_t)obj->nhashes * SHA256_DIGEST_SZ, &pos)
+        || write_section(file, obj->chunk_digests,
+            (size_t)obj->nchunks * SHA256_DIGEST_SZ, &pos)
+        || write_section(file, obj->chunk_offsets,
+            (size_t)obj->nchunks * sizeof(uint32_t), &pos)
+        || write_section(file, obj->chunk_sizes,
+            (size_t)obj->nchunks * sizeof(uint32_t), &pos)
+        || write_section(file, obj->raw_hashes,
+            (size_t)obj->nraw_hashes * sizeof(Bpkg_raw_hash), &pos)
+        || fclose(file) != 0)
+    {
+        fprintf(stderr, "Error writing compiled package\n");
+        remove(path);
+        return 1;
+    }
+    return 0;
+}
+
+int bpkg_text_write(bpkg_obj *obj, const char *path)
+{
+    if (bpkg_load_sections(obj))
+    {
+        return 1;
+    }
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Error opening file\n");
+        return 1;
+    }
+    fprintf(file, "ident:%s\n", obj->ident);
+    fprintf(file, "filename:%s\n", obj->filename);
+    fprintf(file, "size:%u\n", obj->size);
+    fprintf(file, "nhashes:%u\n", obj->nhashes);
+    fprintf(file, "hashes:\n");
+    char hex[HASHLENGTH];
+    for (uint32_t i = 0; i < obj->nhashes; i++)
+    {
+        bpkg_hash_hex(obj, i, hex);
+        fprintf(file, "\t%s\n", hex);
+    }
+    fprintf(file, "nchunks:%u\n", obj->nchunks);
+    fprintf(file, "chunks:\n");
+    for (uint32_t i = 0; i < obj->nchunks; i++)
+    {
+        bpkg_chunk_hash_hex(obj, i, hex);
+        fprintf(file, "\t%s,%u,%u\n", hex, bpkg_chunk_offset(obj, i),
+            bpkg_chunk_size(obj, i));
+    }
+    if (ferror(file) | fclose(file))
+    {
+        fprintf(stderr, "Error writing package\n");
+        remove(path);
+        return 1;
+    }
+    return 0;
+}
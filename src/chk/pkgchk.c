@@ -1,50 +1,503 @@
+#define _DEFAULT_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "chk/pkgchk.h"
+#include "chk/bpkgbin.h"
+#include "chk/strpool.h"
 #include "tree/merkletree.h"
 // PART 1
 
 #define HASHLENGTH 65
 #define MAXLINELENGTH 2000
+// fscanf/isspace whitespace, a table lookup so it stays cheap at -O0
+#define WHITESPACE " \t\n\v\f\r"
+static const unsigned char space_table[256] = {
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1
+};
+#define is_space(c) (space_table[(unsigned char)(c)])
+
+// cursor over the memory mapped .bpkg file
+typedef struct
+{
+    const char *pos;
+    const char *end;
+} Bpkg_cursor;
+
+// same result as atoi on a line that ends at end
+static uint32_t parse_atoi(const char *p, const char *end)
+{
+    while (p < end && is_space(*p))
+        p++;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+    uint32_t value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        value = value * 10 + (uint32_t)(*p - '0');
+        p++;
+    }
+    return negative ? (uint32_t)(-(int32_t)value) : value;
+}
+
+// same as fscanf "%<max>s", skips whitespace then copies at most max
+// non whitespace characters, returns the number copied (0 at end of file)
+static size_t scan_token(Bpkg_cursor *c, char *out, size_t max)
+{
+    while (c->pos < c->end && is_space(*c->pos))
+        c->pos++;
+    // fast path, copy a whole token and let strcspn find where it ends
+    if ((size_t)(c->end - c->pos) >= max)
+    {
+        memcpy(out, c->pos, max);
+        out[max] = '\0';
+        size_t n = strcspn(out, WHITESPACE);
+        // a null byte has to be copied like any other character
+        if (n == max || out[n] != '\0')
+        {
+            out[n] = '\0';
+            c->pos += n;
+            return n;
+        }
+    }
+    size_t len = 0;
+    while (len < max && c->pos < c->end && !is_space(*c->pos))
+    {
+        out[len++] = *c->pos++;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// true if any byte of w is below '!', i.e. whitespace or a control byte
+#define HAS_BELOW_BANG(w) \
+    (((w) - 0x2121212121212121ULL) & ~(w) & 0x8080808080808080ULL)
+
+// start of the line after the next count lines, or end if the file has
+// fewer, one memchr per line
+static const char *skip_lines(const char *p, const char *end, uint32_t count)
+{
+    for (uint32_t i = 0; i < count && p < end; i++)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        p = eol ? eol + 1 : end;
+    }
+    return p;
+}
+
+// same as fscanf "%u", returns 0 if no digits were found
+static int scan_uint(Bpkg_cursor *c, uint32_t *out)
+{
+    while (c->pos < c->end && is_space(*c->pos))
+        c->pos++;
+    int negative = 0;
+    if (c->pos < c->end && (*c->pos == '-' || *c->pos == '+'))
+    {
+        negative = *c->pos == '-';
+        c->pos++;
+    }
+    const char *digits = c->pos;
+    uint32_t value = 0;
+    while (c->pos < c->end && *c->pos >= '0' && *c->pos <= '9')
+    {
+        value = value * 10 + (uint32_t)(*c->pos - '0');
+        c->pos++;
+    }
+    if (c->pos == digits)
+    {
+        return 0;
+    }
+    *out = negative ? (uint32_t)0 - value : value;
+    return 1;
+}
+
+// same as fscanf matching a literal character
+static int scan_char(Bpkg_cursor *c, char ch)
+{
+    if (c->pos < c->end && *c->pos == ch)
+    {
+        c->pos++;
+        return 1;
+    }
+    return 0;
+}
+
+// true if the line starts with key
+static inline int line_has_key(const char *line, size_t len, 
+    const char *key, size_t keylen)
+{
+    return len >= keylen && memcmp(line, key, keylen) == 0;
+}
+
+// length of a string value as strncpy into a dstlen buffer would keep it,
+// stopping at a null byte
+static size_t value_length(const char *src, size_t len, size_t dstlen)
+{
+    const char *nul = memchr(src, '\0', len);
+    if (nul)
+    {
+        len = nul - src;
+    }
+    return len > dstlen - 1 ? dstlen - 1 : len;
+}
+
+int bpkg_set_ident(bpkg_obj *obj, const char *ident, size_t len)
+{
+    const char *interned = strpool_intern(ident, 
+        value_length(ident, len, BPKG_IDENT_SIZE));
+    if (!interned)
+    {
+        return 1;
+    }
+    strpool_release(obj->ident);
+    obj->ident = interned;
+    return 0;
+}
+
+int bpkg_set_filename(bpkg_obj *obj, const char *filename, size_t len)
+{
+    const char *interned = strpool_intern(filename, 
+        value_length(filename, len, BPKG_FILENAME_SIZE));
+    if (!interned)
+    {
+        return 1;
+    }
+    strpool_release(obj->filename);
+    obj->filename = interned;
+    return 0;
+}
+
+// orders raw hashes by section, then index
+static int raw_before(const Bpkg_raw_hash *raw, uint32_t index, int is_chunk)
+{
+    return raw->is_chunk != is_chunk ? raw->is_chunk < is_chunk 
+        : raw->index < index;
+}
+
+// first raw hash not ordered before (is_chunk, index)
+static uint32_t raw_lower_bound(const bpkg_obj *obj, uint32_t index, 
+    int is_chunk)
+{
+    uint32_t lo = 0;
+    uint32_t hi = obj->nraw_hashes;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (raw_before(&obj->raw_hashes[mid], index, is_chunk))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 /**
- * Loads the package for when a valid path is given
+ * Stores a hash token as a digest, or verbatim if it is not hex
+ * Raw hashes stay sorted by (is_chunk, index) and the array doubles 
+ * whenever its count reaches a power of two
  */
-bpkg_obj *bpkg_load(const char *path)
+static int store_hash(bpkg_obj *obj, const char *hex, uint8_t *digest, 
+    uint32_t index, int is_chunk)
 {
-    // open in read mode
-    FILE *file = fopen(path, "r");
-    // failed to open file
-    if (!file)
+    if (sha256_hex_to_digest(hex, digest) == 0)
+    {
+        return 0;
+    }
+    uint32_t n = obj->nraw_hashes;
+    if ((n & (n - 1)) == 0)
+    {
+        Bpkg_raw_hash *raw = realloc(obj->raw_hashes, 
+            (n ? 2 * (size_t)n : 1) * sizeof(Bpkg_raw_hash));
+        if (!raw)
+        {
+            return 1;
+        }
+        obj->raw_hashes = raw;
+    }
+    // sections are parsed in order, so this is nearly always the end
+    uint32_t at = n == 0 || raw_before(&obj->raw_hashes[n - 1], index, 
+        is_chunk) ? n : raw_lower_bound(obj, index, is_chunk);
+    Bpkg_raw_hash *raw = &obj->raw_hashes[at];
+    memmove(raw + 1, raw, (size_t)(n - at) * sizeof(Bpkg_raw_hash));
+    raw->index = index;
+    raw->is_chunk = is_chunk;
+    memcpy(raw->hex, hex, HASHLENGTH);
+    obj->nraw_hashes++;
+    memset(digest, 0, SHA256_DIGEST_SZ);
+    return 0;
+}
+
+// sections with fewer entries are parsed on the calling thread
+#ifndef PARALLEL_MIN_ENTRIES
+#define PARALLEL_MIN_ENTRIES 65536
+#endif
+#define PARALLEL_MAX_THREADS 16
+
+// set by bpkg_set_parse_threads, 0 uses one per cpu
+static atomic_int parse_threads = 0;
+
+void bpkg_set_parse_threads(int nthreads)
+{
+    atomic_store(&parse_threads, nthreads < 0 ? 0 : nthreads);
+}
+
+// a run of whole lines of a section, one entry per line
+typedef struct
+{
+    const char *start;
+    const char *end;
+    uint32_t first;
+    uint32_t count;
+    int is_chunk;
+    uint8_t *digests;
+    uint32_t *offsets;
+    uint32_t *sizes;
+    // set if a line is not a plain entry
+    int failed;
+    // end of the last entry, where the sequential cursor would stop
+    const char *last;
+} Section_slice;
+
+// digits only, wrapping like scan_uint
+static const char *parse_digits(const char *p, const char *eol, 
+    uint32_t *out)
+{
+    const char *digits = p;
+    uint32_t value = 0;
+    while (p < eol && *p >= '0' && *p <= '9')
+    {
+        value = value * 10 + (uint32_t)(*p - '0');
+        p++;
+    }
+    *out = value;
+    return p == digits ? NULL : p;
+}
+
+/**
+ * Parses a line holding exactly one entry, "<hash>" or "<hash>,<offset>,
+ * <size>" with optional surrounding blanks; for such lines the sequential
+ * token parser gives the same result, anything else returns NULL so the
+ * section is parsed sequentially and reports its usual error
+ * @return end of the entry
+ */
+static const char *parse_entry_line(const char *p, const char *eol, 
+    Section_slice *s, uint32_t index)
+{
+    while (p < eol && is_space(*p))
+        p++;
+    if (eol - p < 64)
+    {
+        return NULL;
+    }
+    // no whitespace, null or control bytes inside the hash
+    const char *token = p;
+    for (int i = 0; i < 64; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        if (HAS_BELOW_BANG(w))
+        {
+            return NULL;
+        }
+    }
+    p += 64;
+    uint32_t offset = 0, size = 0;
+    if (s->is_chunk)
+    {
+        if (p == eol || *p++ != ',' 
+            || (p = parse_digits(p, eol, &offset)) == NULL 
+            || p == eol || *p++ != ',' 
+            || (p = parse_digits(p, eol, &size)) == NULL 
+            || size == 0)
+        {
+            return NULL;
+        }
+    }
+    const char *entry_end = p;
+    while (p < eol)
+    {
+        if (!is_space(*p++))
+        {
+            return NULL;
+        }
+    }
+    // non hex hashes go to the raw table, which is sequential
+    if (sha256_hex_to_digest(token, s->digests 
+        + (size_t)index * SHA256_DIGEST_SZ))
+    {
+        return NULL;
+    }
+    if (s->is_chunk)
+    {
+        s->offsets[index] = offset;
+        s->sizes[index] = size;
+    }
+    return entry_end;
+}
+
+static void *parse_slice(void *arg)
+{
+    Section_slice *s = (Section_slice *)arg;
+    const char *p = s->start;
+    for (uint32_t i = 0; i < s->count; i++)
+    {
+        const char *eol = memchr(p, '\n', s->end - p);
+        if (!eol)
+        {
+            eol = s->end;
+        }
+        s->last = parse_entry_line(p, eol, s, s->first + i);
+        if (!s->last)
+        {
+            s->failed = 1;
+            return NULL;
+        }
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+/**
+ * Parses the count entries of a hashes (is_chunk 0) or chunks section
+ * starting at pos on worker threads, each taking a run of lines and
+ * writing straight into its part of the arrays
+ * @return where the sequential cursor would be after the section, or NULL
+ *     if the section is small or not one entry per line, in which case the
+ *     caller parses it sequentially
+ */
+static const char *parse_section_parallel(const char *pos, const char *end, 
+    uint32_t count, int is_chunk, uint8_t *digests, uint32_t *offsets, 
+    uint32_t *sizes)
+{
+    long nthreads = atomic_load(&parse_threads);
+    if (nthreads == 0)
+    {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (count < PARALLEL_MIN_ENTRIES || nthreads < 2)
     {
-        fprintf(stderr, "Error opening file\n");
         return NULL;
     }
+    if (nthreads > PARALLEL_MAX_THREADS)
+    {
+        nthreads = PARALLEL_MAX_THREADS;
+    }
+    Section_slice slices[PARALLEL_MAX_THREADS];
+    memset(slices, 0, sizeof(slices));
+    // find the line boundaries of the slices, one memchr per line
+    uint32_t per_slice = (count + nthreads - 1) / nthreads;
+    const char *p = pos;
+    int n = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (i % per_slice == 0)
+        {
+            if (n > 0)
+            {
+                slices[n - 1].end = p;
+            }
+            slices[n].start = p;
+            slices[n].first = i;
+            n++;
+        }
+        slices[n - 1].count++;
+        if (p >= end)
+        {
+            // fewer lines than entries
+            return NULL;
+        }
+        const char *eol = memchr(p, '\n', end - p);
+        p = eol ? eol + 1 : end;
+    }
+    slices[n - 1].end = p;
+
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    int started[PARALLEL_MAX_THREADS] = {0};
+    for (int i = 0; i < n; i++)
+    {
+        slices[i].is_chunk = is_chunk;
+        slices[i].digests = digests;
+        slices[i].offsets = offsets;
+        slices[i].sizes = sizes;
+        // the last slice runs here, as does any that fails to start
+        if (i < n - 1 
+            && pthread_create(&threads[i], NULL, parse_slice, &slices[i]) == 0)
+        {
+            started[i] = 1;
+        }
+        else
+        {
+            parse_slice(&slices[i]);
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+        failed |= slices[i].failed;
+    }
+    return failed ? NULL : slices[n - 1].last;
+}
+
+/**
+ * Parses the mapped file in a single pass, with the same rules and error
+ * messages as the previous fgets/fscanf parser: lines are at most
+ * MAXLINELENGTH - 1 characters, keys are matched at the start of a line and
+ * the hash and chunk sections are read as whitespace separated tokens
+ * Only the header is parsed here, each section is taken to be nhashes or
+ * nchunks lines and its entries are checked when load_sections stores them
+ */
+static bpkg_obj *bpkg_parse(const char *data, size_t length)
+{
     // allocate memory for struct obj
     bpkg_obj *obj = calloc(1, sizeof(bpkg_obj));
     // alloc failed
     if (!obj)
     {
         fprintf(stderr, "Error allocating memory\n");
-        fclose(file);
         return NULL;
     }
+    pthread_mutex_init(&obj->sections_lock, NULL);
     // struct to make sure every field has been parsed
     ParseFlags flags = {0};
-    // create buffer with max size
-    char buf[MAXLINELENGTH];
-    // keep reading from file
-    while (fgets(buf, sizeof(buf), file) != NULL)
+    Bpkg_cursor c = {data, data + length};
+    while (c.pos < c.end)
     {
-        buf[strcspn(buf, "\n")] = 0;
+        // same line boundaries as fgets with a MAXLINELENGTH buffer
+        const char *line = c.pos;
+        size_t avail = c.end - line;
+        size_t max = avail < MAXLINELENGTH - 1 ? avail : MAXLINELENGTH - 1;
+        const char *eol = memchr(line, '\n', max);
+        size_t len = eol ? (size_t)(eol - line) : max;
+        c.pos = eol ? eol + 1 : line + max;
+        const char *line_end = line + len;
         // ident
-        if (strncmp(buf, "ident:", 6) == 0)
+        if (line_has_key(line, len, "ident:", 6))
         {
-            strncpy(obj->ident, buf + 6, sizeof(obj->ident) - 1);
             if (flags.ident == 0)
             {
                 flags.ident = 1;
+                if (bpkg_set_ident(obj, line + 6, len - 6))
+                {
+                    bpkg_obj_destroy(obj);
+                    return NULL;
+                }
             }
             else
             {
@@ -54,12 +507,16 @@ bpkg_obj *bpkg_load(const char *path)
             }
         }
         // filename
-        else if (strncmp(buf, "filename:", 9) == 0)
+        else if (line_has_key(line, len, "filename:", 9))
         {
-            strncpy(obj->filename, buf + 9, sizeof(obj->filename) - 1);
             if (flags.filename == 0)
             {
                 flags.filename = 1;
+                if (bpkg_set_filename(obj, line + 9, len - 9))
+                {
+                    bpkg_obj_destroy(obj);
+                    return NULL;
+                }
             }
             else
             {
@@ -69,9 +526,9 @@ bpkg_obj *bpkg_load(const char *path)
             }
         }
         // size
-        else if (strncmp(buf, "size:", 5) == 0)
+        else if (line_has_key(line, len, "size:", 5))
         {
-            obj->size = atoi(buf + 5);
+            obj->size = parse_atoi(line + 5, line_end);
             if (obj->size <= 0)
             {
                 fprintf(stderr, "Invalid size found\n");
@@ -90,9 +547,9 @@ bpkg_obj *bpkg_load(const char *path)
             }
         }
         // nhashes
-        else if (strncmp(buf, "nhashes:", 8) == 0)
+        else if (line_has_key(line, len, "nhashes:", 8))
         {
-            obj->nhashes = atoi(buf + 8);
+            obj->nhashes = parse_atoi(line + 8, line_end);
             if (obj->nhashes <= 0)
             {
                 fprintf(stderr, "Invalid number for nhashes\n");
@@ -111,7 +568,7 @@ bpkg_obj *bpkg_load(const char *path)
             }
         }
         // hashes
-        else if (strncmp(buf, "hashes:", 7) == 0)
+        else if (line_has_key(line, len, "hashes:", 7))
         {
             // if not intialised
             if (obj->nhashes <= 0)
@@ -119,7 +576,6 @@ bpkg_obj *bpkg_load(const char *path)
                 fprintf(stderr, "Attempted to store hashes before "
                     "nhashes was given\n");
                 bpkg_obj_destroy(obj);
-                fclose(file);
                 return NULL;
             }
             if (flags.hashes == 0)
@@ -132,51 +588,14 @@ bpkg_obj *bpkg_load(const char *path)
                 bpkg_obj_destroy(obj);
                 return NULL;
             }
-            // set up memory to store char*
-            obj->hashes = calloc(obj->nhashes, sizeof(char *));
-            // failed memory allocation
-            if (!obj->hashes)
-            {
-                fclose(file);
-                bpkg_obj_destroy(obj);
-                fprintf(stderr, "Memory allocation failed\n");
-                return NULL;
-            }
-            // get all n hashes
-            for (uint32_t i = 0; i < obj->nhashes; i++)
-            {
-                // allocate memory for string
-                obj->hashes[i] = malloc(HASHLENGTH);
-                // failed memory allocation or file not read correctly
-                if (!obj->hashes[i] || 
-                fscanf(file, "%64s", obj->hashes[i]) != 1 || 
-                strlen(obj->hashes[i]) != 64)
-                {
-                    fclose(file);
-                    // if its allocated so if its not length 64
-                    if (obj->hashes[i])
-                    {
-                        free(obj->hashes[i]);
-                    }
-                    // cleanup and free all
-                    for (uint32_t j = 0; j < i; j++)
-                    {
-                        free(obj->hashes[j]);
-                    }
-                    free(obj->hashes);
-                    // set to null so bpkgobj doesnt try free again
-                    obj->hashes = NULL;
-                    bpkg_obj_destroy(obj);
-                    fprintf(stderr, "File parsing error or "
-                    "memory allocation failed\n");
-                    return NULL;
-                }
-            }
+            // checked and stored by load_sections, one entry per line
+            obj->hashes_pos = c.pos - data;
+            c.pos = skip_lines(c.pos, c.end, obj->nhashes);
         }
         // nchunks
-        else if (strncmp(buf, "nchunks:", 8) == 0)
+        else if (line_has_key(line, len, "nchunks:", 8))
         {
-            obj->nchunks = atoi(buf + 8);
+            obj->nchunks = parse_atoi(line + 8, line_end);
             if (obj->nchunks <= 0)
             {
                 fprintf(stderr, "Invalid number for nchunks\n");
@@ -195,14 +614,13 @@ bpkg_obj *bpkg_load(const char *path)
             }
         }
         // chunks
-        else if (strncmp(buf, "chunks:", 7) == 0)
+        else if (line_has_key(line, len, "chunks:", 7))
         {
             // if not intialised
             if (obj->nchunks <= 0)
             {
                 fprintf(stderr, "Attempted to store chunks before "
                 "nchunks was given\n");
-                fclose(file);
                 bpkg_obj_destroy(obj);
                 return NULL;
             }
@@ -216,36 +634,11 @@ bpkg_obj *bpkg_load(const char *path)
                 bpkg_obj_destroy(obj);
                 return NULL;
             }
-            // allocate memory for structs
-            obj->chunks = calloc(obj->nchunks, sizeof(Chunk));
-            // failed memory allocation
-            if (!obj->chunks)
-            {
-                fclose(file);
-                bpkg_obj_destroy(obj);
-                fprintf(stderr, "Memory allocation failed\n");
-                return NULL;
-            }
-            // get all n chunks
-            for (uint32_t i = 0; i < obj->nchunks; i++)
-            {
-                // if file not read correctly
-                if (fscanf(file, "%64s,%u,%u", obj->chunks[i].hash, 
-                &obj->chunks[i].offset, &obj->chunks[i].size) != 3 || 
-                strlen(obj->chunks[i].hash) != 64 || 
-                obj->chunks[i].offset < 0 || 
-                obj->chunks[i].size <= 0)
-                {
-                    // cleanup
-                    fclose(file);
-                    bpkg_obj_destroy(obj);
-                    fprintf(stderr, "File parsing error\n");
-                    return NULL;
-                }
-            }
+            // checked and stored by load_sections, one entry per line
+            obj->chunks_pos = c.pos - data;
+            c.pos = skip_lines(c.pos, c.end, obj->nchunks);
         }
     }
-    fclose(file);
     // check all flags have been parsed
     if (!flags.ident || !flags.filename || !flags.size || !flags.nhashes 
     || !flags.hashes || !flags.nchunks || !flags.chunks)
@@ -257,20 +650,426 @@ bpkg_obj *bpkg_load(const char *path)
     return obj;
 }
 
+/**
+ * Loads the package for when a valid path is given
+ */
+bpkg_obj *bpkg_load(const char *path)
+{
+    // open in read mode
+    int fd = open(path, O_RDONLY);
+    // failed to open file
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error opening file\n");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "Error opening file\n");
+        close(fd);
+        return NULL;
+    }
+    // an empty file cannot be mapped, it just has no fields
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return bpkg_parse("", 0);
+    }
+    // map the whole manifest and parse it in place
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Error mapping file\n");
+        return NULL;
+    }
+    // a compiled manifest is used in place and keeps the mapping
+    if (bpkg_bin_detect(data, st.st_size))
+    {
+        bpkg_obj *obj = bpkg_bin_load(data, st.st_size);
+        if (!obj)
+        {
+            munmap(data, st.st_size);
+        }
+        return obj;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    bpkg_obj *obj = bpkg_parse(data, st.st_size);
+    if (!obj)
+    {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    // kept until the sections are loaded
+    obj->map = data;
+    obj->map_length = st.st_size;
+    return obj;
+}
+
+// checks and stores the sections of a text manifest, with the errors the
+// eager parser gave, then releases the mapping
+static int load_sections(bpkg_obj *obj)
+{
+    const char *data = obj->map;
+    // one block holding every digest
+    obj->hashes = malloc((size_t)obj->nhashes * SHA256_DIGEST_SZ);
+    // one block for the digest, offset and size arrays
+    obj->chunk_digests = malloc((size_t)obj->nchunks * 
+        (SHA256_DIGEST_SZ + 2 * sizeof(uint32_t)));
+    // failed memory allocation
+    if (!obj->hashes || !obj->chunk_digests)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    obj->chunk_offsets = (uint32_t *)(obj->chunk_digests 
+        + (size_t)obj->nchunks * SHA256_DIGEST_SZ);
+    obj->chunk_sizes = obj->chunk_offsets + obj->nchunks;
+
+    char hex[HASHLENGTH];
+    const char *end = data + obj->map_length;
+    Bpkg_cursor c = {data + obj->hashes_pos, end};
+    const char *after = parse_section_parallel(c.pos, end, obj->nhashes, 0, 
+        obj->hashes, NULL, NULL);
+    for (uint32_t i = 0; !after && i < obj->nhashes; i++)
+    {
+        // file not read correctly, a null byte ends the hash early
+        if (scan_token(&c, hex, HASHLENGTH - 1) != 64 
+            || memchr(hex, '\0', 64) != NULL)
+        {
+            fprintf(stderr, "File parsing error or "
+                "memory allocation failed\n");
+            return 1;
+        }
+        if (store_hash(obj, hex, obj->hashes 
+            + (size_t)i * SHA256_DIGEST_SZ, i, 0))
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 1;
+        }
+    }
+    c.pos = data + obj->chunks_pos;
+    after = parse_section_parallel(c.pos, end, obj->nchunks, 1, 
+        obj->chunk_digests, obj->chunk_offsets, obj->chunk_sizes);
+    for (uint32_t i = 0; !after && i < obj->nchunks; i++)
+    {
+        // "<hash>,<offset>,<size>"
+        if (scan_token(&c, hex, HASHLENGTH - 1) != 64 
+            || memchr(hex, '\0', 64) != NULL 
+            || !scan_char(&c, ',') 
+            || !scan_uint(&c, &obj->chunk_offsets[i]) 
+            || !scan_char(&c, ',') 
+            || !scan_uint(&c, &obj->chunk_sizes[i]) 
+            || obj->chunk_sizes[i] == 0)
+        {
+            fprintf(stderr, "File parsing error\n");
+            return 1;
+        }
+        if (store_hash(obj, hex, obj->chunk_digests 
+            + (size_t)i * SHA256_DIGEST_SZ, i, 1))
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 1;
+        }
+    }
+    munmap(obj->map, obj->map_length);
+    obj->map = NULL;
+    obj->map_length = 0;
+    return 0;
+}
+
+// double checked so loaded packages only pay for an atomic load
+int bpkg_load_sections(bpkg_obj *obj)
+{
+    int state = atomic_load_explicit(&obj->sections_state, 
+        memory_order_acquire);
+    if (state == BPKG_SECTIONS_PENDING)
+    {
+        pthread_mutex_lock(&obj->sections_lock);
+        state = atomic_load_explicit(&obj->sections_state, 
+            memory_order_relaxed);
+        if (state == BPKG_SECTIONS_PENDING)
+        {
+            state = load_sections(obj) ? BPKG_SECTIONS_FAILED 
+                : BPKG_SECTIONS_LOADED;
+            atomic_store_explicit(&obj->sections_state, state, 
+                memory_order_release);
+        }
+        pthread_mutex_unlock(&obj->sections_lock);
+    }
+    return state == BPKG_SECTIONS_LOADED ? 0 : 1;
+}
+
+// verbatim text of a hash that was not hex, NULL for normal hashes
+static const char *raw_hash(const bpkg_obj *obj, uint32_t i, int is_chunk)
+{
+    uint32_t r = raw_lower_bound(obj, i, is_chunk);
+    if (r < obj->nraw_hashes && obj->raw_hashes[r].index == i 
+        && obj->raw_hashes[r].is_chunk == is_chunk)
+    {
+        return obj->raw_hashes[r].hex;
+    }
+    return NULL;
+}
+
+void bpkg_hash_hex(const bpkg_obj *obj, uint32_t i, char out[HASHLENGTH])
+{
+    const char *raw = obj->nraw_hashes ? raw_hash(obj, i, 0) : NULL;
+    if (raw)
+    {
+        memcpy(out, raw, HASHLENGTH);
+        return;
+    }
+    sha256_digest_to_hex(bpkg_hash_digest(obj, i), out);
+    out[SHA256_HEXLEN] = '\0';
+}
+
+void bpkg_chunk_hash_hex(const bpkg_obj *obj, uint32_t i, 
+    char out[HASHLENGTH])
+{
+    const char *raw = obj->nraw_hashes ? raw_hash(obj, i, 1) : NULL;
+    if (raw)
+    {
+        memcpy(out, raw, HASHLENGTH);
+        return;
+    }
+    sha256_digest_to_hex(bpkg_chunk_digest(obj, i), out);
+    out[SHA256_HEXLEN] = '\0';
+}
+
+// digests are uniformly distributed, their first bytes make a good hash
+static uint32_t digest_slot(const uint8_t *digest, uint32_t mask)
+{
+    uint32_t key;
+    memcpy(&key, digest, sizeof(key));
+    return key & mask;
+}
+
+/**
+ * Builds the digest to chunk table, at most half full, a chunk whose digest
+ * repeats an earlier one is left out so the first is found as before
+ * Chunks whose hash was not hex cannot be looked up and are left out too
+ */
+static uint32_t *build_chunk_index(bpkg_obj *obj)
+{
+    uint32_t size = 16;
+    while (size < 2 * (uint64_t)obj->nchunks)
+    {
+        size *= 2;
+    }
+    uint32_t *slots = calloc(size, sizeof(uint32_t));
+    if (!slots)
+    {
+        return NULL;
+    }
+    uint32_t mask = size - 1;
+    for (uint32_t i = 0; i < obj->nchunks; i++)
+    {
+        if (obj->nraw_hashes && raw_hash(obj, i, 1) != NULL)
+        {
+            continue;
+        }
+        const uint8_t *digest = bpkg_chunk_digest(obj, i);
+        uint32_t slot = digest_slot(digest, mask);
+        while (slots[slot] != 0 && memcmp(bpkg_chunk_digest(obj, 
+            slots[slot] - 1), digest, SHA256_DIGEST_SZ) != 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+        if (slots[slot] == 0)
+        {
+            slots[slot] = i + 1;
+        }
+    }
+    obj->chunk_index_mask = mask;
+    return slots;
+}
+
+// the chunk table, built once under sections_lock, NULL if out of memory
+static uint32_t *chunk_index(bpkg_obj *obj)
+{
+    uint32_t *slots = atomic_load_explicit(&obj->chunk_index, 
+        memory_order_acquire);
+    if (slots == NULL)
+    {
+        pthread_mutex_lock(&obj->sections_lock);
+        slots = atomic_load_explicit(&obj->chunk_index, 
+            memory_order_relaxed);
+        if (slots == NULL)
+        {
+            slots = build_chunk_index(obj);
+            atomic_store_explicit(&obj->chunk_index, slots, 
+                memory_order_release);
+        }
+        pthread_mutex_unlock(&obj->sections_lock);
+    }
+    return slots;
+}
+
+void bpkg_index_chunks(bpkg_obj *obj)
+{
+    if (bpkg_load_sections(obj) == 0)
+    {
+        chunk_index(obj);
+    }
+}
+
+int bpkg_root_digest(bpkg_obj *obj, uint8_t digest[SHA256_DIGEST_SZ])
+{
+    pthread_mutex_lock(&obj->sections_lock);
+    int state = atomic_load(&obj->sections_state);
+    int result = 1;
+    if (state == BPKG_SECTIONS_PENDING)
+    {
+        // the manifest stays mapped until the sections are loaded
+        char hex[HASHLENGTH];
+        Bpkg_cursor c = {(const char *)obj->map + obj->hashes_pos, 
+            (const char *)obj->map + obj->map_length};
+        scan_token(&c, hex, HASHLENGTH - 1);
+        result = sha256_hex_to_digest(hex, digest);
+    }
+    else if (state == BPKG_SECTIONS_LOADED)
+    {
+        memcpy(digest, bpkg_hash_digest(obj, 0), SHA256_DIGEST_SZ);
+        result = obj->nraw_hashes && raw_hash(obj, 0, 0) != NULL;
+    }
+    pthread_mutex_unlock(&obj->sections_lock);
+    return result;
+}
+
+int64_t bpkg_find_chunk(bpkg_obj *obj, const char *hash)
+{
+    uint8_t digest[SHA256_DIGEST_SZ];
+    if (bpkg_load_sections(obj) || sha256_hex_to_digest(hash, digest))
+    {
+        return -1;
+    }
+    uint32_t *slots = chunk_index(obj);
+    if (slots == NULL)
+    {
+        // compares binary digests so each chunk costs a 32 byte memcmp
+        for (uint32_t i = 0; i < obj->nchunks; i++)
+        {
+            if (memcmp(bpkg_chunk_digest(obj, i), digest, 
+                SHA256_DIGEST_SZ) == 0
+                && (obj->nraw_hashes == 0 || raw_hash(obj, i, 1) == NULL))
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+    uint32_t mask = obj->chunk_index_mask;
+    for (uint32_t slot = digest_slot(digest, mask); slots[slot] != 0; 
+        slot = (slot + 1) & mask)
+    {
+        uint32_t i = slots[slot] - 1;
+        if (memcmp(bpkg_chunk_digest(obj, i), digest, SHA256_DIGEST_SZ) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
 int bpkg_intialise_merkle(bpkg_obj *obj)
+{
+    return bpkg_intialise_merkle_job(obj, NULL);
+}
+
+int bpkg_intialise_merkle_job(bpkg_obj *obj, Merkle_build_job *job)
 {
     // intialise the merkle tree
-    obj->merkle = intialise_merkle_tree(obj);
+    obj->merkle = intialise_merkle_tree_job(obj, job);
+    obj->merkle_used = time(NULL);
     // if something went wrong
     if (obj->merkle == NULL)
     {
-        fprintf(stderr, "Error intialising merkle tree\n");
+        // a cancelled build is not an error
+        if (!merkle_job_cancelled(job))
+        {
+            fprintf(stderr, "Error intialising merkle tree\n");
+        }
         bpkg_obj_destroy(obj);
         return 1;
     }
     return 0;
 }
 
+Merkle_tree *bpkg_merkle(bpkg_obj *obj)
+{
+    if (!obj->merkle && obj->merkle_evicted)
+    {
+        obj->merkle = merkle_tree_from_digests(obj);
+        if (!obj->merkle)
+        {
+            return NULL;
+        }
+        obj->merkle_evicted = 0;
+    }
+    obj->merkle_used = time(NULL);
+    return obj->merkle;
+}
+
+void bpkg_defer_merkle(bpkg_obj *obj)
+{
+    obj->merkle_evicted = 1;
+}
+
+// only evicted when every leaf matches its chunk hash, then the rebuilt
+// tree hashes the same leaves and comes out identical
+int bpkg_evict_merkle(bpkg_obj *obj)
+{
+    if (!obj->merkle || !merkle_node_complete(obj, obj->merkle->root))
+    {
+        return 0;
+    }
+    for (uint32_t i = 0; i < obj->nchunks; i++)
+    {
+        if (!merkle_node_complete(obj, &obj->merkle->nodes[i]))
+        {
+            return 0;
+        }
+    }
+    destroy_merkle_tree(obj->merkle);
+    obj->merkle = NULL;
+    obj->merkle_evicted = 1;
+    return 1;
+}
+
+int bpkg_is_complete(bpkg_obj *obj)
+{
+    if (obj->merkle_evicted)
+    {
+        return 1;
+    }
+    return obj->merkle && merkle_node_complete(obj, obj->merkle->root);
+}
+
+void bpkg_memory_usage(const bpkg_obj *obj, Bpkg_memory *mem)
+{
+    memset(mem, 0, sizeof(*mem));
+    mem->object = sizeof(bpkg_obj);
+    mem->strings = strpool_share(obj->ident) + strpool_share(obj->filename);
+    int loaded = atomic_load(&obj->sections_state) == BPKG_SECTIONS_LOADED;
+    if (!obj->compiled && loaded)
+    {
+        mem->hashes = (size_t)obj->nhashes * SHA256_DIGEST_SZ;
+        mem->chunks = (size_t)obj->nchunks 
+            * (SHA256_DIGEST_SZ + 2 * sizeof(uint32_t));
+        mem->raw_hashes = (size_t)obj->nraw_hashes * sizeof(Bpkg_raw_hash);
+    }
+    if (atomic_load(&obj->chunk_index))
+    {
+        mem->chunks += ((size_t)obj->chunk_index_mask + 1) * sizeof(uint32_t);
+    }
+    mem->tree = merkle_tree_memory(obj->merkle);
+    mem->mapped = obj->map_length;
+    mem->total = mem->object + mem->strings + mem->hashes + mem->chunks 
+        + mem->raw_hashes + mem->tree;
+}
+
 /**
  * Checks to see if the referenced filename in the bpkg file
  * exists or not.
@@ -341,6 +1140,10 @@ bpkg_query bpkg_file_check(bpkg_obj *bpkg)
 // for debugging
 void print_bpkg_obj(const bpkg_obj *obj, const char *output_path)
 {
+    if (bpkg_load_sections((bpkg_obj *)obj))
+    {
+        return;
+    }
     FILE *fp = fopen(output_path, "w");
     if (!fp)
     {
@@ -353,12 +1156,14 @@ void print_bpkg_obj(const bpkg_obj *obj, const char *output_path)
     fprintf(fp, "size:%u\n", obj->size);
     fprintf(fp, "nhashes:%u\n", obj->nhashes);
 
+    char hex[HASHLENGTH];
     if (obj->nhashes > 0)
     {
         fprintf(fp, "hashes:\n");
         for (uint32_t i = 0; i < obj->nhashes; i++)
         {
-            fprintf(fp, "\t%s\n", obj->hashes[i]);
+            bpkg_hash_hex(obj, i, hex);
+            fprintf(fp, "\t%s\n", hex);
         }
     }
 
@@ -368,8 +1173,9 @@ void print_bpkg_obj(const bpkg_obj *obj, const char *output_path)
         fprintf(fp, "chunks:\n");
         for (uint32_t i = 0; i < obj->nchunks; i++)
         {
-            fprintf(fp, "\t%s,%u,%u\n", obj->chunks[i].hash, 
-            obj->chunks[i].offset, obj->chunks[i].size);
+            bpkg_chunk_hash_hex(obj, i, hex);
+            fprintf(fp, "\t%s,%u,%u\n", hex, bpkg_chunk_offset(obj, i), 
+            bpkg_chunk_size(obj, i));
         }
     }
 
@@ -392,7 +1198,7 @@ bpkg_query bpkg_get_all_hashes(bpkg_obj *bpkg)
         fprintf(stderr, "Error with bpkg_obj fields\n");
         exit(EXIT_FAILURE);
     }
-    query.len = bpkg->merkle->n_nodes;
+    query.len = bpkg_merkle(bpkg)->n_nodes;
     return query;
 }
 
@@ -486,24 +1292,22 @@ void bpkg_obj_destroy(bpkg_obj *obj)
 {
     if (obj)
     {
-        if (obj->merkle)
-        {
-            destroy_merkle_tree(obj->merkle->root);
-            free(obj->merkle);
-        }
-        if (obj->hashes)
+        destroy_merkle_tree(obj->merkle);
+        strpool_release(obj->ident);
+        strpool_release(obj->filename);
+        if (!obj->compiled)
         {
-            for (uint32_t i = 0; i < obj->nhashes; i++)
-            {
-                if (obj->hashes[i])
-                    free(obj->hashes[i]);
-            }
+            // offsets and sizes live in the chunk_digests block
             free(obj->hashes);
+            free(obj->chunk_digests);
+            free(obj->raw_hashes);
         }
-        if (obj->chunks)
+        if (obj->map)
         {
-            free(obj->chunks);
+            munmap(obj->map, obj->map_length);
         }
+        free(atomic_load(&obj->chunk_index));
+        pthread_mutex_destroy(&obj->sections_lock);
         free(obj);
     }
 }
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "chk/strpool.h"
+
+#define STRPOOL_MIN_BUCKETS 64
+
+typedef struct Pool_string
+{
+    struct Pool_string *next;
+    uint32_t hash;
+    uint32_t refs;
+    size_t len;
+    char str[];
+} Pool_string;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static Pool_string **buckets = NULL;
+static size_t nbuckets = 0;
+static size_t nstrings = 0;
+
+// FNV-1a
+static uint32_t hash_bytes(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static Pool_string *header_of(const char *s)
+{
+    return (Pool_string *)(s - offsetof(Pool_string, str));
+}
+
+// doubles the bucket array once there are more strings than buckets,
+// a failed resize just leaves the chains longer
+static void maybe_grow(void)
+{
+    if (nstrings < nbuckets)
+    {
+        return;
+    }
+    size_t grown = nbuckets ? nbuckets * 2 : STRPOOL_MIN_BUCKETS;
+    Pool_string **table = calloc(grown, sizeof(Pool_string *));
+    if (!table)
+    {
+        return;
+    }
+    for (size_t b = 0; b < nbuckets; b++)
+    {
+        Pool_string *entry = buckets[b];
+        while (entry)
+        {
+            Pool_string *next = entry->next;
+            entry->next = table[entry->hash & (grown - 1)];
+            table[entry->hash & (grown - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(buckets);
+    buckets = table;
+    nbuckets = grown;
+}
+
+const char *strpool_intern(const char *s, size_t len)
+{
+    uint32_t hash = hash_bytes(s, len);
+    pthread_mutex_lock(&pool_lock);
+    maybe_grow();
+    if (nbuckets == 0)
+    {
+        pthread_mutex_unlock(&pool_lock);
+        fprintf(stderr, "Error allocating memory\n");
+        return NULL;
+    }
+    Pool_string **slot = &buckets[hash & (nbuckets - 1)];
+    for (Pool_string *entry = *slot; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->len == len
+            && memcmp(entry->str, s, len) == 0)
+        {
+            entry->refs++;
+            pthread_mutex_unlock(&pool_lock);
+            return entry->str;
+        }
+    }
+    Pool_string *entry = malloc(sizeof(Pool_string) + len + 1);
+    if (!entry)
+    {
+        pthread_mutex_unlock(&pool_lock);
+        fprintf(stderr, "Error allocating memory\n");
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->refs = 1;
+    entry->len = len;
+    memcpy(entry->str, s, len);
+    entry->str[len] = '\0';
+    entry->next = *slot;
+    *slot = entry;
+    nstrings++;
+    pthread_mutex_unlock(&pool_lock);
+    return entry->str;
+}
+
+void strpool_release(const char *s)
+{
+    if (!s)
+    {
+        return;
+    }
+    Pool_string *entry = header_of(s);
+    pthread_mutex_lock(&pool_lock);
+    if (--entry->refs > 0)
+    {
+        pthread_mutex_unlock(&pool_lock);
+        return;
+    }
+    Pool_string **cursor = &buckets[entry->hash & (nbuckets - 1)];
+    while (*cursor != entry)
+    {
+        cursor = &(*cursor)->next;
+    }
+    *cursor = entry->next;
+    nstrings--;
+    pthread_mutex_unlock(&pool_lock);
+    free(entry);
+}
+
+size_t strpool_share(const char *s)
+{
+    if (!s)
+    {
+        return 0;
+    }
+    Pool_string *entry = header_of(s);
+    pthread_mutex_lock(&pool_lock);
+    size_t share = (sizeof(Pool_string) + entry->len + 1) / entry->refs;
+    pthread_mutex_unlock(&pool_lock);
+    return share;
+}
@@ -1,4 +1,5 @@
 #include "config/config.h"
+#include "net/reactor.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +18,15 @@ int parse_config(char *path, Config *cfg)
 
     char buf[MAXLINELENGTH];
     int parsed[3] = {0};
+    // optional fields
+    int parsed_autoload = 0;
+    int parsed_persist = 0;
+    int parsed_reactors = 0;
+    int parsed_window = 0;
+    cfg->autoload[0] = '\0';
+    cfg->persist = 0;
+    cfg->reactors = 1;
+    cfg->fetch_window = DEFAULT_FETCH_WINDOW;
 
     // keep parsing
     while (fgets(buf, sizeof(buf), file) != NULL)
@@ -100,6 +110,88 @@ int parse_config(char *path, Config *cfg)
                 return 5;
             }
         }
+        else if (strncmp(buf, "autoload:", 9) == 0)
+        {
+            // check duplicate entry
+            if (parsed_autoload == 0)
+            {
+                parsed_autoload = 1;
+            }
+            else
+            {
+                fprintf(stderr, "Duplicate entry for autoload\n");
+                fclose(file);
+                return 1;
+            }
+            strncpy(cfg->autoload, buf + 9, MAXLINELENGTH - 1);
+            cfg->autoload[MAXLINELENGTH - 1] = '\0';
+        }
+        else if (strncmp(buf, "persist:", 8) == 0)
+        {
+            // check duplicate entry
+            if (parsed_persist == 0)
+            {
+                parsed_persist = 1;
+            }
+            else
+            {
+                fprintf(stderr, "Duplicate entry for persist\n");
+                fclose(file);
+                return 1;
+            }
+            // either on or off
+            if (strcmp(buf + 8, "0") != 0 && strcmp(buf + 8, "1") != 0)
+            {
+                fprintf(stderr, "Invalid value parsed for persist\n");
+                fclose(file);
+                return 1;
+            }
+            cfg->persist = buf[8] == '1';
+        }
+        else if (strncmp(buf, "reactors:", 9) == 0)
+        {
+            // check duplicate entry
+            if (parsed_reactors == 0)
+            {
+                parsed_reactors = 1;
+            }
+            else
+            {
+                fprintf(stderr, "Duplicate entry for reactors\n");
+                fclose(file);
+                return 1;
+            }
+            cfg->reactors = atoi(buf + 9);
+            // check within bounds [1, MAXREACTORS]
+            if (cfg->reactors < 1 || cfg->reactors > MAXREACTORS)
+            {
+                fprintf(stderr, "Invalid number parsed for reactors\n");
+                fclose(file);
+                return 1;
+            }
+        }
+        else if (strncmp(buf, "fetch_window:", 13) == 0)
+        {
+            // check duplicate entry
+            if (parsed_window == 0)
+            {
+                parsed_window = 1;
+            }
+            else
+            {
+                fprintf(stderr, "Duplicate entry for fetch_window\n");
+                fclose(file);
+                return 1;
+            }
+            cfg->fetch_window = atoi(buf + 13);
+            // check within bounds [1, MAXFETCHWINDOW]
+            if (cfg->fetch_window < 1 || cfg->fetch_window > MAXFETCHWINDOW)
+            {
+                fprintf(stderr, "Invalid number parsed for fetch_window\n");
+                fclose(file);
+                return 1;
+            }
+        }
         else
         {
             // unknown field
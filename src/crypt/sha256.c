@@ -2,6 +2,7 @@
 #include <crypt/sha256.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #define SHA256K 64
 #define rotate_r(val, bits) (val >> bits | val << (32 - bits))
@@ -227,3 +228,63 @@ void sha256_output_hex(struct sha256_compute_data *data,
 	sha256_output(data, hash);
 	bin_to_hex(hash, 32, hexbuf);
 }
+
+void sha256_digest_to_hex(const uint8_t digest[SHA256_DIGEST_SZ],
+						  char hexbuf[SHA256_CHUNK_SZ])
+{
+	bin_to_hex(digest, SHA256_DIGEST_SZ, hexbuf);
+}
+
+// hex character values plus one, 0 marks characters that are not hex
+// only lowercase, the form bin_to_hex writes, so a digest round trips to
+// the exact string it was parsed from
+static const uint8_t hex_table[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16
+};
+
+// byte value plus one for every pair of hex characters (read as a
+// little endian uint16), 0 if either is not hex; built on first use so
+// a digest decodes with one lookup per byte
+static uint16_t hex_pair_table[65536];
+static pthread_once_t hex_pair_once = PTHREAD_ONCE_INIT;
+
+static void build_hex_pair_table(void)
+{
+	for (uint32_t hi = 0; hi < 256; hi++)
+	{
+		for (uint32_t lo = 0; lo < 256; lo++)
+		{
+			uint16_t value = 0;
+			if (hex_table[hi] && hex_table[lo])
+			{
+				value = (uint16_t)(((hex_table[hi] - 1) << 4 
+					| (hex_table[lo] - 1)) + 1);
+			}
+			hex_pair_table[hi | lo << 8] = value;
+		}
+	}
+}
+
+int sha256_hex_to_digest(const char *hex, uint8_t digest[SHA256_DIGEST_SZ])
+{
+	pthread_once(&hex_pair_once, build_hex_pair_table);
+	const uint8_t *in = (const uint8_t *)hex;
+	for (uint32_t i = 0; i < SHA256_DIGEST_SZ; i++)
+	{
+		// in[1] is past the terminator when in[0] is it
+		if (in[0] == '\0')
+		{
+			return 1;
+		}
+		uint16_t value = hex_pair_table[in[0] | in[1] << 8];
+		if (value == 0)
+		{
+			return 1;
+		}
+		digest[i] = (uint8_t)(value - 1);
+		in += 2;
+	}
+	return 0;
+}
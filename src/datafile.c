@@ -0,0 +1,71 @@
+#include "package/datafile.h"
+#include "pool/epoch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * bpkg_obj.file is read without a lock. A file taken off a package keeps
+ * the package's reference until every reader that could still have loaded
+ * it has left its epoch, so a reference is never taken on a closed file
+ */
+static void detach(Package_file *file)
+{
+    if (file)
+    {
+        epoch_synchronize();
+        datafile_put(file);
+    }
+}
+
+int datafile_open(bpkg_obj *obj)
+{
+    Package_file *file = malloc(sizeof(Package_file));
+    if (!file)
+    {
+        perror("Malloc failed");
+        return 1;
+    }
+    file->fd = open(obj->filename, O_RDWR);
+    if (file->fd < 0)
+    {
+        perror("Failed to open package data file");
+        free(file);
+        return 1;
+    }
+    atomic_init(&file->refs, 1);
+    detach(atomic_exchange(&obj->file, file));
+    return 0;
+}
+
+Package_file *datafile_get(bpkg_obj *obj)
+{
+    epoch_enter();
+    Package_file *file = atomic_load(&obj->file);
+    if (file)
+    {
+        atomic_fetch_add(&file->refs, 1);
+    }
+    epoch_exit();
+    return file;
+}
+
+void datafile_hold(Package_file *file)
+{
+    atomic_fetch_add(&file->refs, 1);
+}
+
+void datafile_put(Package_file *file)
+{
+    if (file && atomic_fetch_sub(&file->refs, 1) == 1)
+    {
+        close(file->fd);
+        free(file);
+    }
+}
+
+void datafile_close(bpkg_obj *obj)
+{
+    detach(atomic_exchange(&obj->file, NULL));
+}
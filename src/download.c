@@ -0,0 +1,953 @@
+#define _POSIX_C_SOURCE 200809L
+#include "package/download.h"
+#include "config/config.h"
+#include "package/have.h"
+#include "package/package.h"
+#include "peer/peer.h"
+#include "net/wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+// a peer that refuses this many chunks before sending any is assumed not to
+// have the package and leaves the download
+#define REFUSE_LIMIT 16
+// peer slots a download can hold, owner and helper are int16_t
+#define MAXSWARMPEERS 32767
+
+typedef enum
+{
+    CHUNK_WAITING,
+    CHUNK_REQUESTED,
+    CHUNK_DONE,
+    // gave up after DOWNLOAD_ATTEMPTS or no peer has it
+    CHUNK_FAILED
+} Chunk_state;
+
+typedef struct
+{
+    int socket;
+    // 0 once the peer has left the download
+    int active;
+    uint32_t inflight;
+    // REQs it may have outstanding, halved when one times out and moved
+    // by one towards its share of fetch_window per chunk it delivers
+    uint32_t window;
+    // order entries before this are taken or lacked by the peer
+    uint32_t scan;
+    uint32_t received;
+    uint32_t refused;
+    // smoothed seconds from a REQ to the chunk's last piece
+    double latency;
+    // have queries not answered yet, the peer gets no REQs until they are
+    uint32_t probes;
+    // when the first have query was sent
+    double probed;
+    // bitmap of the positions the peer refused or said it does not have,
+    // NULL until there is one
+    uint8_t *lacks;
+} Swarm_peer;
+
+typedef struct Download
+{
+    bpkg_obj *obj;
+    int quiet;
+    uint32_t count;
+    // chunk indices in increasing order, the arrays below are indexed by
+    // position in it
+    uint32_t *chunks;
+    uint8_t *state;
+    uint8_t *attempts;
+    // on the retry stack
+    uint8_t *queued;
+    // peers in the download that have not refused the chunk
+    uint16_t *available;
+    // peers asked for a requested chunk, the helper only in the endgame
+    int16_t *owner;
+    int16_t *helper;
+    // when the owner was asked for the chunk
+    double *sent;
+    // positions rarest first, entries before cursor are all taken
+    uint32_t *order;
+    uint32_t cursor;
+    // availability changed since order was sorted
+    int dirty;
+    // positions to request again
+    uint32_t *retry;
+    uint32_t nretry;
+    // positions requested when nothing was left to hand out, which idle
+    // peers may request as well
+    uint32_t *endgame;
+    uint32_t nendgame;
+    int in_endgame;
+    Swarm_peer *peers;
+    int npeers;
+    int peers_size;
+    uint32_t done;
+    uint32_t failed;
+    // when it started and when its last chunk was settled
+    struct timespec started;
+    struct timespec ended;
+    struct Download *next;
+} Download;
+
+// a REQ to send once download_lock is released, sending may block
+typedef struct
+{
+    bpkg_obj *obj;
+    int socket;
+    uint32_t chunk;
+    // a have query for the whole package rather than a REQ
+    int probe;
+} Pending_req;
+
+typedef struct
+{
+    Pending_req *reqs;
+    size_t len;
+    size_t size;
+} Pending;
+
+static pthread_mutex_t download_lock = PTHREAD_MUTEX_INITIALIZER;
+static Download *downloads = NULL;
+static int window = DEFAULT_FETCH_WINDOW;
+// availability the order is sorted by, only used under download_lock
+static const uint16_t *sort_available;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void download_set_window(int size)
+{
+    pthread_mutex_lock(&download_lock);
+    window = size > 0 ? size : DEFAULT_FETCH_WINDOW;
+    pthread_mutex_unlock(&download_lock);
+}
+
+static void download_free(Download *d)
+{
+    for (int i = 0; i < d->npeers; i++)
+    {
+        free(d->peers[i].lacks);
+    }
+    free(d->peers);
+    free(d->chunks);
+    free(d->state);
+    free(d->attempts);
+    free(d->queued);
+    free(d->available);
+    free(d->owner);
+    free(d->helper);
+    free(d->sent);
+    free(d->order);
+    free(d->retry);
+    free(d->endgame);
+    free(d);
+}
+
+// position of the first chunk of the download from chunk on
+static uint32_t lower_bound(const Download *d, uint32_t chunk)
+{
+    uint32_t low = 0;
+    uint32_t high = d->count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (d->chunks[mid] < chunk)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// position of chunk in the download, -1 if it is not part of it
+static int64_t find_position(const Download *d, uint32_t chunk)
+{
+    uint32_t pos = lower_bound(d, chunk);
+    return pos < d->count && d->chunks[pos] == chunk ? (int64_t)pos : -1;
+}
+
+// slot of the peer on socket, also once it has left, -1 if it never joined
+static int find_peer(const Download *d, int socket)
+{
+    for (int i = 0; i < d->npeers; i++)
+    {
+        if (d->peers[i].socket == socket)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int lacks(const Swarm_peer *p, uint32_t pos)
+{
+    return p->lacks && (p->lacks[pos / 8] >> (pos % 8)) & 1;
+}
+
+/**
+ * The peer delivered a chunk, sample is how long it took or 0 if the peer
+ * was only helping with it. A peer slower than the fastest one is given a
+ * window that much smaller, so that fewer chunks wait behind it
+ */
+static void delivered(Download *d, int peer, double sample)
+{
+    Swarm_peer *p = &d->peers[peer];
+    if (sample > 0)
+    {
+        p->latency = p->latency > 0 ? 0.8 * p->latency + 0.2 * sample
+            : sample;
+    }
+    p->received++;
+    double fastest = p->latency;
+    for (int i = 0; i < d->npeers; i++)
+    {
+        Swarm_peer *other = &d->peers[i];
+        if (other->active && other->latency > 0
+            && other->latency < fastest)
+        {
+            fastest = other->latency;
+        }
+    }
+    uint32_t cap = window;
+    if (p->latency > 0)
+    {
+        cap = window * fastest / p->latency;
+        cap = cap > 0 ? cap : 1;
+    }
+    if (p->window < cap)
+    {
+        p->window++;
+    }
+    else if (p->window > cap)
+    {
+        p->window--;
+    }
+}
+
+static void add_pending(Pending *pending, const Download *d, int peer,
+    uint32_t pos, int probe)
+{
+    if (pending->len == pending->size)
+    {
+        size_t grown = pending->size ? pending->size * 2 : 64;
+        Pending_req *reqs = realloc(pending->reqs,
+            grown * sizeof(Pending_req));
+        if (!reqs)
+        {
+            perror("Realloc failed");
+            return;
+        }
+        pending->reqs = reqs;
+        pending->size = grown;
+    }
+    // sent once the lock is dropped, the package may be removed by then
+    package_hold(d->obj);
+    pending->reqs[pending->len++] = (Pending_req){
+        d->obj, d->peers[peer].socket, d->chunks[pos], probe
+    };
+}
+
+// the peer is no longer asked for the chunk
+static void release(Download *d, uint32_t pos, int peer)
+{
+    if (d->owner[pos] == peer)
+    {
+        d->owner[pos] = d->helper[pos];
+    }
+    else if (d->helper[pos] != peer)
+    {
+        return;
+    }
+    d->helper[pos] = -1;
+    d->peers[peer].inflight--;
+}
+
+static void settle(Download *d, uint32_t pos, Chunk_state state)
+{
+    while (d->owner[pos] >= 0)
+    {
+        release(d, pos, d->owner[pos]);
+    }
+    d->state[pos] = state;
+    if (state == CHUNK_DONE)
+    {
+        d->done++;
+    }
+    else
+    {
+        d->failed++;
+    }
+}
+
+// a chunk no peer is asked for any more goes back to be requested again
+static void requeue(Download *d, uint32_t pos)
+{
+    if (d->available[pos] == 0)
+    {
+        settle(d, pos, CHUNK_FAILED);
+        return;
+    }
+    d->state[pos] = CHUNK_WAITING;
+    if (!d->queued[pos])
+    {
+        d->queued[pos] = 1;
+        d->retry[d->nretry++] = pos;
+    }
+}
+
+// a requested chunk went unanswered or arrived corrupted
+static void retry_or_fail(Download *d, uint32_t pos)
+{
+    if (d->attempts[pos] >= DOWNLOAD_ATTEMPTS)
+    {
+        settle(d, pos, CHUNK_FAILED);
+        return;
+    }
+    requeue(d, pos);
+}
+
+// the last peer asked for the chunk let go of it through no fault of the
+// chunk, it does not count as an attempt
+static void give_back(Download *d, uint32_t pos)
+{
+    if (d->attempts[pos] > 0)
+    {
+        d->attempts[pos]--;
+    }
+    requeue(d, pos);
+}
+
+static int add_peer(Download *d, int socket, Pending *pending)
+{
+    int peer = find_peer(d, socket);
+    if (peer >= 0 && d->peers[peer].active)
+    {
+        return 0;
+    }
+    // a new connection may reuse the socket of one that left
+    if (peer < 0 && d->npeers == d->peers_size)
+    {
+        int grown = d->peers_size ? d->peers_size * 2 : 4;
+        Swarm_peer *peers = grown <= MAXSWARMPEERS
+            ? realloc(d->peers, grown * sizeof(Swarm_peer)) : NULL;
+        if (!peers)
+        {
+            fprintf(stderr, "Download has no room for another peer\n");
+            return 1;
+        }
+        d->peers = peers;
+        d->peers_size = grown;
+    }
+    if (peer < 0)
+    {
+        peer = d->npeers++;
+    }
+    d->peers[peer] = (Swarm_peer){
+        .socket = socket,
+        .active = 1,
+        .window = window,
+        .scan = d->cursor
+    };
+    // a peer that can say which chunks it has is asked before any REQ
+    if (!d->quiet && (wire_mode(socket).flags & WIRE_HAVE))
+    {
+        d->peers[peer].probes = 1;
+        d->peers[peer].probed = now();
+        add_pending(pending, d, peer, 0, 1);
+    }
+    for (uint32_t pos = 0; pos < d->count; pos++)
+    {
+        d->available[pos]++;
+        // nobody had it before, the new peer may
+        if (d->state[pos] == CHUNK_FAILED && d->available[pos] == 1
+            && d->attempts[pos] < DOWNLOAD_ATTEMPTS)
+        {
+            d->failed--;
+            requeue(d, pos);
+        }
+    }
+    return 0;
+}
+
+static void drop_peer(Download *d, int peer)
+{
+    Swarm_peer *p = &d->peers[peer];
+    for (uint32_t pos = 0; pos < d->count; pos++)
+    {
+        if (!lacks(p, pos))
+        {
+            d->available[pos]--;
+            d->dirty = 1;
+        }
+        if (d->state[pos] == CHUNK_REQUESTED
+            && (d->owner[pos] == peer || d->helper[pos] == peer))
+        {
+            release(d, pos, peer);
+            if (d->owner[pos] < 0)
+            {
+                give_back(d, pos);
+            }
+        }
+        else if (d->state[pos] == CHUNK_WAITING && d->available[pos] == 0)
+        {
+            settle(d, pos, CHUNK_FAILED);
+        }
+    }
+    free(p->lacks);
+    p->lacks = NULL;
+    p->active = 0;
+    p->inflight = 0;
+    p->probes = 0;
+}
+
+static void set_lacks(Download *d, int peer, uint32_t pos)
+{
+    Swarm_peer *p = &d->peers[peer];
+    if (!p->lacks)
+    {
+        p->lacks = calloc((d->count + 7) / 8, 1);
+    }
+    if (p->lacks && !lacks(p, pos))
+    {
+        p->lacks[pos / 8] |= 1 << (pos % 8);
+        d->available[pos]--;
+        d->dirty = 1;
+    }
+}
+
+// the peer does not have the chunk, other peers are asked for it instead
+static void mark_lacking(Download *d, int peer, uint32_t pos)
+{
+    set_lacks(d, peer, pos);
+    if (d->state[pos] == CHUNK_REQUESTED
+        && (d->owner[pos] == peer || d->helper[pos] == peer))
+    {
+        // asking the same peer again would not help, others may
+        release(d, pos, peer);
+        if (d->owner[pos] < 0)
+        {
+            give_back(d, pos);
+        }
+    }
+    else if (d->state[pos] == CHUNK_WAITING && d->available[pos] == 0)
+    {
+        settle(d, pos, CHUNK_FAILED);
+    }
+}
+
+static int compare_rarity(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    if (sort_available[x] != sort_available[y])
+    {
+        return sort_available[x] < sort_available[y] ? -1 : 1;
+    }
+    return x < y ? -1 : x > y;
+}
+
+// puts the chunks not handed out yet rarest first
+static void sort_order(Download *d)
+{
+    sort_available = d->available;
+    qsort(d->order + d->cursor, d->count - d->cursor, sizeof(uint32_t),
+        compare_rarity);
+    for (int i = 0; i < d->npeers; i++)
+    {
+        d->peers[i].scan = d->cursor;
+    }
+    d->dirty = 0;
+}
+
+// next chunk for the peer, rarest first, -1 if none is left
+static int64_t pick(Download *d, int peer)
+{
+    Swarm_peer *p = &d->peers[peer];
+    for (uint32_t i = d->nretry; i-- > 0;)
+    {
+        uint32_t pos = d->retry[i];
+        if (d->state[pos] != CHUNK_WAITING || !lacks(p, pos))
+        {
+            d->retry[i] = d->retry[--d->nretry];
+            d->queued[pos] = 0;
+            if (d->state[pos] == CHUNK_WAITING)
+            {
+                return pos;
+            }
+        }
+    }
+    while (d->cursor < d->count
+        && d->state[d->order[d->cursor]] != CHUNK_WAITING)
+    {
+        d->cursor++;
+    }
+    if (p->scan < d->cursor)
+    {
+        p->scan = d->cursor;
+    }
+    for (; p->scan < d->count; p->scan++)
+    {
+        uint32_t pos = d->order[p->scan];
+        if (d->state[pos] == CHUNK_WAITING && !lacks(p, pos))
+        {
+            p->scan++;
+            return pos;
+        }
+    }
+    return -1;
+}
+
+/**
+ * With nothing left to hand out, an idle peer also requests a chunk that
+ * another peer has had for twice the idle peer's usual time, or at once if
+ * that peer is twice as slow, whichever copy arrives first completes it
+ */
+static int64_t steal(Download *d, int peer, double t)
+{
+    Swarm_peer *p = &d->peers[peer];
+    if (p->latency == 0)
+    {
+        return -1;
+    }
+    if (!d->in_endgame)
+    {
+        d->in_endgame = 1;
+        d->endgame = malloc(d->count * sizeof(uint32_t));
+        for (uint32_t pos = 0; d->endgame && pos < d->count; pos++)
+        {
+            if (d->state[pos] == CHUNK_REQUESTED)
+            {
+                d->endgame[d->nendgame++] = pos;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < d->nendgame;)
+    {
+        uint32_t pos = d->endgame[i];
+        if (d->state[pos] != CHUNK_REQUESTED)
+        {
+            d->endgame[i] = d->endgame[--d->nendgame];
+            continue;
+        }
+        if (d->helper[pos] < 0 && d->owner[pos] != peer && !lacks(p, pos)
+            && (t - d->sent[pos] > 2 * p->latency
+            || d->peers[d->owner[pos]].latency > 2 * p->latency))
+        {
+            return pos;
+        }
+        i++;
+    }
+    return -1;
+}
+
+// fills every peer's window, called with download_lock held after every
+// change
+static void pump(Download *d, Pending *pending)
+{
+    if (d->done + d->failed == d->count)
+    {
+        // download_tick reports it later
+        if (d->ended.tv_sec == 0 && d->ended.tv_nsec == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &d->ended);
+        }
+        return;
+    }
+    double t = now();
+    // one chunk per peer per round spreads the rarest over every peer
+    for (int given = 1; given;)
+    {
+        given = 0;
+        for (int i = 0; i < d->npeers; i++)
+        {
+            Swarm_peer *p = &d->peers[i];
+            if (!p->active || p->probes > 0 || p->inflight >= p->window)
+            {
+                continue;
+            }
+            int64_t pos = pick(d, i);
+            if (pos >= 0)
+            {
+                d->state[pos] = CHUNK_REQUESTED;
+                d->attempts[pos]++;
+                d->owner[pos] = i;
+                d->sent[pos] = t;
+            }
+            else if (!d->quiet && (pos = steal(d, i, t)) >= 0)
+            {
+                d->helper[pos] = i;
+            }
+            else
+            {
+                continue;
+            }
+            p->inflight++;
+            add_pending(pending, d, i, pos, 0);
+            given = 1;
+        }
+    }
+}
+
+static void send_pending(Pending *pending)
+{
+    int failed = -1;
+    for (size_t i = 0; i < pending->len; i++)
+    {
+        Pending_req *req = &pending->reqs[i];
+        if (req->socket == failed)
+        {
+            // its chunks were already handed to the other peers
+            package_put(req->obj);
+            continue;
+        }
+        if (req->probe)
+        {
+            // without its own tree it cannot ask, it just sends REQs
+            if (have_start(req->socket, req->obj) != 0)
+            {
+                download_peer_lacks(req->obj, req->socket, NULL, 0, 0);
+            }
+            package_put(req->obj);
+            continue;
+        }
+        char hash[HASHLENGTH];
+        bpkg_chunk_hash_hex(req->obj, req->chunk, hash);
+        if (send_req_packet(req->socket, req->obj->ident, hash,
+            bpkg_chunk_offset(req->obj, req->chunk),
+            bpkg_chunk_size(req->obj, req->chunk)) != 0)
+        {
+            // rather than waiting out DOWNLOAD_TIMEOUT, the chunks it was
+            // asked for are given back without costing an attempt
+            failed = req->socket;
+            download_peer_left(req->socket);
+        }
+        package_put(req->obj);
+    }
+    free(pending->reqs);
+}
+
+static Download *download_alloc(uint32_t *chunks, uint32_t count)
+{
+    Download *d = calloc(1, sizeof(Download));
+    if (!d)
+    {
+        return NULL;
+    }
+    d->chunks = chunks;
+    d->count = count;
+    d->state = calloc(count, sizeof(uint8_t));
+    d->attempts = calloc(count, sizeof(uint8_t));
+    d->queued = calloc(count, sizeof(uint8_t));
+    d->available = calloc(count, sizeof(uint16_t));
+    d->owner = malloc(count * sizeof(int16_t));
+    d->helper = malloc(count * sizeof(int16_t));
+    d->sent = calloc(count, sizeof(double));
+    d->order = malloc(count * sizeof(uint32_t));
+    d->retry = malloc(count * sizeof(uint32_t));
+    if (!d->state || !d->attempts || !d->queued || !d->available
+        || !d->owner || !d->helper || !d->sent || !d->order || !d->retry)
+    {
+        download_free(d);
+        return NULL;
+    }
+    for (uint32_t pos = 0; pos < count; pos++)
+    {
+        d->owner[pos] = -1;
+        d->helper[pos] = -1;
+        d->order[pos] = pos;
+    }
+    return d;
+}
+
+int download_start(bpkg_obj *obj, const int *sockets, int nsockets,
+    uint32_t *chunks, uint32_t count, int quiet)
+{
+    Download *d = download_alloc(chunks, count);
+    if (!d)
+    {
+        perror("Calloc failed");
+        free(chunks);
+        return 1;
+    }
+    d->obj = obj;
+    d->quiet = quiet;
+    clock_gettime(CLOCK_MONOTONIC, &d->started);
+
+    Pending pending = {0};
+    pthread_mutex_lock(&download_lock);
+    for (int i = 0; i < nsockets; i++)
+    {
+        add_peer(d, sockets[i], &pending);
+    }
+    d->next = downloads;
+    downloads = d;
+    pump(d, &pending);
+    pthread_mutex_unlock(&download_lock);
+    send_pending(&pending);
+    return 0;
+}
+
+int download_active(const bpkg_obj *obj)
+{
+    int active = 0;
+    pthread_mutex_lock(&download_lock);
+    for (Download *d = downloads; d != NULL && !active; d = d->next)
+    {
+        active = d->obj == obj && !d->quiet;
+    }
+    pthread_mutex_unlock(&download_lock);
+    return active;
+}
+
+void download_chunk_received(bpkg_obj *obj, int socket, uint32_t chunk,
+    int verified)
+{
+    Pending pending = {0};
+    double t = now();
+    pthread_mutex_lock(&download_lock);
+    for (Download *d = downloads; d != NULL; d = d->next)
+    {
+        int64_t pos = d->obj == obj ? find_position(d, chunk) : -1;
+        if (pos < 0)
+        {
+            continue;
+        }
+        int peer = find_peer(d, socket);
+        int asked = peer >= 0 && d->state[pos] == CHUNK_REQUESTED
+            && (d->owner[pos] == peer || d->helper[pos] == peer);
+        if (verified && asked)
+        {
+            delivered(d, peer, d->owner[pos] == peer ? t - d->sent[pos] : 0);
+        }
+        if (verified && (d->state[pos] == CHUNK_REQUESTED
+            || d->state[pos] == CHUNK_WAITING))
+        {
+            settle(d, pos, CHUNK_DONE);
+        }
+        else if (!verified && asked)
+        {
+            // a peer sending data that does not match has no good copy
+            set_lacks(d, peer, pos);
+            release(d, pos, peer);
+            if (d->owner[pos] < 0)
+            {
+                retry_or_fail(d, pos);
+            }
+        }
+        pump(d, &pending);
+    }
+    pthread_mutex_unlock(&download_lock);
+    send_pending(&pending);
+}
+
+int download_chunk_refused(bpkg_obj *obj, int socket, uint32_t chunk)
+{
+    int expected = 0;
+    Pending pending = {0};
+    pthread_mutex_lock(&download_lock);
+    for (Download *d = downloads; d != NULL; d = d->next)
+    {
+        int64_t pos = d->obj == obj ? find_position(d, chunk) : -1;
+        int peer = pos >= 0 ? find_peer(d, socket) : -1;
+        if (peer < 0)
+        {
+            continue;
+        }
+        Swarm_peer *p = &d->peers[peer];
+        expected |= !d->quiet;
+        // REQs still answered after it was dropped
+        if (!p->active)
+        {
+            continue;
+        }
+        p->refused++;
+        mark_lacking(d, peer, pos);
+        if (p->received == 0 && p->refused >= REFUSE_LIMIT)
+        {
+            drop_peer(d, peer);
+        }
+        pump(d, &pending);
+    }
+    pthread_mutex_unlock(&download_lock);
+    send_pending(&pending);
+    return expected;
+}
+
+int download_peer_probing(bpkg_obj *obj, int socket)
+{
+    int probing = 0;
+    pthread_mutex_lock(&download_lock);
+    for (Download *d = downloads; d != NULL && !probing; d = d->next)
+    {
+        int peer = d->obj == obj ? find_peer(d, socket) : -1;
+        probing = peer >= 0 && d->peers[peer].active
+            && d->peers[peer].probes > 0;
+    }
+    pthread_mutex_unlock(&download_lock);
+    return probing;
+}
+
+void download_peer_lacks(bpkg_obj *obj, int socket, const uint32_t *ranges,
+    int nranges, int queries)
+{
+    Pending pending = {0};
+    pthread_mutex_lock(&download_lock);
+    for (Download *d = downloads; d != NULL; d = d->next)
+    {
+        int peer = d->obj == obj ? find_peer(d, socket) : -1;
+        if (peer < 0 || !d->peers[peer].active || d->peers[peer].probes == 0)
+        {
+            continue;
+        }
+        for (int i = 0; i < nranges; i++)
+        {
+            for (uint32_t pos = lower_bound(d, ranges[2 * i]);
+                pos < d->count && d->chunks[pos] <= ranges[2 * i + 1]; pos++)
+            {
+                mark_lacking(d, peer, pos);
+            }
+        }
+        Swarm_peer *p = &d->peers[peer];
+        p->probes += queries;
+        p->probes--;
+        pump(d, &pending);
+    }
+    pthread_mutex_unlock(&download_lock);
+    send_pending(&pending);
+}
+
+static void report(const Download *d)
+{
+    if (d->quiet)
+    {
+        return;
+    }
+    int sources = 0;
+    for (int i = 0; i < d->npeers; i++)
+    {
+        sources += d->peers[i].received > 0;
+    }
+    double elapsed = (d->ended.tv_sec - d->started.tv_sec)
+        + (d->ended.tv_nsec - d->started.tv_nsec) / 1e9;
+    printf("Fetched %u of %u chunks of %.32s from %d peer%s in %.2fs\n",
+        d->done, d->count, d->obj->ident, sources, sources == 1 ? "" : "s",
+        elapsed);
+    if (d->failed > 0)
+    {
+        printf("%u chunks could not be fetched\n", d->failed);
+    }
+}
+
+void download_tick(void)
+{
+    Pending pending = {0};
+    double t = now();
+    pthread_mutex_lock(&download_lock);
+    Download **link = &downloads;
+    while (*link != NULL)
+    {
+        Download *d = *link;
+        // a peer that stops answering have queries is just sent REQs
+        for (int i = 0; i < d->npeers; i++)
+        {
+            Swarm_peer *p = &d->peers[i];
+            if (p->probes > 0 && p->probed + DOWNLOAD_TIMEOUT <= t)
+            {
+                p->probes = 0;
+            }
+        }
+        for (uint32_t pos = 0; pos < d->count; pos++)
+        {
+            if (d->state[pos] != CHUNK_REQUESTED
+                || d->sent[pos] + DOWNLOAD_TIMEOUT > t)
+            {
+                continue;
+            }
+            // the peers that let it time out get fewer REQs
+            for (int peer = d->owner[pos]; peer >= 0; peer = d->owner[pos])
+            {
+                Swarm_peer *p = &d->peers[peer];
+                p->window = p->window > 1 ? p->window / 2 : 1;
+                release(d, pos, peer);
+            }
+            retry_or_fail(d, pos);
+        }
+        if (d->dirty)
+        {
+            sort_order(d);
+        }
+        pump(d, &pending);
+        if (d->done + d->failed == d->count)
+        {
+            *link = d->next;
+            report(d);
+            download_free(d);
+            continue;
+        }
+        link = &d->next;
+    }
+    pthread_mutex_unlock(&download_lock);
+    send_pending(&pending);
+}
+
+void download_peer_joined(int socket)
+{
+    Pending pending = {0};
+    pthread_mutex_lock(&download_lock);
+    for (Download *d = downloads; d != NULL; d = d->next)
+    {
+        if (!d->quiet && !add_peer(d, socket, &pending))
+        {
+            pump(d, &pending);
+        }
+    }
+    pthread_mutex_unlock(&download_lock);
+    send_pending(&pending);
+}
+
+void download_peer_left(int socket)
+{
+    Pending pending = {0};
+    pthread_mutex_lock(&download_lock);
+    for (Download *d = downloads; d != NULL; d = d->next)
+    {
+        int peer = find_peer(d, socket);
+        if (peer >= 0 && d->peers[peer].active)
+        {
+            drop_peer(d, peer);
+            pump(d, &pending);
+        }
+    }
+    pthread_mutex_unlock(&download_lock);
+    send_pending(&pending);
+}
+
+void download_cancel_package(bpkg_obj *obj)
+{
+    pthread_mutex_lock(&download_lock);
+    Download **link = &downloads;
+    while (*link != NULL)
+    {
+        Download *d = *link;
+        if (d->obj == obj)
+        {
+            *link = d->next;
+            download_free(d);
+            continue;
+        }
+        link = &d->next;
+    }
+    pthread_mutex_unlock(&download_lock);
+}
@@ -0,0 +1,115 @@
+#include "package/have.h"
+#include "package/package.h"
+#include "package/download.h"
+#include "peer/peer.h"
+#include "net/wire.h"
+#include <string.h>
+
+// bytes per node in each kind of have packet
+static size_t entry_size(const struct btide_packet *packet)
+{
+    return packet->msg_code == WIRE_MSG_HAVE_REPLY
+        ? sizeof(uint32_t) + 1 : sizeof(uint32_t);
+}
+
+// number of nodes in a have packet, capped to what fits
+static uint16_t node_count(const struct btide_packet *packet)
+{
+    uint16_t count;
+    memcpy(&count, packet->pl.data, sizeof(uint16_t));
+    return count > HAVE_BATCH ? HAVE_BATCH : count;
+}
+
+void have_ident(const struct btide_packet *packet, char *ident)
+{
+    size_t pos = sizeof(uint16_t) + node_count(packet) * entry_size(packet);
+    memcpy(ident, packet->pl.data + pos, HAVE_IDENT);
+    ident[HAVE_IDENT] = '\0';
+}
+
+// reads the nodes, and the answers of a reply, out of a have packet
+static uint16_t read_nodes(const struct btide_packet *packet,
+    uint32_t *nodes, uint8_t *have)
+{
+    uint16_t count = node_count(packet);
+    const uint8_t *data = packet->pl.data + sizeof(uint16_t);
+    for (uint16_t i = 0; i < count; i++)
+    {
+        memcpy(&nodes[i], data, sizeof(uint32_t));
+        data += sizeof(uint32_t);
+        if (have)
+        {
+            have[i] = *data++;
+        }
+    }
+    return count;
+}
+
+// sends count nodes in as many queries as they need
+static int send_queries(int socket, bpkg_obj *obj, const uint32_t *nodes,
+    int count)
+{
+    int queries = 0;
+    for (int i = 0; i < count; i += HAVE_BATCH)
+    {
+        int batch = count - i < HAVE_BATCH ? count - i : HAVE_BATCH;
+        send_have_packet(socket, obj->ident, nodes + i, NULL, batch);
+        queries++;
+    }
+    return queries;
+}
+
+int have_start(int socket, bpkg_obj *obj)
+{
+    int64_t root = package_have_root(obj);
+    if (root < 0)
+    {
+        return 1;
+    }
+    uint32_t node = root;
+    send_queries(socket, obj, &node, 1);
+    return 0;
+}
+
+void have_answer(int socket, bpkg_obj *obj,
+    const struct btide_packet *packet)
+{
+    uint32_t nodes[HAVE_BATCH];
+    uint8_t have[HAVE_BATCH];
+    uint16_t count = read_nodes(packet, nodes, NULL);
+    char ident[HAVE_IDENT + 1];
+    have_ident(packet, ident);
+    if (obj)
+    {
+        package_have(obj, nodes, have, count);
+    }
+    else
+    {
+        memset(have, MERKLE_HAVE_UNKNOWN, count);
+    }
+    send_have_packet(socket, ident, nodes, have, count);
+}
+
+void have_reply(int socket, bpkg_obj *obj,
+    const struct btide_packet *packet)
+{
+    // answers that come after the download moved on are of no use
+    if (!obj || !download_peer_probing(obj, socket))
+    {
+        return;
+    }
+    uint32_t nodes[HAVE_BATCH];
+    uint8_t have[HAVE_BATCH];
+    uint16_t count = read_nodes(packet, nodes, have);
+    uint32_t next[2 * HAVE_BATCH];
+    uint32_t lacking[2 * HAVE_BATCH];
+    int nnext;
+    int nlacking;
+    package_have_reply(obj, nodes, have, count, next, &nnext, lacking,
+        &nlacking);
+    // the download hears of the queries first, their answers come in on
+    // this same reactor thread after this one
+    download_peer_lacks(obj, socket, lacking, nlacking,
+        (nnext + HAVE_BATCH - 1) / HAVE_BATCH);
+    send_queries(socket, obj, next, nnext);
+}
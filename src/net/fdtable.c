@@ -0,0 +1,84 @@
+#include "net/fdtable.h"
+#include "pool/epoch.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Fd_slots
+{
+    size_t size;
+    _Atomic uint64_t values[];
+};
+
+uint64_t fd_table_get(Fd_table *table, int fd)
+{
+    uint64_t value = 0;
+    epoch_enter();
+    Fd_slots *slots = atomic_load(&table->slots);
+    if (fd >= 0 && slots && (size_t)fd < slots->size)
+    {
+        value = atomic_load(&slots->values[fd]);
+    }
+    epoch_exit();
+    return value;
+}
+
+int fd_table_set(Fd_table *table, int fd, uint64_t value)
+{
+    if (fd < 0)
+    {
+        return 1;
+    }
+    pthread_mutex_lock(&table->lock);
+    Fd_slots *slots = atomic_load(&table->slots);
+    Fd_slots *old = NULL;
+    size_t size = slots ? slots->size : 0;
+    if ((size_t)fd >= size)
+    {
+        size_t grown = size ? size : 64;
+        while (grown <= (size_t)fd)
+        {
+            grown *= 2;
+        }
+        Fd_slots *bigger = calloc(1,
+            sizeof(Fd_slots) + grown * sizeof(uint64_t));
+        if (!bigger)
+        {
+            perror("Calloc failed");
+            pthread_mutex_unlock(&table->lock);
+            return 1;
+        }
+        bigger->size = grown;
+        // every store is made under the lock, so none is lost in the copy
+        for (size_t i = 0; i < size; i++)
+        {
+            atomic_init(&bigger->values[i], atomic_load(&slots->values[i]));
+        }
+        atomic_store(&table->slots, bigger);
+        old = slots;
+        slots = bigger;
+    }
+    atomic_store(&slots->values[fd], value);
+    pthread_mutex_unlock(&table->lock);
+    if (old)
+    {
+        epoch_synchronize();
+        free(old);
+    }
+    return 0;
+}
+
+size_t fd_table_size(Fd_table *table)
+{
+    pthread_mutex_lock(&table->lock);
+    Fd_slots *slots = atomic_load(&table->slots);
+    size_t size = slots ? slots->size : 0;
+    pthread_mutex_unlock(&table->lock);
+    return size;
+}
+
+void fd_table_free(Fd_table *table)
+{
+    pthread_mutex_lock(&table->lock);
+    free(atomic_exchange(&table->slots, NULL));
+    pthread_mutex_unlock(&table->lock);
+}
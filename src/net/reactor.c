@@ -0,0 +1,644 @@
+#define _GNU_SOURCE
+#include "net/reactor.h"
+#include "net/wire.h"
+#include "net/sendq.h"
+#include "peer/peer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define MAXEVENTS 64
+// bytes read per recv, packets are reassembled from them, the buffer grows
+// for jumbo frames
+#define RECVBUFFER (16 * WIRE_MAX_FRAME)
+
+typedef enum
+{
+    CONN_LISTENER,
+    // accepted, waiting for the ACK
+    CONN_HANDSHAKE,
+    CONN_PEER
+} Conn_state;
+
+typedef struct
+{
+    int fd;
+    Conn_state state;
+    struct sockaddr_in address;
+    int reactor;
+    // reactor_close has queued it, its packets are ignored
+    int closing;
+    // its send queue (net/sendq.h) waits for the socket to be writable
+    int writing;
+    // its send queue is over SENDQ_HIGH, it is not read from
+    int throttled;
+    // wire encoding agreed in the handshake (net/wire.h)
+    Wire_mode wire;
+    // bytes received that do not yet make up a whole frame
+    size_t buffered;
+    size_t capacity;
+    uint8_t *buffer;
+} Connection;
+
+typedef struct
+{
+    int epoll_fd;
+    // written to wake the loop for queued closes and for stopping
+    int wake_fd;
+    pthread_t thread;
+    int *close_queue;
+    size_t nclose;
+    size_t close_size;
+} Reactor;
+
+static Reactor reactors[MAXREACTORS];
+static int nreactors = 0;
+static Reactor_handlers handlers;
+static Connection listener;
+static atomic_int stopping = 0;
+static unsigned next_reactor = 0;
+// connections by fd, also guards every close queue
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static Connection **conns = NULL;
+static size_t conns_size = 0;
+
+// records a connection in the fd table, called with conn_lock held
+static int table_put(Connection *conn)
+{
+    if ((size_t)conn->fd >= conns_size)
+    {
+        size_t grown = conns_size ? conns_size : 64;
+        while (grown <= (size_t)conn->fd)
+        {
+            grown *= 2;
+        }
+        Connection **table = realloc(conns, grown * sizeof(Connection *));
+        if (!table)
+        {
+            perror("Realloc failed");
+            return 1;
+        }
+        memset(table + conns_size, 0,
+            (grown - conns_size) * sizeof(Connection *));
+        conns = table;
+        conns_size = grown;
+    }
+    conns[conn->fd] = conn;
+    return 0;
+}
+
+// sets the events a connection is watched for, called with conn_lock held
+static void update_events(Connection *conn)
+{
+    struct epoll_event event = {
+        .events = (conn->throttled ? 0 : EPOLLIN)
+            | (conn->writing ? EPOLLOUT : 0),
+        .data.ptr = conn
+    };
+    epoll_ctl(reactors[conn->reactor].epoll_fd, EPOLL_CTL_MOD, conn->fd,
+        &event);
+}
+
+static void wake(Reactor *reactor)
+{
+    uint64_t one = 1;
+    if (write(reactor->wake_fd, &one, sizeof(one)) < 0)
+    {
+        perror("Waking reactor failed");
+    }
+}
+
+// starts watching fd on the next reactor in turn
+static int watch(int fd, Conn_state state, struct sockaddr_in *address)
+{
+    Connection *conn = calloc(1, sizeof(Connection));
+    uint8_t *buffer = malloc(RECVBUFFER);
+    if (!conn || !buffer)
+    {
+        perror("Calloc failed");
+        free(conn);
+        free(buffer);
+        return 1;
+    }
+    conn->buffer = buffer;
+    conn->capacity = RECVBUFFER;
+    conn->fd = fd;
+    // frames go out from the send queue only as far as the socket takes them
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    sendq_open(fd);
+    conn->state = state;
+    conn->wire = wire_mode(fd);
+    if (address)
+    {
+        conn->address = *address;
+    }
+    conn->reactor = __atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED)
+        % nreactors;
+    pthread_mutex_lock(&conn_lock);
+    int failed = table_put(conn);
+    pthread_mutex_unlock(&conn_lock);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+    if (failed || epoll_ctl(reactors[conn->reactor].epoll_fd, EPOLL_CTL_ADD,
+        fd, &event) != 0)
+    {
+        pthread_mutex_lock(&conn_lock);
+        if (!failed)
+        {
+            conns[fd] = NULL;
+        }
+        pthread_mutex_unlock(&conn_lock);
+        sendq_close(fd);
+        free(conn->buffer);
+        free(conn);
+        return 1;
+    }
+    // frames queued before it was watched, or while it was being added,
+    // unless its reactor already dropped it
+    pthread_mutex_lock(&conn_lock);
+    if (conns[fd] == conn && (conn->writing || sendq_pending(fd) > 0))
+    {
+        conn->writing = 1;
+        update_events(conn);
+    }
+    pthread_mutex_unlock(&conn_lock);
+    return 0;
+}
+
+/**
+ * Stops watching a connection on its own reactor thread, the fd is only
+ * closed if close_fd is set, peers that hung up stay open for the peer list
+ */
+static void unwatch(Reactor *reactor, Connection *conn, int close_fd)
+{
+    pthread_mutex_lock(&conn_lock);
+    conns[conn->fd] = NULL;
+    pthread_mutex_unlock(&conn_lock);
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    if (close_fd)
+    {
+        // a DSN queued by DISCONNECT still goes out if the socket takes it
+        sendq_flush(conn->fd);
+    }
+    sendq_close(conn->fd);
+    if (close_fd)
+    {
+        close(conn->fd);
+    }
+    free(conn->buffer);
+    free(conn);
+}
+
+static void accept_peer(void)
+{
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+    int fd = accept(listener.fd, (struct sockaddr *)&address, &addrlen);
+    if (fd < 0)
+    {
+        perror("Accept failed");
+        return;
+    }
+    wire_set_mode(fd, WIRE_LEGACY);
+    send_acp_packet(fd);
+    if (watch(fd, CONN_HANDSHAKE, &address))
+    {
+        close(fd);
+    }
+}
+
+// hands one whole frame on, nonzero if the connection was dropped
+static int dispatch(Reactor *reactor, Connection *conn,
+    struct btide_packet *packet, Wire_res *res)
+{
+    if (conn->state == CONN_HANDSHAKE)
+    {
+        // wait for ACK before adding the peer
+        if (packet->msg_code != PKT_MSG_ACK)
+        {
+            unwatch(reactor, conn, 1);
+            return 1;
+        }
+        // later packets use the encoding the ACK accepted, including the
+        // REQs queued as soon as the peer joins a running download
+        conn->wire = wire_hello_mode(packet);
+        wire_set_mode(conn->fd, conn->wire);
+        if (handlers.ready(conn->fd, conn->address))
+        {
+            unwatch(reactor, conn, 1);
+            return 1;
+        }
+        conn->state = CONN_PEER;
+        return 0;
+    }
+    int failed = packet->msg_code == WIRE_MSG_JUMBO_RES
+        ? handlers.res(conn->fd, res) : handlers.packet(conn->fd, packet);
+    if (failed)
+    {
+        unwatch(reactor, conn, 1);
+        return 1;
+    }
+    return 0;
+}
+
+// makes room for the frame at the start of the buffer, nonzero if it is
+// malformed or there is no memory for it
+static int fit_frame(Connection *conn)
+{
+    // a buffer grown for a jumbo frame goes back to RECVBUFFER once empty,
+    // so an idle peer does not keep a frame's worth of memory
+    if (conn->buffered == 0 && conn->capacity > RECVBUFFER)
+    {
+        uint8_t *buffer = malloc(RECVBUFFER);
+        if (buffer)
+        {
+            free(conn->buffer);
+            conn->buffer = buffer;
+            conn->capacity = RECVBUFFER;
+        }
+        return 0;
+    }
+    long frame = wire_frame_length(conn->buffer, conn->buffered, &conn->wire);
+    if (frame < 0)
+    {
+        fprintf(stderr, "Malformed packet from peer\n");
+        return 1;
+    }
+    if ((size_t)frame <= conn->capacity)
+    {
+        return 0;
+    }
+    uint8_t *buffer = realloc(conn->buffer, frame);
+    if (!buffer)
+    {
+        perror("Realloc failed");
+        return 1;
+    }
+    conn->buffer = buffer;
+    conn->capacity = frame;
+    return 0;
+}
+
+/**
+ * Dispatches every whole frame in the receive buffer, a frame split over
+ * several reads waits in the buffer for the rest
+ * Stops while the peer's send queue is over SENDQ_HIGH, the frames left
+ * are dispatched once it drains
+ * @return nonzero if the connection was dropped
+ */
+static int dispatch_buffered(Reactor *reactor, Connection *conn)
+{
+    size_t used = 0;
+    int throttled = 0;
+    while (used < conn->buffered && !throttled)
+    {
+        struct btide_packet packet;
+        Wire_res res;
+        long length = wire_decode(conn->buffer + used, conn->buffered - used,
+            &conn->wire, &packet, &res);
+        if (length < 0)
+        {
+            fprintf(stderr, "Malformed packet from peer\n");
+            unwatch(reactor, conn, 1);
+            return 1;
+        }
+        if (length == 0)
+        {
+            break;
+        }
+        used += length;
+        if (dispatch(reactor, conn, &packet, &res))
+        {
+            return 1;
+        }
+        throttled = sendq_pending(conn->fd) > SENDQ_HIGH;
+    }
+    memmove(conn->buffer, conn->buffer + used, conn->buffered - used);
+    conn->buffered -= used;
+    if (throttled)
+    {
+        // the peer's REQs wait in its socket until it reads what it asked for
+        pthread_mutex_lock(&conn_lock);
+        conn->throttled = 1;
+        update_events(conn);
+        pthread_mutex_unlock(&conn_lock);
+    }
+    if (fit_frame(conn))
+    {
+        unwatch(reactor, conn, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Reads what the socket has without blocking and dispatches every whole
+ * frame in it, the epoll set is level triggered so anything left in the
+ * socket comes back on the next wait
+ */
+static void read_packets(Reactor *reactor, Connection *conn)
+{
+    ssize_t num_bytes = recv(conn->fd, conn->buffer + conn->buffered,
+        conn->capacity - conn->buffered, MSG_DONTWAIT);
+    if (num_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+        || errno == EINTR))
+    {
+        return;
+    }
+    pthread_mutex_lock(&conn_lock);
+    int closing = conn->closing;
+    pthread_mutex_unlock(&conn_lock);
+    // left for drain_close_queue
+    if (closing)
+    {
+        return;
+    }
+    if (num_bytes <= 0)
+    {
+        // hung up, a peer keeps its place in the list until DISCONNECT
+        int fd = conn->fd;
+        int peer = conn->state == CONN_PEER;
+        unwatch(reactor, conn, !peer);
+        if (peer)
+        {
+            handlers.hangup(fd);
+        }
+        return;
+    }
+    conn->buffered += num_bytes;
+    dispatch_buffered(reactor, conn);
+}
+
+/**
+ * Writes the connection's send queue as far as the socket takes it, and
+ * reads from the peer again once the queue has drained under SENDQ_LOW
+ * @return nonzero if the connection was dropped
+ */
+static int write_queued(Reactor *reactor, Connection *conn)
+{
+    long left = sendq_flush(conn->fd);
+    pthread_mutex_lock(&conn_lock);
+    int resumed = conn->throttled && left < SENDQ_LOW;
+    if (left <= 0)
+    {
+        conn->writing = 0;
+    }
+    if (resumed)
+    {
+        conn->throttled = 0;
+    }
+    update_events(conn);
+    pthread_mutex_unlock(&conn_lock);
+    // a frame queued during the flush found it still writing
+    if (left <= 0 && sendq_pending(conn->fd) > 0)
+    {
+        reactor_want_write(conn->fd);
+    }
+    return resumed ? dispatch_buffered(reactor, conn) : 0;
+}
+
+// closes the connections other threads handed to reactor_close
+static void drain_close_queue(Reactor *reactor)
+{
+    uint64_t count;
+    if (read(reactor->wake_fd, &count, sizeof(count)) < 0)
+    {
+        perror("Reading reactor wakeup failed");
+    }
+    pthread_mutex_lock(&conn_lock);
+    size_t nclose = reactor->nclose;
+    int *queue = reactor->close_queue;
+    reactor->close_queue = NULL;
+    reactor->nclose = 0;
+    reactor->close_size = 0;
+    pthread_mutex_unlock(&conn_lock);
+    for (size_t i = 0; i < nclose; i++)
+    {
+        pthread_mutex_lock(&conn_lock);
+        Connection *conn = (size_t)queue[i] < conns_size
+            ? conns[queue[i]] : NULL;
+        pthread_mutex_unlock(&conn_lock);
+        if (conn)
+        {
+            unwatch(reactor, conn, 1);
+        }
+    }
+    free(queue);
+}
+
+static void *reactor_loop(void *arg)
+{
+    Reactor *reactor = (Reactor *)arg;
+    struct epoll_event events[MAXEVENTS];
+    while (!stopping)
+    {
+        int n = epoll_wait(reactor->epoll_fd, events, MAXEVENTS, -1);
+        int woken = 0;
+        for (int i = 0; i < n && !stopping; i++)
+        {
+            Connection *conn = (Connection *)events[i].data.ptr;
+            if (conn == NULL)
+            {
+                woken = 1;
+            }
+            else if (conn->state == CONN_LISTENER)
+            {
+                accept_peer();
+            }
+            else
+            {
+                // written first, reading may drop the connection
+                if ((events[i].events & EPOLLOUT)
+                    && write_queued(reactor, conn))
+                {
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                {
+                    read_packets(reactor, conn);
+                }
+            }
+        }
+        // after the batch, which may still hold events for the queued ones
+        if (woken)
+        {
+            drain_close_queue(reactor);
+        }
+    }
+    return NULL;
+}
+
+// spreads the reactors over the cpus, failing to pin is not an error
+static void pin_reactor(int i)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 1)
+    {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(i % ncpu, &set);
+    pthread_setaffinity_np(reactors[i].thread, sizeof(set), &set);
+}
+
+int reactor_start(int listen_fd, int count,
+    const Reactor_handlers *callbacks)
+{
+    if (count < 1 || count > MAXREACTORS)
+    {
+        count = 1;
+    }
+    handlers = *callbacks;
+    stopping = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Reactor *reactor = &reactors[i];
+        memset(reactor, 0, sizeof(Reactor));
+        reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        reactor->wake_fd = eventfd(0, EFD_CLOEXEC);
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+        if (reactor->epoll_fd < 0 || reactor->wake_fd < 0
+            || epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd,
+                &event) != 0)
+        {
+            perror("Creating reactor failed");
+            nreactors = i + 1;
+            reactor_stop();
+            return 1;
+        }
+    }
+    nreactors = count;
+    // the first reactor accepts
+    listener.fd = listen_fd;
+    listener.state = CONN_LISTENER;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &listener };
+    if (epoll_ctl(reactors[0].epoll_fd, EPOLL_CTL_ADD, listen_fd, &event))
+    {
+        perror("Watching listener failed");
+        reactor_stop();
+        return 1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_loop,
+            &reactors[i]) != 0)
+        {
+            perror("Failed to create reactor thread");
+            nreactors = i;
+            reactor_stop();
+            return 1;
+        }
+        if (count > 1)
+        {
+            pin_reactor(i);
+        }
+    }
+    return 0;
+}
+
+int reactor_add(int socket)
+{
+    return watch(socket, CONN_PEER, NULL);
+}
+
+void reactor_close(int socket)
+{
+    pthread_mutex_lock(&conn_lock);
+    Connection *conn = (size_t)socket < conns_size ? conns[socket] : NULL;
+    if (!conn)
+    {
+        // not watched, e.g. the peer hung up
+        pthread_mutex_unlock(&conn_lock);
+        sendq_close(socket);
+        close(socket);
+        return;
+    }
+    if (!conn->closing)
+    {
+        Reactor *reactor = &reactors[conn->reactor];
+        if (reactor->nclose == reactor->close_size)
+        {
+            size_t grown = reactor->close_size ? reactor->close_size * 2 : 8;
+            int *queue = realloc(reactor->close_queue, grown * sizeof(int));
+            if (!queue)
+            {
+                perror("Realloc failed");
+                pthread_mutex_unlock(&conn_lock);
+                return;
+            }
+            reactor->close_queue = queue;
+            reactor->close_size = grown;
+        }
+        reactor->close_queue[reactor->nclose++] = socket;
+        conn->closing = 1;
+        wake(reactor);
+    }
+    pthread_mutex_unlock(&conn_lock);
+}
+
+void reactor_want_write(int socket)
+{
+    pthread_mutex_lock(&conn_lock);
+    Connection *conn = socket >= 0 && (size_t)socket < conns_size
+        ? conns[socket] : NULL;
+    if (conn && !conn->writing)
+    {
+        conn->writing = 1;
+        update_events(conn);
+    }
+    pthread_mutex_unlock(&conn_lock);
+}
+
+void reactor_stop(void)
+{
+    stopping = 1;
+    for (int i = 0; i < nreactors; i++)
+    {
+        if (reactors[i].thread)
+        {
+            wake(&reactors[i]);
+            pthread_join(reactors[i].thread, NULL);
+        }
+    }
+    // connections still watched are freed, peers stay open for the caller
+    for (size_t fd = 0; fd < conns_size; fd++)
+    {
+        Connection *conn = conns[fd];
+        if (conn && (conn->state == CONN_HANDSHAKE || conn->closing))
+        {
+            close(conn->fd);
+        }
+        if (conn)
+        {
+            free(conn->buffer);
+        }
+        free(conn);
+    }
+    free(conns);
+    conns = NULL;
+    conns_size = 0;
+    for (int i = 0; i < nreactors; i++)
+    {
+        if (reactors[i].epoll_fd >= 0)
+        {
+            close(reactors[i].epoll_fd);
+        }
+        if (reactors[i].wake_fd >= 0)
+        {
+            close(reactors[i].wake_fd);
+        }
+        free(reactors[i].close_queue);
+        memset(&reactors[i], 0, sizeof(Reactor));
+    }
+    nreactors = 0;
+}
@@ -0,0 +1,368 @@
+#include "net/sendq.h"
+#include "net/reactor.h"
+#include "net/fdtable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+// segments gathered into one writev
+#define SENDQ_IOV 64
+#define ZERO_PAD 4096
+
+typedef struct Send_segment
+{
+    struct Send_segment *next;
+    size_t length;
+    size_t sent;
+    // a file range rather than data when fd is not -1
+    int fd;
+    off_t position;
+    void (*done)(void *);
+    void *arg;
+    uint8_t data[];
+} Send_segment;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    Send_segment *head;
+    Send_segment *tail;
+    // bytes queued, file ranges included
+    size_t bytes;
+    int open;
+} Send_queue;
+
+// queues by socket, a queue is kept for its fd number until sendq_free
+// and is looked up without a lock, create_lock only orders creating them
+static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;
+static Fd_table queues = FD_TABLE_INITIALIZER;
+
+// the queue of a socket, created if create is set, NULL if there is none
+static Send_queue *queue_of(int socket, int create)
+{
+    Send_queue *queue = (Send_queue *)(uintptr_t)fd_table_get(&queues,
+        socket);
+    if (queue || !create || socket < 0)
+    {
+        return queue;
+    }
+    pthread_mutex_lock(&create_lock);
+    queue = (Send_queue *)(uintptr_t)fd_table_get(&queues, socket);
+    if (!queue)
+    {
+        queue = calloc(1, sizeof(Send_queue));
+        if (!queue)
+        {
+            perror("Calloc failed");
+        }
+        else
+        {
+            pthread_mutex_init(&queue->lock, NULL);
+            if (fd_table_set(&queues, socket, (uintptr_t)queue))
+            {
+                pthread_mutex_destroy(&queue->lock);
+                free(queue);
+                queue = NULL;
+            }
+        }
+    }
+    pthread_mutex_unlock(&create_lock);
+    return queue;
+}
+
+static Send_segment *segment_data(const void *data, size_t length)
+{
+    Send_segment *segment = malloc(sizeof(Send_segment) + length);
+    if (!segment)
+    {
+        perror("Malloc failed");
+        return NULL;
+    }
+    *segment = (Send_segment){ .length = length, .fd = -1 };
+    memcpy(segment->data, data, length);
+    return segment;
+}
+
+// frees a segment that was sent or dropped
+static void segment_free(Send_segment *segment)
+{
+    if (segment->done)
+    {
+        segment->done(segment->arg);
+    }
+    free(segment);
+}
+
+// frees a chain that was never queued
+static void chain_free(Send_segment *segment)
+{
+    while (segment)
+    {
+        Send_segment *next = segment->next;
+        segment_free(segment);
+        segment = next;
+    }
+}
+
+// drops every queued segment, called with the queue's lock held
+static void queue_drop(Send_queue *queue)
+{
+    chain_free(queue->head);
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->bytes = 0;
+}
+
+/**
+ * Appends a chain of segments holding bytes in total, the reactor is asked
+ * to write if the queue was empty
+ */
+static int queue_append(int socket, Send_segment *first, Send_segment *last,
+    size_t bytes)
+{
+    Send_queue *queue = queue_of(socket, 0);
+    if (!queue)
+    {
+        chain_free(first);
+        errno = EPIPE;
+        return -1;
+    }
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->open)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        chain_free(first);
+        errno = EPIPE;
+        return -1;
+    }
+    int was_empty = queue->head == NULL;
+    if (queue->tail)
+    {
+        queue->tail->next = first;
+    }
+    else
+    {
+        queue->head = first;
+    }
+    queue->tail = last;
+    queue->bytes += bytes;
+    pthread_mutex_unlock(&queue->lock);
+    if (was_empty)
+    {
+        reactor_want_write(socket);
+    }
+    return 0;
+}
+
+void sendq_open(int socket)
+{
+    Send_queue *queue = queue_of(socket, 1);
+    if (queue)
+    {
+        pthread_mutex_lock(&queue->lock);
+        queue->open = 1;
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+void sendq_close(int socket)
+{
+    Send_queue *queue = queue_of(socket, 0);
+    if (queue)
+    {
+        pthread_mutex_lock(&queue->lock);
+        queue->open = 0;
+        queue_drop(queue);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+int sendq_push(int socket, const void *data, size_t length)
+{
+    Send_segment *segment = segment_data(data, length);
+    if (!segment)
+    {
+        return -1;
+    }
+    return queue_append(socket, segment, segment, length);
+}
+
+int sendq_file(int socket, const void *head, size_t head_length, int fd,
+    off_t position, size_t length, const void *tail, size_t tail_length,
+    void (*done)(void *), void *arg)
+{
+    Send_segment *file = malloc(sizeof(Send_segment));
+    if (!file)
+    {
+        perror("Malloc failed");
+        done(arg);
+        return -1;
+    }
+    *file = (Send_segment){
+        .length = length, .fd = fd, .position = position,
+        .done = done, .arg = arg
+    };
+    Send_segment *first = file;
+    Send_segment *last = file;
+    if (head_length > 0)
+    {
+        first = segment_data(head, head_length);
+        if (!first)
+        {
+            segment_free(file);
+            return -1;
+        }
+        first->next = file;
+    }
+    if (tail_length > 0)
+    {
+        last = segment_data(tail, tail_length);
+        if (!last)
+        {
+            chain_free(first);
+            return -1;
+        }
+        file->next = last;
+    }
+    return queue_append(socket, first, last,
+        head_length + length + tail_length);
+}
+
+// takes n sent bytes off the front, called with the queue's lock held
+static void queue_advance(Send_queue *queue, size_t n)
+{
+    queue->bytes -= n;
+    while (n > 0 || (queue->head && queue->head->sent == queue->head->length))
+    {
+        Send_segment *segment = queue->head;
+        size_t left = segment->length - segment->sent;
+        size_t taken = n < left ? n : left;
+        segment->sent += taken;
+        n -= taken;
+        if (segment->sent < segment->length)
+        {
+            break;
+        }
+        queue->head = segment->next;
+        if (!queue->head)
+        {
+            queue->tail = NULL;
+        }
+        segment_free(segment);
+    }
+}
+
+// sends part of the file range at the front of the queue
+static ssize_t send_file(int socket, Send_segment *segment)
+{
+    static const uint8_t zeros[ZERO_PAD];
+    off_t position = segment->position + segment->sent;
+    size_t left = segment->length - segment->sent;
+    ssize_t n = sendfile(socket, segment->fd, &position, left);
+    if (n == 0)
+    {
+        // the file shrank, pad so the frame keeps its length
+        n = send(socket, zeros, left < ZERO_PAD ? left : ZERO_PAD,
+            MSG_DONTWAIT);
+    }
+    return n;
+}
+
+// sends the data segments at the front of the queue in one writev
+static ssize_t send_data(int socket, Send_segment *segment)
+{
+    struct iovec iov[SENDQ_IOV];
+    int count = 0;
+    int more = 0;
+    for (; segment && count < SENDQ_IOV; segment = segment->next)
+    {
+        if (segment->fd >= 0)
+        {
+            // its file range follows straight after
+            more = 1;
+            break;
+        }
+        iov[count].iov_base = segment->data + segment->sent;
+        iov[count].iov_len = segment->length - segment->sent;
+        count++;
+    }
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+    return sendmsg(socket, &msg, MSG_DONTWAIT | (more ? MSG_MORE : 0));
+}
+
+long sendq_flush(int socket)
+{
+    Send_queue *queue = queue_of(socket, 0);
+    if (!queue)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&queue->lock);
+    while (queue->head)
+    {
+        if (queue->head->sent == queue->head->length)
+        {
+            // an empty file range
+            queue_advance(queue, 0);
+            continue;
+        }
+        ssize_t n = queue->head->fd >= 0
+            ? send_file(socket, queue->head)
+            : send_data(socket, queue->head);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (n <= 0)
+        {
+            // the reactor sees the connection fail when it next reads
+            queue_drop(queue);
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        queue_advance(queue, n);
+    }
+    long left = queue->bytes;
+    pthread_mutex_unlock(&queue->lock);
+    return left;
+}
+
+size_t sendq_pending(int socket)
+{
+    Send_queue *queue = queue_of(socket, 0);
+    if (!queue)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&queue->lock);
+    size_t bytes = queue->bytes;
+    pthread_mutex_unlock(&queue->lock);
+    return bytes;
+}
+
+void sendq_free(void)
+{
+    size_t size = fd_table_size(&queues);
+    for (size_t fd = 0; fd < size; fd++)
+    {
+        Send_queue *queue = (Send_queue *)(uintptr_t)fd_table_get(&queues,
+            fd);
+        if (queue)
+        {
+            queue_drop(queue);
+            pthread_mutex_destroy(&queue->lock);
+            free(queue);
+        }
+    }
+    fd_table_free(&queues);
+}
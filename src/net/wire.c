@@ -0,0 +1,256 @@
+#include "net/wire.h"
+#include "net/fdtable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WIRE_MAGIC "BTWIRE1"
+#define WIRE_MAGIC_LENGTH 8
+
+// RES payload: offset, data, then the size, hash and identifier
+#define RES_OFFSET 4
+#define RES_DATA WIRE_RES_DATA
+#define RES_TAIL (PAYLOAD_MAX - RES_OFFSET - RES_DATA)
+#define RES_HASH 64
+#define RES_IDENT 1024
+// jumbo RES payload before its data: offset, size, hash, identifier
+#define JUMBO_HEAD (2 * sizeof(uint32_t) + RES_HASH + RES_IDENT)
+
+// agreed encodings by socket, max_data in the high half and the flags in
+// the low half, zeroed entries are legacy
+static Fd_table modes = FD_TABLE_INITIALIZER;
+
+void wire_hello(struct btide_packet *packet, Wire_mode mode)
+{
+    uint8_t *data = packet->pl.data;
+    memcpy(data, WIRE_MAGIC, WIRE_MAGIC_LENGTH);
+    memcpy(data + WIRE_MAGIC_LENGTH, &mode.flags, sizeof(mode.flags));
+    memcpy(data + WIRE_MAGIC_LENGTH + sizeof(mode.flags), &mode.max_data,
+        sizeof(mode.max_data));
+}
+
+Wire_mode wire_hello_mode(const struct btide_packet *packet)
+{
+    const uint8_t *data = packet->pl.data;
+    Wire_mode mode = WIRE_LEGACY;
+    if (memcmp(data, WIRE_MAGIC, WIRE_MAGIC_LENGTH) != 0)
+    {
+        return mode;
+    }
+    uint32_t max_data;
+    memcpy(&mode.flags, data + WIRE_MAGIC_LENGTH, sizeof(mode.flags));
+    memcpy(&max_data, data + WIRE_MAGIC_LENGTH + sizeof(mode.flags),
+        sizeof(max_data));
+    mode.flags &= WIRE_SUPPORTED;
+    // jumbo frames need the length the compact header carries
+    if (!(mode.flags & WIRE_COMPACT) || max_data <= WIRE_RES_DATA)
+    {
+        mode.flags &= ~WIRE_JUMBO;
+    }
+    if (mode.flags & WIRE_JUMBO)
+    {
+        mode.max_data = max_data < WIRE_JUMBO_DATA
+            ? max_data : WIRE_JUMBO_DATA;
+    }
+    return mode;
+}
+
+void wire_set_mode(int socket, Wire_mode mode)
+{
+    fd_table_set(&modes, socket, (uint64_t)mode.max_data << 32 | mode.flags);
+}
+
+Wire_mode wire_mode(int socket)
+{
+    uint64_t value = fd_table_get(&modes, socket);
+    if (value >> 32 == 0)
+    {
+        return WIRE_LEGACY;
+    }
+    return (Wire_mode){ .flags = (uint32_t)value,
+        .max_data = (uint32_t)(value >> 32) };
+}
+
+size_t wire_encode(const struct btide_packet *packet, const Wire_mode *mode,
+    uint8_t *out)
+{
+    if (!(mode->flags & WIRE_COMPACT))
+    {
+        memcpy(out, packet, sizeof(*packet));
+        return sizeof(*packet);
+    }
+    uint8_t *payload = out + sizeof(Wire_header);
+    const uint8_t *data = packet->pl.data;
+    if (packet->msg_code == PKT_MSG_RES)
+    {
+        // the data goes last so its unused tail can be left out
+        memcpy(payload, data, RES_OFFSET);
+        memcpy(payload + RES_OFFSET, data + RES_OFFSET + RES_DATA, RES_TAIL);
+        memcpy(payload + RES_OFFSET + RES_TAIL, data + RES_OFFSET, RES_DATA);
+    }
+    else
+    {
+        memcpy(payload, data, PAYLOAD_MAX);
+    }
+    uint32_t length = PAYLOAD_MAX;
+    while (length > 0 && payload[length - 1] == 0)
+    {
+        length--;
+    }
+    Wire_header header = {
+        .msg_code = packet->msg_code,
+        .error = packet->error,
+        .length = length
+    };
+    memcpy(out, &header, sizeof(header));
+    return sizeof(header) + length;
+}
+
+long wire_frame_length(const uint8_t *in, size_t len, const Wire_mode *mode)
+{
+    if (!(mode->flags & WIRE_COMPACT))
+    {
+        return sizeof(struct btide_packet);
+    }
+    Wire_header header;
+    if (len < sizeof(header))
+    {
+        return 0;
+    }
+    memcpy(&header, in, sizeof(header));
+    if (header.msg_code == WIRE_MSG_JUMBO_RES)
+    {
+        if (!(mode->flags & WIRE_JUMBO) || header.length < JUMBO_HEAD
+            || header.length - JUMBO_HEAD > mode->max_data)
+        {
+            return -1;
+        }
+    }
+    else if (header.length > PAYLOAD_MAX)
+    {
+        return -1;
+    }
+    return sizeof(header) + header.length;
+}
+
+// reads a jumbo RES frame, its data stays where it is
+static int decode_jumbo(const uint8_t *in, const Wire_header *header,
+    Wire_res *res)
+{
+    const uint8_t *payload = in + sizeof(*header);
+    res->error = header->error;
+    memcpy(&res->offset, payload, sizeof(uint32_t));
+    memcpy(&res->size, payload + sizeof(uint32_t), sizeof(uint32_t));
+    if (res->size != header->length - JUMBO_HEAD)
+    {
+        return 1;
+    }
+    memcpy(res->hash, payload + 2 * sizeof(uint32_t), RES_HASH);
+    res->hash[RES_HASH] = '\0';
+    memcpy(res->ident, payload + 2 * sizeof(uint32_t) + RES_HASH, RES_IDENT);
+    res->ident[RES_IDENT] = '\0';
+    res->data = payload + JUMBO_HEAD;
+    return 0;
+}
+
+long wire_decode(const uint8_t *in, size_t len, const Wire_mode *mode,
+    struct btide_packet *packet, Wire_res *res)
+{
+    long frame = wire_frame_length(in, len, mode);
+    if (frame <= 0 || len < (size_t)frame)
+    {
+        return frame < 0 ? -1 : 0;
+    }
+    if (!(mode->flags & WIRE_COMPACT))
+    {
+        memcpy(packet, in, sizeof(*packet));
+        return frame;
+    }
+    Wire_header header;
+    memcpy(&header, in, sizeof(header));
+    packet->msg_code = header.msg_code;
+    packet->error = header.error;
+    if (header.msg_code == WIRE_MSG_JUMBO_RES)
+    {
+        return decode_jumbo(in, &header, res) ? -1 : frame;
+    }
+    // left out bytes were zeros
+    uint8_t payload[PAYLOAD_MAX] = { 0 };
+    memcpy(payload, in + sizeof(header), header.length);
+    uint8_t *data = packet->pl.data;
+    if (header.msg_code == PKT_MSG_RES)
+    {
+        memcpy(data, payload, RES_OFFSET);
+        memcpy(data + RES_OFFSET + RES_DATA, payload + RES_OFFSET, RES_TAIL);
+        memcpy(data + RES_OFFSET, payload + RES_OFFSET + RES_TAIL, RES_DATA);
+    }
+    else
+    {
+        memcpy(data, payload, PAYLOAD_MAX);
+    }
+    return frame;
+}
+
+void wire_res(const struct btide_packet *packet, Wire_res *res)
+{
+    const uint8_t *data = packet->pl.data;
+    uint16_t size;
+    res->error = packet->error;
+    memcpy(&res->offset, data, sizeof(uint32_t));
+    memcpy(&size, data + RES_OFFSET + RES_DATA, sizeof(uint16_t));
+    res->size = size < RES_DATA ? size : RES_DATA;
+    res->data = data + RES_OFFSET;
+    memcpy(res->hash, data + RES_OFFSET + RES_DATA + sizeof(uint16_t),
+        RES_HASH);
+    res->hash[RES_HASH] = '\0';
+    memcpy(res->ident, data + RES_OFFSET + RES_DATA + sizeof(uint16_t)
+        + RES_HASH, RES_IDENT);
+    res->ident[RES_IDENT] = '\0';
+}
+
+void wire_split_res(const struct btide_packet *packet, uint32_t length,
+    const Wire_mode *mode, uint8_t *before, size_t *before_length,
+    uint8_t *after, size_t *after_length)
+{
+    const uint8_t *data = packet->pl.data;
+    *after_length = 0;
+    if (!(mode->flags & WIRE_COMPACT))
+    {
+        // the data sits in the middle, padded to its full size
+        size_t head = sizeof(packet->msg_code) + sizeof(packet->error)
+            + RES_OFFSET;
+        memcpy(before, packet, head);
+        *before_length = head;
+        memset(after, 0, RES_DATA - length);
+        memcpy(after + RES_DATA - length, data + RES_OFFSET + RES_DATA,
+            RES_TAIL);
+        *after_length = RES_DATA - length + RES_TAIL;
+        return;
+    }
+    Wire_header header = {
+        .msg_code = packet->msg_code,
+        .error = packet->error
+    };
+    uint8_t *payload = before + sizeof(header);
+    if (length > RES_DATA && (mode->flags & WIRE_JUMBO))
+    {
+        // the size no longer fits the packet's uint16_t
+        header.msg_code = WIRE_MSG_JUMBO_RES;
+        header.length = JUMBO_HEAD + length;
+        memcpy(payload, data, RES_OFFSET);
+        memcpy(payload + RES_OFFSET, &length, sizeof(uint32_t));
+        memcpy(payload + 2 * sizeof(uint32_t),
+            data + RES_OFFSET + RES_DATA + sizeof(uint16_t),
+            RES_HASH + RES_IDENT);
+        *before_length = sizeof(header) + JUMBO_HEAD;
+    }
+    else
+    {
+        // the data is already last
+        header.length = RES_OFFSET + RES_TAIL + length;
+        memcpy(payload, data, RES_OFFSET);
+        memcpy(payload + RES_OFFSET, data + RES_OFFSET + RES_DATA, RES_TAIL);
+        *before_length = sizeof(header) + RES_OFFSET + RES_TAIL;
+    }
+    memcpy(before, &header, sizeof(header));
+}
@@ -1,49 +1,317 @@
+#define _DEFAULT_SOURCE
 #include "chk/pkgchk.h"
+#include "package/package.h"
 #include "bytetide/btide.h"
+#include "pool/threadpool.h"
+#include "package/registry.h"
+#include "package/download.h"
+#include "package/receive.h"
+#include "package/datafile.h"
+#include "pool/epoch.h"
+#include <dirent.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
 
 #define MAXIDENTLENGTH 1024
 #define MAXFILESIZE 256
 #define MAXHASHLENGTH 65
+// how long ADDPACKAGE waits before moving a build to the background
+#define BUILD_WAIT_SECONDS 1
+// a complete package's tree is freed after this long without being used
+#define TREE_IDLE_SECONDS 60
+#define MAXSCANPATH 4096
 
-// handle ADDPACKAGE command
-void handle_add_package(char command[], int *current_length, 
-int *max_size, bpkg_obj ***list, char directory[])
+// a merkle tree build running on its own thread
+typedef struct Package_build
 {
-    char filename[MAXLINELENGTH];
-    // check if command doesnt have trailing spaces
-    char remainder;
-    if (command[10] != ' ' || command[11] == ' ' || command[11] == '\0')
+    bpkg_obj *obj;
+    // copied so they can be read after a failed build destroyed obj
+    char ident[MAXIDENTLENGTH];
+    char filename[MAXFILESIZE];
+    // the .bpkg it was added from, saved by the registry
+    char manifest[MAXSCANPATH];
+    Merkle_build_job job;
+    // chunks the registry has verified, given to the job
+    uint8_t *verified;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int done;
+    int result;
+    struct Package_build *next;
+} Package_build;
+
+// builds moved to the background, only touched by the client thread
+static Package_build *pending_builds = NULL;
+// held while received chunks update a tree, so it is not evicted under them
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Managed packages by identifier for package_get, open addressed and at
+ * most half full. Only the client thread changes it, reactor threads read
+ * it without locks: a package is stored into an empty slot in place and
+ * removed by putting a tombstone over it, a resize publishes a new table
+ * and frees the old one once no reader can still be in it (see
+ * pool/epoch.h)
+ */
+typedef struct
+{
+    size_t mask;
+    // slots holding a package or a tombstone, and those holding a package
+    size_t used;
+    size_t live;
+    _Atomic(bpkg_obj *) slots[];
+} Ident_table;
+
+static _Atomic(Ident_table *) ident_table = NULL;
+// stands in a removed package's slot so lookups keep probing past it
+static bpkg_obj ident_removed;
+
+// FNV-1a over the identifier up to its null or MAXIDENTLENGTH bytes
+static size_t ident_hash(const char *ident, size_t *length)
+{
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i < MAXIDENTLENGTH && ident[i] != '\0'; i++)
     {
-        printf("Invalid Input\n");
-        return;
+        hash = (hash ^ (uint8_t)ident[i]) * 1099511628211ull;
     }
-    // check if there is a file specified
-    if (sscanf(command + 11, "%s%c", filename, &remainder) < 1 
-        || (remainder != '\n' && remainder != '\r'))
+    *length = i;
+    return hash;
+}
+
+static void ident_place(Ident_table *table, bpkg_obj *obj)
+{
+    size_t length;
+    size_t slot = ident_hash(obj->ident, &length) & table->mask;
+    while (atomic_load_explicit(&table->slots[slot], memory_order_relaxed))
     {
-        printf("Missing file argument\n");
-        return;
+        slot = (slot + 1) & table->mask;
     }
+    // release, so a reader that finds obj also sees it fully set up
+    atomic_store_explicit(&table->slots[slot], obj, memory_order_release);
+    table->used++;
+    table->live++;
+}
 
-    FILE *file = fopen(filename, "r");
-    // failed to open file
-    if (!file)
+static int ident_insert(bpkg_obj *obj)
+{
+    Ident_table *old = atomic_load(&ident_table);
+    if (old && 2 * (old->used + 1) <= old->mask + 1)
     {
-        printf("Cannot open file\n");
+        ident_place(old, obj);
+        return 0;
+    }
+    // a new table without the tombstones, with room to grow
+    size_t size = 64;
+    while (old && size < 4 * (old->live + 1))
+    {
+        size *= 2;
+    }
+    Ident_table *table = calloc(1, sizeof(Ident_table) 
+        + size * sizeof(bpkg_obj *));
+    if (!table)
+    {
+        perror("Calloc failed");
+        return 1;
+    }
+    table->mask = size - 1;
+    for (size_t i = 0; old && i <= old->mask; i++)
+    {
+        bpkg_obj *kept = atomic_load_explicit(&old->slots[i], 
+            memory_order_relaxed);
+        if (kept && kept != &ident_removed)
+        {
+            ident_place(table, kept);
+        }
+    }
+    ident_place(table, obj);
+    atomic_store(&ident_table, table);
+    if (old)
+    {
+        epoch_synchronize();
+        free(old);
+    }
+    return 0;
+}
+
+// once this returns no reader can find obj any more
+static void ident_remove(bpkg_obj *obj)
+{
+    Ident_table *table = atomic_load(&ident_table);
+    size_t length;
+    size_t slot = table ? ident_hash(obj->ident, &length) & table->mask : 0;
+    for (; table && atomic_load(&table->slots[slot]); 
+        slot = (slot + 1) & table->mask)
+    {
+        if (atomic_load(&table->slots[slot]) == obj)
+        {
+            atomic_store(&table->slots[slot], &ident_removed);
+            table->live--;
+            epoch_synchronize();
+            return;
+        }
+    }
+}
+
+void package_index_clear(void)
+{
+    free(atomic_exchange(&ident_table, NULL));
+}
+
+// true if an earlier run verified every chunk of the package
+static int all_verified(const uint8_t *verified, uint32_t nchunks)
+{
+    if (!verified)
+    {
+        return 0;
+    }
+    for (uint32_t i = 0; i < nchunks; i++)
+    {
+        if (!((verified[i / 8] >> (i % 8)) & 1))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void *package_build_thread(void *arg)
+{
+    Package_build *build = (Package_build *)arg;
+    int result = bpkg_intialise_merkle_job(build->obj, &build->job);
+    if (result == 0)
+    {
+        // so the first REQ served does not wait for it
+        bpkg_index_chunks(build->obj);
+    }
+    pthread_mutex_lock(&build->lock);
+    build->result = result;
+    if (result)
+    {
+        // already destroyed by bpkg_intialise_merkle_job
+        build->obj = NULL;
+    }
+    build->done = 1;
+    pthread_cond_broadcast(&build->finished);
+    pthread_mutex_unlock(&build->lock);
+    return NULL;
+}
+
+// appends a built package to the list of managed packages and saves it
+// in the registry
+static void register_package(bpkg_obj *obj, const char *manifest, 
+    int *current_length, int *max_size, bpkg_obj ***list)
+{
+    // if list of current bpkg objs runs out of space, dynamically reallocate
+    if (*current_length == *max_size)
+    {
+        bpkg_obj **new_list = realloc(*list, 
+            (*max_size * 2) * sizeof(bpkg_obj *));
+        if (!new_list)
+        {
+            perror("Realloc failed");
+            bpkg_obj_destroy(obj);
+            return;
+        }
+        *max_size *= 2;
+        *list = new_list;
+    }
+    // the reference of the package table, given back by REMPACKAGE
+    atomic_init(&obj->refs, 1);
+    if (ident_insert(obj))
+    {
+        bpkg_obj_destroy(obj);
         return;
     }
-    fclose(file);
+    (*list)[(*current_length)++] = obj;
+    registry_add(obj, manifest);
+    // kept open for the transfers until the package is removed
+    datafile_open(obj);
+}
 
-    // if opened, try to load the bpkg object
-    bpkg_obj *obj = bpkg_load(filename);
-    if (obj == NULL)
+// joins a finished (or cancelled) build and registers the package if it
+// succeeded, the build itself is freed
+static void finish_build(Package_build *build, int *current_length, 
+    int *max_size, bpkg_obj ***list)
+{
+    pthread_join(build->thread, NULL);
+    if (build->result == 0)
+    {
+        register_package(build->obj, build->manifest, current_length, 
+            max_size, list);
+    }
+    else if (!merkle_job_cancelled(&build->job))
     {
         printf("Unable to parse bpkg file\n");
-        return;
     }
+    free(build->verified);
+    pthread_mutex_destroy(&build->lock);
+    pthread_cond_destroy(&build->finished);
+    free(build);
+}
+
+// cancels a build and waits for it to release its partial tree
+static void cancel_build(Package_build *build)
+{
+    merkle_job_cancel(&build->job);
+    pthread_join(build->thread, NULL);
+    if (build->result == 0)
+    {
+        // finished before it saw the cancellation
+        bpkg_obj_destroy(build->obj);
+    }
+    free(build->verified);
+    pthread_mutex_destroy(&build->lock);
+    pthread_cond_destroy(&build->finished);
+    free(build);
+}
+
+// registers every background build that has finished since the last call
+void reap_package_builds(int *current_length, int *max_size, 
+    bpkg_obj ***list)
+{
+    Package_build **cursor = &pending_builds;
+    while (*cursor)
+    {
+        Package_build *build = *cursor;
+        pthread_mutex_lock(&build->lock);
+        int done = build->done;
+        pthread_mutex_unlock(&build->lock);
+        if (done)
+        {
+            *cursor = build->next;
+            finish_build(build, current_length, max_size, list);
+        }
+        else
+        {
+            cursor = &build->next;
+        }
+    }
+}
+
+static void cancel_package_scan(void);
+
+// cancels every background build and the startup scan, used on QUIT
+void cancel_package_builds(void)
+{
+    while (pending_builds)
+    {
+        Package_build *build = pending_builds;
+        pending_builds = build->next;
+        cancel_build(build);
+    }
+    cancel_package_scan();
+}
+
+// prepends the directory to the package's data file and creates the file
+// at its full size if it does not exist, obj is destroyed on failure
+static int prepare_data_file(bpkg_obj *obj, const char directory[])
+{
     // prepend the directory into filename
     int size = strlen(directory);
     int need_slash = directory[size - 1] != '/';
@@ -56,14 +324,17 @@ int *max_size, bpkg_obj ***list, char directory[])
         fprintf(stderr, "Filename buffer is too small to hold the "
             "full path.\n");
         bpkg_obj_destroy(obj);
-        return;
+        return 1;
     }
     char new_path[MAXFILESIZE];
     snprintf(new_path, sizeof(new_path), "%s%s%s", directory, 
         need_slash ? "/" : "", obj->filename);
     // copy new path into bpkg obj
-    strncpy(obj->filename, new_path, MAXFILESIZE);
-    obj->filename[MAXFILESIZE - 1] = '\0';
+    if (bpkg_set_filename(obj, new_path, strlen(new_path)))
+    {
+        bpkg_obj_destroy(obj);
+        return 1;
+    }
     // try to open the file specified in bpkg
     FILE *file2 = fopen(obj->filename, "r");
     if (!file2)
@@ -74,38 +345,401 @@ int *max_size, bpkg_obj ***list, char directory[])
         {
             fprintf(stderr, "Failed to create file\n");
             bpkg_obj_destroy(obj);
-            return;
+            return 1;
         }
         if (fseek(file2, obj->size - 1, SEEK_SET) != 0 
             || fwrite("\0", 1, 1, file2) != 1)
         {
             fclose(file2);
             bpkg_obj_destroy(obj);
-            return;
+            return 1;
         }
     }
     fclose(file2);
-    // intialise the merkle tree
-    if (bpkg_intialise_merkle(obj))
+    return 0;
+}
+
+// handle ADDPACKAGE command
+void handle_add_package(char command[], int *current_length, 
+int *max_size, bpkg_obj ***list, char directory[])
+{
+    char filename[MAXLINELENGTH];
+    // check if command doesnt have trailing spaces
+    char remainder;
+    if (command[10] != ' ' || command[11] == ' ' || command[11] == '\0')
+    {
+        printf("Invalid Input\n");
+        return;
+    }
+    // check if there is a file specified
+    if (sscanf(command + 11, "%s%c", filename, &remainder) < 1 
+        || (remainder != '\n' && remainder != '\r'))
+    {
+        printf("Missing file argument\n");
+        return;
+    }
+
+    FILE *file = fopen(filename, "r");
+    // failed to open file
+    if (!file)
+    {
+        printf("Cannot open file\n");
+        return;
+    }
+    fclose(file);
+
+    // if opened, try to load the bpkg object
+    bpkg_obj *obj = bpkg_load(filename);
+    if (obj == NULL)
     {
         printf("Unable to parse bpkg file\n");
         return;
     }
-    // if list of current bpkg objs runs out of space, dynamically reallocate
-    if (*current_length == *max_size)
+    // place the data file in the package directory
+    if (prepare_data_file(obj, directory))
     {
-        bpkg_obj **new_list = realloc(*list, 
-            (*max_size * 2) * sizeof(bpkg_obj *));
-        if (!new_list)
+        return;
+    }
+    uint8_t *verified = registry_verified_chunks(obj);
+    if (all_verified(verified, obj->nchunks))
+    {
+        // its tree, sections and chunk index wait for first use
+        free(verified);
+        bpkg_defer_merkle(obj);
+        register_package(obj, filename, current_length, max_size, list);
+        return;
+    }
+    // intialise the merkle tree on a build thread so large packages can be
+    // watched with PROGRESS and cancelled with REMPACKAGE or QUIT
+    Package_build *build = calloc(1, sizeof(Package_build));
+    if (!build)
+    {
+        perror("Calloc failed");
+        free(verified);
+        bpkg_obj_destroy(obj);
+        return;
+    }
+    build->obj = obj;
+    strncpy(build->ident, obj->ident, MAXIDENTLENGTH - 1);
+    strncpy(build->filename, obj->filename, MAXFILESIZE - 1);
+    strncpy(build->manifest, filename, MAXSCANPATH - 1);
+    merkle_job_init(&build->job, obj);
+    // chunks verified by an earlier run are not read again
+    build->verified = verified;
+    build->job.verified = build->verified;
+    pthread_mutex_init(&build->lock, NULL);
+    pthread_cond_init(&build->finished, NULL);
+    if (pthread_create(&build->thread, NULL, package_build_thread, build) != 0)
+    {
+        // build inline like before
+        pthread_mutex_destroy(&build->lock);
+        pthread_cond_destroy(&build->finished);
+        free(build->verified);
+        free(build);
+        if (bpkg_intialise_merkle(obj))
         {
-            perror("Realloc failed");
-            bpkg_obj_destroy(obj);
+            printf("Unable to parse bpkg file\n");
             return;
         }
-        *max_size *= 2;
-        *list = new_list;
+        register_package(obj, filename, current_length, max_size, list);
+        return;
     }
-    (*list)[(*current_length)++] = obj;
+    // small packages finish well within the wait and behave as before
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += BUILD_WAIT_SECONDS;
+    pthread_mutex_lock(&build->lock);
+    while (!build->done)
+    {
+        if (pthread_cond_timedwait(&build->finished, &build->lock, 
+            &deadline) != 0)
+        {
+            break;
+        }
+    }
+    int done = build->done;
+    pthread_mutex_unlock(&build->lock);
+    if (done)
+    {
+        finish_build(build, current_length, max_size, list);
+        return;
+    }
+    build->next = pending_builds;
+    pending_builds = build;
+    printf("Package is being built in the background\n");
+}
+
+// one manifest of the startup scan
+typedef struct Scan_task
+{
+    char path[MAXSCANPATH];
+    const char *directory;
+    // only used for cancellation, its counters are not reported
+    Merkle_build_job job;
+    // NULL if the package could not be loaded
+    bpkg_obj *obj;
+    struct Scan_task *next;
+} Scan_task;
+
+// the startup scan, running until every task has been reaped
+static Thread_pool *scan_pool = NULL;
+static Scan_task *scan_tasks = NULL;
+static size_t scan_count = 0;
+static size_t scan_unreaped = 0;
+static size_t scan_loaded = 0;
+static atomic_int scan_cancelled = 0;
+// finished tasks waiting for the client thread to register them
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static Scan_task *scan_ready = NULL;
+
+// worker task, loads one manifest and builds its tree
+static void scan_load_package(void *arg)
+{
+    Scan_task *task = (Scan_task *)arg;
+    if (!atomic_load(&scan_cancelled))
+    {
+        bpkg_obj *obj = bpkg_load(task->path);
+        if (!obj)
+        {
+            fprintf(stderr, "Unable to parse bpkg file %s\n", task->path);
+        }
+        // both destroy obj on failure
+        else if (prepare_data_file(obj, task->directory) == 0)
+        {
+            // chunks verified by an earlier run are not read again
+            uint8_t *verified = registry_verified_chunks(obj);
+            task->job.verified = verified;
+            if (all_verified(verified, obj->nchunks))
+            {
+                // its tree, sections and chunk index wait for first use
+                bpkg_defer_merkle(obj);
+                task->obj = obj;
+            }
+            else if (bpkg_intialise_merkle_job(obj, &task->job) == 0)
+            {
+                bpkg_index_chunks(obj);
+                task->obj = obj;
+            }
+            free(verified);
+        }
+    }
+    pthread_mutex_lock(&scan_lock);
+    task->next = scan_ready;
+    scan_ready = task;
+    pthread_mutex_unlock(&scan_lock);
+}
+
+// appends a manifest path to the scan, growing the task array, a path
+// named twice (e.g. saved and in the autoload directory) is loaded once
+static int add_scan_task(const char *path, size_t *capacity)
+{
+    char resolved[MAXSCANPATH];
+    if (realpath(path, resolved))
+    {
+        path = resolved;
+    }
+    for (size_t i = 0; i < scan_count; i++)
+    {
+        if (strcmp(scan_tasks[i].path, path) == 0)
+        {
+            return 0;
+        }
+    }
+    if (scan_count == *capacity)
+    {
+        size_t grown = *capacity ? *capacity * 2 : 16;
+        Scan_task *tasks = realloc(scan_tasks, grown * sizeof(Scan_task));
+        if (!tasks)
+        {
+            perror("Realloc failed");
+            return 1;
+        }
+        scan_tasks = tasks;
+        *capacity = grown;
+    }
+    if (strlen(path) >= MAXSCANPATH)
+    {
+        fprintf(stderr, "Package path too long: %s\n", path);
+        return 0;
+    }
+    Scan_task *task = &scan_tasks[scan_count++];
+    memset(task, 0, sizeof(*task));
+    strcpy(task->path, path);
+    return 0;
+}
+
+// true if name ends in .bpkg or .bpkgb
+static int is_manifest_name(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    return dot && (strcmp(dot, ".bpkg") == 0 || strcmp(dot, ".bpkgb") == 0);
+}
+
+// collects the manifests in the package directory
+static int scan_directory(const char *directory, size_t *capacity)
+{
+    DIR *dir = opendir(directory);
+    if (!dir)
+    {
+        fprintf(stderr, "Unable to open package directory\n");
+        return 1;
+    }
+    int need_slash = directory[strlen(directory) - 1] != '/';
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!is_manifest_name(entry->d_name))
+        {
+            continue;
+        }
+        char path[MAXSCANPATH];
+        snprintf(path, sizeof(path), "%s%s%s", directory, 
+            need_slash ? "/" : "", entry->d_name);
+        if (add_scan_task(path, capacity))
+        {
+            closedir(dir);
+            return 1;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// collects the manifests named in a list file, one path per line
+static int scan_list(const char *list_path, size_t *capacity)
+{
+    FILE *file = fopen(list_path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Unable to open autoload list\n");
+        return 1;
+    }
+    char line[MAXSCANPATH];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && add_scan_task(line, capacity))
+        {
+            fclose(file);
+            return 1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// starts loading the packages saved by the registry and the ones named by
+// the autoload config field
+int start_package_scan(Config *cfg)
+{
+    size_t capacity = 0;
+    int failed = 0;
+    const char *saved = registry_manifests();
+    if (saved)
+    {
+        failed = scan_list(saved, &capacity);
+    }
+    if (!failed && cfg->autoload[0] != '\0')
+    {
+        failed = strcmp(cfg->autoload, AUTOLOAD_DIRECTORY) == 0 
+            ? scan_directory(cfg->directory, &capacity) 
+            : scan_list(cfg->autoload, &capacity);
+    }
+    if (failed || scan_count == 0)
+    {
+        free(scan_tasks);
+        scan_tasks = NULL;
+        scan_count = 0;
+        return failed;
+    }
+    scan_pool = pool_create(0);
+    if (!scan_pool)
+    {
+        free(scan_tasks);
+        scan_tasks = NULL;
+        scan_count = 0;
+        return 1;
+    }
+    // the array no longer moves once tasks are queued
+    for (size_t i = 0; i < scan_count; i++)
+    {
+        scan_tasks[i].directory = cfg->directory;
+        if (pool_submit(scan_pool, scan_load_package, &scan_tasks[i]))
+        {
+            // not queued, finish it as a failed load
+            pthread_mutex_lock(&scan_lock);
+            scan_tasks[i].next = scan_ready;
+            scan_ready = &scan_tasks[i];
+            pthread_mutex_unlock(&scan_lock);
+        }
+    }
+    scan_unreaped = scan_count;
+    return 0;
+}
+
+// frees the scan once every task has been reaped or cancelled
+static void finish_package_scan(void)
+{
+    pool_destroy(scan_pool);
+    scan_pool = NULL;
+    free(scan_tasks);
+    scan_tasks = NULL;
+    scan_count = 0;
+    scan_unreaped = 0;
+    scan_loaded = 0;
+    scan_ready = NULL;
+}
+
+// registers every package the startup scan has finished since the last call
+void reap_package_scan(int *current_length, int *max_size, bpkg_obj ***list)
+{
+    if (!scan_pool)
+    {
+        return;
+    }
+    pthread_mutex_lock(&scan_lock);
+    Scan_task *ready = scan_ready;
+    scan_ready = NULL;
+    pthread_mutex_unlock(&scan_lock);
+    for (; ready; ready = ready->next)
+    {
+        if (ready->obj)
+        {
+            register_package(ready->obj, ready->path, current_length, 
+                max_size, list);
+            ready->obj = NULL;
+            scan_loaded++;
+        }
+        scan_unreaped--;
+    }
+    if (scan_unreaped == 0)
+    {
+        printf("Loaded %zu of %zu packages\n", scan_loaded, scan_count);
+        finish_package_scan();
+        // saved packages that failed to load are not tried again
+        registry_drop_pending();
+    }
+}
+
+// stops the startup scan, dropping packages that were not registered
+static void cancel_package_scan(void)
+{
+    if (!scan_pool)
+    {
+        return;
+    }
+    atomic_store(&scan_cancelled, 1);
+    for (size_t i = 0; i < scan_count; i++)
+    {
+        merkle_job_cancel(&scan_tasks[i].job);
+    }
+    // runs what is still queued, which now returns straight away
+    pool_wait(scan_pool);
+    for (size_t i = 0; i < scan_count; i++)
+    {
+        bpkg_obj_destroy(scan_tasks[i].obj);
+    }
+    finish_package_scan();
 }
 
 // function to handle REMPACKAGE command
@@ -129,12 +763,32 @@ int *max_size, bpkg_obj **list)
         return;
     }
     int found = 0;
+    // a package still being built is cancelled instead
+    for (Package_build **cursor = &pending_builds; *cursor; 
+        cursor = &(*cursor)->next)
+    {
+        if (strncmp((*cursor)->ident, ident, strlen(ident)) == 0)
+        {
+            Package_build *build = *cursor;
+            *cursor = build->next;
+            cancel_build(build);
+            printf("Package has been removed\n");
+            return;
+        }
+    }
     // look for the same IDENT in list of packages
     for (int i = 0; i < *current_length; i++)
     {
         if (strncmp(list[i]->ident, ident, strlen(ident)) == 0)
         {
-            bpkg_obj_destroy(list[i]);
+            // no transfer can find it from here on
+            ident_remove(list[i]);
+            download_cancel_package(list[i]);
+            receive_drop_package(list[i]);
+            datafile_close(list[i]);
+            registry_remove(list[i]);
+            // freed here, or by the last transfer still using it
+            package_put(list[i]);
             list[i] = list[--(*current_length)];
             found = 1;
             break;
@@ -171,8 +825,7 @@ void handle_view_package(char command[], int *current_length,
     for (int i = 0; i < *current_length; i++)
     {
         char *complete = "INCOMPLETE";
-        if (strncmp(list[i]->merkle->root->expected_hash, 
-            list[i]->merkle->root->computed_hash, 64) == 0)
+        if (package_is_complete(list[i]))
         {
             complete = "COMPLETED";
         }
@@ -182,30 +835,309 @@ void handle_view_package(char command[], int *current_length,
     return;
 }
 
-// function to return a bpkg obj given a IDENT
-bpkg_obj *check_ident(char ident[], int current_length, bpkg_obj **list)
+// frees the trees of complete packages that have not been used for a while,
+// PACKAGES still reports them as complete and queries rebuild them
+void evict_idle_trees(int current_length, bpkg_obj **list)
 {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&tree_lock);
     for (int i = 0; i < current_length; i++)
     {
-        bpkg_obj *obj = list[i];
-        if (strncmp(obj->ident, ident, MAXIDENTLENGTH) == 0)
+        if (list[i]->merkle 
+            && now - list[i]->merkle_used >= TREE_IDLE_SECONDS)
         {
-            return obj;
+            bpkg_evict_merkle(list[i]);
         }
     }
-    return NULL;
+    pthread_mutex_unlock(&tree_lock);
+}
+
+// function to handle MEMORY command, heap bytes held by each package
+void handle_memory(char command[], int *current_length, bpkg_obj **list)
+{
+    // check for invalid input
+    if (command[7] != '\0')
+    {
+        printf("Invalid Input\n");
+        return;
+    }
+    if (*current_length == 0)
+    {
+        printf("No packages managed\n");
+        return;
+    }
+    size_t total = 0;
+    for (int i = 0; i < *current_length; i++)
+    {
+        Bpkg_memory mem;
+        pthread_mutex_lock(&tree_lock);
+        bpkg_memory_usage(list[i], &mem);
+        int evicted = list[i]->merkle_evicted;
+        pthread_mutex_unlock(&tree_lock);
+        printf("%d. %.32s : %zu bytes (object %zu, strings %zu, hashes %zu, "
+            "chunks %zu, tree %zu%s), %zu mapped\n", i + 1, list[i]->ident, 
+            mem.total, mem.object, mem.strings, mem.hashes + mem.raw_hashes, 
+            mem.chunks, mem.tree, evicted ? " evicted" : "", mem.mapped);
+        total += mem.total;
+    }
+    printf("Total: %zu bytes\n", total);
 }
 
-// function to return the specified CHUNK given a bpjg obj and chunk hash
-Chunk *request_hash(char hash[], bpkg_obj *obj)
+// function to handle PROGRESS command, lists the builds still running
+void handle_progress(char command[])
 {
-    for (int i = 0; i < obj->nchunks; i++)
+    // check for invalid input
+    if (command[9] != '\0')
     {
-        Chunk chunk = obj->chunks[i];
-        if (strncmp(chunk.hash, hash, MAXHASHLENGTH - 1) == 0)
+        printf("Invalid Input\n");
+        return;
+    }
+    if (pending_builds == NULL)
+    {
+        printf("No packages being built\n");
+        return;
+    }
+    int i = 1;
+    for (Package_build *build = pending_builds; build; build = build->next)
+    {
+        Merkle_progress p;
+        merkle_job_progress(&build->job, &p);
+        printf("%d. %.32s, %s : %u/%u chunks, %.1f/%.1f MiB", i++, 
+            build->ident, build->filename, p.chunks_hashed, p.chunks_total, 
+            p.bytes_hashed / (1024.0 * 1024.0), 
+            p.bytes_total / (1024.0 * 1024.0));
+        if (p.eta >= 0)
         {
-            return &obj->chunks[i];
+            printf(", ETA %.0fs", p.eta);
         }
+        printf("\n");
     }
-    return NULL;
-}
\ No newline at end of file
+}
+
+// function to return a bpkg obj given a IDENT
+bpkg_obj *package_get(const char ident[])
+{
+    size_t length;
+    size_t hash = ident_hash(ident, &length);
+    bpkg_obj *found = NULL;
+    epoch_enter();
+    Ident_table *table = atomic_load_explicit(&ident_table, 
+        memory_order_acquire);
+    for (size_t slot = table ? hash & table->mask : 0; table; 
+        slot = (slot + 1) & table->mask)
+    {
+        bpkg_obj *obj = atomic_load_explicit(&table->slots[slot], 
+            memory_order_acquire);
+        if (obj == NULL)
+        {
+            break;
+        }
+        if (obj != &ident_removed && strncmp(obj->ident, ident, length) == 0
+            && obj->ident[length] == '\0')
+        {
+            // still in the table, so the table's own reference is held
+            atomic_fetch_add(&obj->refs, 1);
+            found = obj;
+            break;
+        }
+    }
+    epoch_exit();
+    return found;
+}
+
+void package_hold(bpkg_obj *obj)
+{
+    atomic_fetch_add(&obj->refs, 1);
+}
+
+void package_put(bpkg_obj *obj)
+{
+    if (obj && atomic_fetch_sub(&obj->refs, 1) == 1)
+    {
+        datafile_close(obj);
+        bpkg_obj_destroy(obj);
+    }
+}
+
+int package_is_complete(bpkg_obj *obj)
+{
+    pthread_mutex_lock(&tree_lock);
+    int complete = bpkg_is_complete(obj);
+    pthread_mutex_unlock(&tree_lock);
+    return complete;
+}
+
+int package_verified_chunks(bpkg_obj *obj, uint8_t *bitmap)
+{
+    pthread_mutex_lock(&tree_lock);
+    // a restored complete package has no tree until it is used
+    Merkle_tree *tree = obj->merkle_evicted ? NULL : bpkg_merkle(obj);
+    int built = tree || obj->merkle_evicted;
+    for (uint32_t i = 0; built && i < obj->nchunks; i++)
+    {
+        if (!tree || merkle_node_complete(obj, &tree->nodes[i]))
+        {
+            bitmap[i / 8] |= 1 << (i % 8);
+        }
+    }
+    pthread_mutex_unlock(&tree_lock);
+    return !built;
+}
+
+int64_t request_hash(char hash[], bpkg_obj *obj)
+{
+    return bpkg_find_chunk(obj, hash);
+}
+
+// writes a chunk whose digest matched into the package's file, then records
+// it in the package's tree and the registry
+int package_commit_chunk(bpkg_obj *obj, uint32_t chunk, const uint8_t *data,
+    const uint8_t digest[SHA256_DIGEST_SZ])
+{
+    pthread_mutex_lock(&tree_lock);
+    Merkle_tree *tree = bpkg_merkle(obj);
+    // another peer's copy got here first
+    int held = tree && merkle_node_complete(obj, &tree->nodes[chunk]);
+    pthread_mutex_unlock(&tree_lock);
+    if (held)
+    {
+        return 1;
+    }
+    Package_file *file = datafile_get(obj);
+    if (file == NULL)
+    {
+        printf("File specified does not exist\n");
+        return 0;
+    }
+    uint32_t size = bpkg_chunk_size(obj, chunk);
+    off_t position = bpkg_chunk_offset(obj, chunk);
+    // the chunk is no longer verified once it is overwritten
+    registry_chunk_written(obj, chunk);
+    uint32_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pwrite(file->fd, data + done, size - done, 
+            position + done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    // the registry records it once the file has been synced
+    int written = done == size;
+    datafile_put(file);
+    if (written)
+    {
+        pthread_mutex_lock(&tree_lock);
+        tree = bpkg_merkle(obj);
+        if (tree)
+        {
+            merkle_tree_set_leaf(tree, chunk, digest);
+        }
+        pthread_mutex_unlock(&tree_lock);
+    }
+    registry_chunk_checked(obj, chunk, written);
+    return written;
+}
+
+int package_missing_chunks(bpkg_obj *obj, const char *hash, 
+    uint32_t **chunks, uint32_t *count)
+{
+    *chunks = NULL;
+    *count = 0;
+    pthread_mutex_lock(&tree_lock);
+    Merkle_tree *tree = bpkg_merkle(obj);
+    Merkle_tree_node *node = NULL;
+    if (tree)
+    {
+        node = hash ? merkle_tree_find(obj, tree, hash) : tree->root;
+    }
+    uint32_t *missing = node ? malloc(obj->nchunks * sizeof(uint32_t)) 
+        : NULL;
+    if (missing)
+    {
+        *count = merkle_tree_missing(obj, tree, node, missing);
+    }
+    pthread_mutex_unlock(&tree_lock);
+    if (!node)
+    {
+        return 1;
+    }
+    if (!missing)
+    {
+        perror("Malloc failed");
+        return 1;
+    }
+    if (*count == 0)
+    {
+        free(missing);
+        missing = NULL;
+    }
+    *chunks = missing;
+    return 0;
+}
+
+int64_t package_have_root(bpkg_obj *obj)
+{
+    pthread_mutex_lock(&tree_lock);
+    Merkle_tree *tree = bpkg_merkle(obj);
+    int64_t root = tree && tree->root ? tree->root - tree->nodes : -1;
+    pthread_mutex_unlock(&tree_lock);
+    return root;
+}
+
+void package_have(bpkg_obj *obj, const uint32_t *nodes, uint8_t *have,
+    int count)
+{
+    pthread_mutex_lock(&tree_lock);
+    Merkle_tree *tree = bpkg_merkle(obj);
+    for (int i = 0; i < count; i++)
+    {
+        have[i] = tree && nodes[i] < tree->nodes_used
+            ? merkle_tree_have(obj, tree, &tree->nodes[nodes[i]])
+            : MERKLE_HAVE_UNKNOWN;
+    }
+    pthread_mutex_unlock(&tree_lock);
+}
+
+void package_have_reply(bpkg_obj *obj, const uint32_t *nodes,
+    const uint8_t *have, int count, uint32_t *next, int *nnext,
+    uint32_t *lacking, int *nlacking)
+{
+    *nnext = 0;
+    *nlacking = 0;
+    pthread_mutex_lock(&tree_lock);
+    Merkle_tree *tree = bpkg_merkle(obj);
+    for (int i = 0; tree && i < count; i++)
+    {
+        if (nodes[i] >= tree->nodes_used)
+        {
+            continue;
+        }
+        Merkle_tree_node *node = &tree->nodes[nodes[i]];
+        if (have[i] == MERKLE_HAVE_NONE)
+        {
+            merkle_tree_leaves(tree, node, &lacking[2 * *nlacking],
+                &lacking[2 * *nlacking + 1]);
+            (*nlacking)++;
+        }
+        else if (have[i] == MERKLE_HAVE_PARTIAL && !node->is_leaf)
+        {
+            // only where this side is missing chunks too
+            Merkle_tree_node *children[2] = { node->left, node->right };
+            for (int c = 0; c < 2; c++)
+            {
+                if (!merkle_node_complete(obj, children[c]))
+                {
+                    next[(*nnext)++] = children[c] - tree->nodes;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&tree_lock);
+}
@@ -1,6 +1,8 @@
 #include "config/config.h"
 #include "net/packet.h"
 #include "bytetide/btide.h"
+#include "net/reactor.h"
+#include "net/wire.h"
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <pthread.h>
@@ -61,11 +63,14 @@ void handle_connect(char command[], char ip[], int *port, Config *cfg)
             // wait for ACP packet
             // printf("C: Waiting for ACP packet\n");
             struct btide_packet packet;
-            if (read(sockfd, &packet, sizeof(packet)) > 0 
+            if (recv_packet(sockfd, &packet) == 0
                 && packet.msg_code == PKT_MSG_ACP)
             {
-                // Send ACK after receiving ACP
-                send_ack_packet(sockfd);
+                // Send ACK after receiving ACP, agreeing to the encodings
+                // both sides support
+                Wire_mode mode = wire_hello_mode(&packet);
+                send_ack_packet(sockfd, mode);
+                wire_set_mode(sockfd, mode);
                 printf("Connection established with peer\n");
                 add_peer(sockfd, servaddr, cfg);
             }
@@ -93,8 +98,7 @@ void handle_connect(char command[], char ip[], int *port, Config *cfg)
 }
 
 // function to handle DISCONNECT command
-void handle_disconnect(char command[], char ip[], int *port, 
-pthread_mutex_t *peer_list_lock, int *peer_count, Peer *peer_list)
+void handle_disconnect(char command[], char ip[], int *port)
 {
     char remainder;
     if (command[10] != ' ' || command[11] == ' ' || command[11] == '\0')
@@ -110,29 +114,19 @@ pthread_mutex_t *peer_list_lock, int *peer_count, Peer *peer_list)
         // printf("C: Attempting to disconnect %s on port %d\n", ip, *port);
 
         int found = 0;
-        // critical section, sending DSN packets, removing PEERS
-        pthread_mutex_lock(peer_list_lock);
-        for (int i = 0; i < *peer_count; i++)
+        struct in_addr address;
+        Peer peer;
+        // a peer that sent its own DSN meanwhile has already left
+        if (inet_pton(AF_INET, ip, &address) > 0 && *port >= 0 
+            && *port <= UINT16_MAX
+            && remove_peer_id(peer_table_find(address, *port), &peer) == 0)
         {
-            char connected_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &peer_list[i].address.sin_addr, 
-                connected_ip, INET_ADDRSTRLEN);
-
-            if (strcmp(connected_ip, ip) == 0 
-                && ntohs(peer_list[i].address.sin_port) == *port)
-            {
-                // send dsn packet
-                send_dsn_packet(peer_list[i].socket);
-                close(peer_list[i].socket);
-                pthread_join(peer_list[i].id, NULL);
-                // Swap last peer into the one removed so no holes
-                peer_list[i] = peer_list[*peer_count - 1];
-                (*peer_count)--;
-                found = 1;
-                break;
-            }
+            // send dsn packet
+            send_dsn_packet(peer.socket);
+            // its reactor stops watching it before it is closed
+            reactor_close(peer.socket);
+            found = 1;
         }
-        pthread_mutex_unlock(peer_list_lock);
 
         if (found)
         {
@@ -2,13 +2,70 @@
 #include <pthread.h>
 #include "config/config.h"
 #include "net/packet.h"
+#include "net/wire.h"
+#include "net/sendq.h"
+#include "package/datafile.h"
+#include "peer/peertable.h"
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 #define MAX_IDENTIFIER_LENGTH 1024
 #define MAX_HASH_LENGTH 64
 #define MAX_DATA 2998
 
+// writes all of buffer, looping over short writes so the receiver's
+// framing stays aligned
+static int send_all(int socket, const uint8_t *buffer, size_t length,
+    int flags)
+{
+    size_t sent = 0;
+    while (sent < length)
+    {
+        ssize_t n = send(socket, buffer + sent, length - sent, flags);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+// queues a whole packet in the socket's wire encoding, its reactor sends it
+static int send_packet(int socket, const struct btide_packet *packet)
+{
+    uint8_t frame[WIRE_MAX_FRAME];
+    Wire_mode mode = wire_mode(socket);
+    size_t length = wire_encode(packet, &mode, frame);
+    return sendq_push(socket, frame, length);
+}
+
+// writes a handshake packet straight to a socket no reactor watches yet,
+// nothing else has been sent on it so it never waits for buffer space
+static int send_handshake(int socket, const struct btide_packet *packet)
+{
+    return send_all(socket, (const uint8_t *)packet, sizeof(*packet), 0);
+}
+
+// reads exactly one legacy sized packet, used for the handshake before a
+// reactor owns the socket, 0 on success
+int recv_packet(int socket, struct btide_packet *packet)
+{
+    ssize_t n;
+    do
+    {
+        n = recv(socket, packet, sizeof(*packet), MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    return n == sizeof(*packet) ? 0 : -1;
+}
+
 // sends a DSN packet to the socket
 void send_dsn_packet(int socket)
 {
@@ -16,7 +73,7 @@ void send_dsn_packet(int socket)
     memset(&packet, 0, sizeof(packet));
     packet.msg_code = PKT_MSG_DSN;
 
-    if (write(socket, &packet, sizeof(packet)) < 0)
+    if (send_packet(socket, &packet) < 0)
     {
         perror("Sending DSN failed");
     }
@@ -29,31 +86,33 @@ void send_pog_packet(int socket)
     memset(&packet, 0, sizeof(packet));
     packet.msg_code = PKT_MSG_POG;
 
-    if (write(socket, &packet, sizeof(packet)) < 0)
+    if (send_packet(socket, &packet) < 0)
     {
         perror("Sending POG failed");
     }
 }
 
-// sends a ACP packet to the socket
+// sends a ACP packet to the socket, advertising the wire capabilities
 void send_acp_packet(int socket)
 {
     struct btide_packet packet;
     memset(&packet, 0, sizeof(packet));
     packet.msg_code = PKT_MSG_ACP;
-    if (write(socket, &packet, sizeof(packet)) < 0)
+    wire_hello(&packet, WIRE_LOCAL);
+    if (send_handshake(socket, &packet) < 0)
     {
         perror("Sending ACP failed");
     }
 }
 
-// sends a ACK packet to the socket
-void send_ack_packet(int socket)
+// sends a ACK packet to the socket, with the wire encoding accepted
+void send_ack_packet(int socket, Wire_mode mode)
 {
     struct btide_packet packet;
     memset(&packet, 0, sizeof(packet));
     packet.msg_code = PKT_MSG_ACK;
-    if (write(socket, &packet, sizeof(packet)) < 0)
+    wire_hello(&packet, mode);
+    if (send_handshake(socket, &packet) < 0)
     {
         perror("Sending ACK failed");
     }
@@ -65,14 +124,14 @@ void send_png_packet(int socket)
     struct btide_packet packet;
     memset(&packet, 0, sizeof(packet));
     packet.msg_code = PKT_MSG_PNG;
-    if (write(socket, &packet, sizeof(packet)) < 0)
+    if (send_packet(socket, &packet) < 0)
     {
         perror("Sending PNG failed");
     }
 }
 
 // sends a REQ packet to the socket
-void send_req_packet(int socket, const char *identifier, const char *chunk_hash,
+int send_req_packet(int socket, const char *identifier, const char *chunk_hash,
  uint32_t offset, uint32_t size)
 {
     struct btide_packet packet;
@@ -88,10 +147,40 @@ void send_req_packet(int socket, const char *identifier, const char *chunk_hash,
     pos += MAX_HASH_LENGTH;
     memcpy(packet.pl.data + pos, identifier, strlen(identifier));
     pos += MAX_IDENTIFIER_LENGTH;
-    if (write(socket, &packet, sizeof(packet.msg_code) 
-        + sizeof(packet.error) + pos) < 0)
+    // the rest of the payload stays zeroed, every packet is full size
+    if (send_packet(socket, &packet) < 0)
     {
         perror("Sending REQ failed");
+        return -1;
+    }
+    return 0;
+}
+
+// sends a have query, or a reply if have is given, for count nodes
+void send_have_packet(int socket, const char *identifier,
+    const uint32_t *nodes, const uint8_t *have, uint16_t count)
+{
+    struct btide_packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.msg_code = have ? WIRE_MSG_HAVE_REPLY : WIRE_MSG_HAVE_QUERY;
+
+    int pos = 0;
+    memcpy(packet.pl.data + pos, &count, sizeof(uint16_t));
+    pos += sizeof(uint16_t);
+    for (uint16_t i = 0; i < count; i++)
+    {
+        memcpy(packet.pl.data + pos, &nodes[i], sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        if (have)
+        {
+            packet.pl.data[pos++] = have[i];
+        }
+    }
+    // the identifier goes last so compact frames leave out its padding
+    memcpy(packet.pl.data + pos, identifier, strlen(identifier));
+    if (send_packet(socket, &packet) < 0)
+    {
+        perror("Sending have packet failed");
     }
 }
 
@@ -119,61 +208,104 @@ void send_res_packet(int socket, const char *identifier, const char *chunk_hash,
     memset(&packet, 0, sizeof(packet));
     packet.msg_code = PKT_MSG_RES;
     packet.error = error;
-    if (error)
+    // an error RES still names the chunk, so the requester knows which REQ
+    // was refused
+    int pos = 0;
+    memcpy(packet.pl.data + pos, &offset, sizeof(uint32_t));
+    pos += sizeof(uint32_t);
+    if (!error)
     {
-        if (write(socket, &packet, sizeof(packet)) < 0)
-        {
-            perror("Sending REQ failed");
-        }
+        memcpy(packet.pl.data + pos, buffer, read);
     }
     else
     {
-        int pos = 0;
-        memcpy(packet.pl.data + pos, &offset, sizeof(uint32_t));
-        pos += sizeof(uint32_t);
-        memcpy(packet.pl.data + pos, buffer, read);
-        pos += MAX_DATA;
-        memcpy(packet.pl.data + pos, &read, sizeof(uint16_t));
-        pos += sizeof(uint16_t);
-        memcpy(packet.pl.data + pos, chunk_hash, MAX_HASH_LENGTH);
-        pos += MAX_HASH_LENGTH;
-        memcpy(packet.pl.data + pos, identifier, MAX_IDENTIFIER_LENGTH);
-        pos += MAX_IDENTIFIER_LENGTH;
-
-        // write_packet_to_file("test.pkt", &packet, sizeof(packet.msg_code) 
-        // + sizeof(packet.error) + pos);
-
-        if (write(socket, &packet, sizeof(packet.msg_code)
-             + sizeof(packet.error) + pos) < 0)
-        {
-            perror("Sending REQ failed");
-        }
+        read = 0;
+    }
+    pos += MAX_DATA;
+    memcpy(packet.pl.data + pos, &read, sizeof(uint16_t));
+    pos += sizeof(uint16_t);
+    memcpy(packet.pl.data + pos, chunk_hash, MAX_HASH_LENGTH);
+    pos += MAX_HASH_LENGTH;
+    memcpy(packet.pl.data + pos, identifier, MAX_IDENTIFIER_LENGTH);
+
+    if (send_packet(socket, &packet) < 0)
+    {
+        perror("Sending REQ failed");
+    }
+}
+
+// the send queue is done with a file range
+static void put_file(void *file)
+{
+    datafile_put(file);
+}
+
+// queues a RES packet whose data is moved from the package's file to the
+// socket with sendfile, skipping the copies through send_res_packet's
+// buffers, in a jumbo frame if it is longer than a packet holds
+int send_res_file(int socket, const char *identifier, const char *chunk_hash,
+    uint32_t offset, Package_file *file, off_t position, uint32_t length)
+{
+    struct btide_packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.msg_code = PKT_MSG_RES;
+    int pos = 0;
+    memcpy(packet.pl.data + pos, &offset, sizeof(uint32_t));
+    pos += sizeof(uint32_t) + MAX_DATA;
+    uint16_t size = length < MAX_DATA ? length : MAX_DATA;
+    memcpy(packet.pl.data + pos, &size, sizeof(uint16_t));
+    pos += sizeof(uint16_t);
+    memcpy(packet.pl.data + pos, chunk_hash, MAX_HASH_LENGTH);
+    pos += MAX_HASH_LENGTH;
+    memcpy(packet.pl.data + pos, identifier, MAX_IDENTIFIER_LENGTH);
+
+    uint8_t before[WIRE_MAX_FRAME];
+    uint8_t after[WIRE_MAX_FRAME];
+    size_t before_length;
+    size_t after_length;
+    Wire_mode mode = wire_mode(socket);
+    wire_split_res(&packet, length, &mode, before, &before_length, after,
+        &after_length);
+
+    // the queue holds its own reference until the range is sent
+    datafile_hold(file);
+    int result = sendq_file(socket, before, before_length, file->fd,
+        position, length, after, after_length, put_file, file);
+    if (result < 0)
+    {
+        perror("Sending RES failed");
     }
+    return result;
 }
 
 // function to handle logic of connecting peers
-void handle_peers(pthread_mutex_t peer_list_lock, 
-int *peer_count, Peer *peer_list)
+void handle_peers(int max_peers)
 {
-    pthread_mutex_lock(&peer_list_lock);
-    if (*peer_count == 0)
+    Peer *peers = malloc(max_peers * sizeof(Peer));
+    if (!peers)
+    {
+        perror("Malloc failed");
+        return;
+    }
+    int peer_count = peer_table_list(peers, max_peers);
+    if (peer_count == 0)
     {
         printf("Not connected to any peers\n");
     }
     else
     {
         printf("Connected to:\n\n");
-        for (int i = 0; i < *peer_count; i++)
+        for (int i = 0; i < peer_count; i++)
         {
             printf("%d. %s:%d\n", i + 1,
-                   inet_ntoa(peer_list[i].address.sin_addr),
-                   ntohs(peer_list[i].address.sin_port));
+                   inet_ntoa(peers[i].address.sin_addr),
+                   ntohs(peers[i].address.sin_port));
 
             // Send a ping packet to each peer
-            send_png_packet(peer_list[i].socket);
+            send_png_packet(peers[i].socket);
         }
     }
-    pthread_mutex_unlock(&peer_list_lock);
+    free(peers);
 }
 
 // code from resources section with minor modifications -> client.c
@@ -203,6 +335,8 @@ int connect_to_peer(const char *ip, int port)
         close(sockfd);
         return -1;
     }
+    // the handshake is always in the legacy encoding
+    wire_set_mode(sockfd, WIRE_LEGACY);
 
     return sockfd;
 }
\ No newline at end of file
@@ -0,0 +1,283 @@
+#include "peer/peertable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define SLOT_BITS 32
+#define SLOT_MASK 0xffffffffu
+
+typedef struct
+{
+    Peer peer;
+    // bumped each time the slot is filled, ids from before no longer match
+    uint32_t generation;
+    int used;
+    // next free slot while this one is free
+    int next_free;
+} Peer_slot;
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static Peer_slot *slots = NULL;
+static int nslots = 0;
+static int free_slot = -1;
+// address index with linear probing, entries are slot + 1, 0 is empty,
+// at most half full since it is sized for every slot
+static int *by_address = NULL;
+static size_t address_mask = 0;
+// ids by fd, zeroed entries have no peer
+static Peer_id *by_socket = NULL;
+static size_t by_socket_size = 0;
+
+static uint64_t address_key(struct in_addr address, uint16_t port)
+{
+    return (uint64_t)address.s_addr << 16 | port;
+}
+
+static uint64_t slot_key(int slot)
+{
+    return address_key(slots[slot].peer.address.sin_addr,
+        ntohs(slots[slot].peer.address.sin_port));
+}
+
+// multiplicative hashing, the high half is the best mixed
+static size_t address_home(uint64_t key)
+{
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & address_mask;
+}
+
+/**
+ * Position of a key in the address index, or of the empty entry where it
+ * would go, called with table_lock held
+ */
+static size_t address_probe(uint64_t key)
+{
+    size_t pos = address_home(key);
+    while (by_address[pos] != 0 && slot_key(by_address[pos] - 1) != key)
+    {
+        pos = (pos + 1) & address_mask;
+    }
+    return pos;
+}
+
+// empties an entry, moving later ones back so no probe chain is broken
+static void address_delete(size_t pos)
+{
+    by_address[pos] = 0;
+    size_t next = (pos + 1) & address_mask;
+    while (by_address[next] != 0)
+    {
+        size_t home = address_home(slot_key(by_address[next] - 1));
+        // it may fill the gap unless its home lies after the gap
+        if (((next - home) & address_mask) >= ((next - pos) & address_mask))
+        {
+            by_address[pos] = by_address[next];
+            by_address[next] = 0;
+            pos = next;
+        }
+        next = (next + 1) & address_mask;
+    }
+}
+
+// slot of an id, -1 if it is stale, called with table_lock held
+static int id_slot(Peer_id id)
+{
+    uint64_t slot = id & SLOT_MASK;
+    if (id == 0 || slot >= (uint64_t)nslots || !slots[slot].used
+        || slots[slot].generation != (uint32_t)(id >> SLOT_BITS))
+    {
+        return -1;
+    }
+    return (int)slot;
+}
+
+// records the id on a socket, called with table_lock held
+static int socket_put(int socket, Peer_id id)
+{
+    if (socket < 0)
+    {
+        return 1;
+    }
+    if ((size_t)socket >= by_socket_size)
+    {
+        size_t grown = by_socket_size ? by_socket_size : 64;
+        while (grown <= (size_t)socket)
+        {
+            grown *= 2;
+        }
+        Peer_id *table = realloc(by_socket, grown * sizeof(Peer_id));
+        if (!table)
+        {
+            perror("Realloc failed");
+            return 1;
+        }
+        memset(table + by_socket_size, 0,
+            (grown - by_socket_size) * sizeof(Peer_id));
+        by_socket = table;
+        by_socket_size = grown;
+    }
+    by_socket[socket] = id;
+    return 0;
+}
+
+int peer_table_init(int max_peers)
+{
+    size_t size = 2;
+    while (size < 2 * (size_t)max_peers)
+    {
+        size *= 2;
+    }
+    slots = calloc(max_peers, sizeof(Peer_slot));
+    by_address = calloc(size, sizeof(int));
+    if (!slots || !by_address)
+    {
+        perror("Calloc failed");
+        peer_table_free();
+        return 1;
+    }
+    nslots = max_peers;
+    address_mask = size - 1;
+    // the first peers take the first slots
+    for (int i = 0; i < max_peers; i++)
+    {
+        slots[i].next_free = i + 1 < max_peers ? i + 1 : -1;
+    }
+    free_slot = 0;
+    return 0;
+}
+
+void peer_table_free(void)
+{
+    pthread_mutex_lock(&table_lock);
+    free(slots);
+    free(by_address);
+    free(by_socket);
+    slots = NULL;
+    by_address = NULL;
+    by_socket = NULL;
+    nslots = 0;
+    free_slot = -1;
+    address_mask = 0;
+    by_socket_size = 0;
+    pthread_mutex_unlock(&table_lock);
+}
+
+Peer_id peer_table_add(int socket, struct sockaddr_in address)
+{
+    uint64_t key = address_key(address.sin_addr, ntohs(address.sin_port));
+    pthread_mutex_lock(&table_lock);
+    if (free_slot < 0)
+    {
+        pthread_mutex_unlock(&table_lock);
+        fprintf(stderr, "Max peers reached, connection refused\n");
+        return 0;
+    }
+    size_t pos = address_probe(key);
+    if (by_address[pos] != 0)
+    {
+        pthread_mutex_unlock(&table_lock);
+        fprintf(stderr, "Already connected to peer, connection refused\n");
+        return 0;
+    }
+    int slot = free_slot;
+    Peer_slot *entry = &slots[slot];
+    // skips 0 when the counter wraps, so no id is ever 0
+    uint32_t generation = entry->generation + 1 ? entry->generation + 1 : 1;
+    Peer_id id = (Peer_id)generation << SLOT_BITS | (uint32_t)slot;
+    if (socket_put(socket, id))
+    {
+        pthread_mutex_unlock(&table_lock);
+        return 0;
+    }
+    free_slot = entry->next_free;
+    entry->peer.socket = socket;
+    entry->peer.address = address;
+    entry->generation = generation;
+    entry->used = 1;
+    by_address[pos] = slot + 1;
+    pthread_mutex_unlock(&table_lock);
+    return id;
+}
+
+int peer_table_remove(Peer_id id, Peer *peer)
+{
+    pthread_mutex_lock(&table_lock);
+    int slot = id_slot(id);
+    if (slot < 0)
+    {
+        pthread_mutex_unlock(&table_lock);
+        return 1;
+    }
+    Peer_slot *entry = &slots[slot];
+    if (peer)
+    {
+        *peer = entry->peer;
+    }
+    address_delete(address_probe(slot_key(slot)));
+    int socket = entry->peer.socket;
+    if ((size_t)socket < by_socket_size && by_socket[socket] == id)
+    {
+        by_socket[socket] = 0;
+    }
+    entry->used = 0;
+    entry->next_free = free_slot;
+    free_slot = slot;
+    pthread_mutex_unlock(&table_lock);
+    return 0;
+}
+
+Peer_id peer_table_find(struct in_addr address, uint16_t port)
+{
+    Peer_id id = 0;
+    pthread_mutex_lock(&table_lock);
+    if (by_address)
+    {
+        int entry = by_address[address_probe(address_key(address, port))];
+        if (entry != 0)
+        {
+            id = (Peer_id)slots[entry - 1].generation << SLOT_BITS
+                | (uint32_t)(entry - 1);
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+    return id;
+}
+
+Peer_id peer_table_socket(int socket)
+{
+    Peer_id id = 0;
+    pthread_mutex_lock(&table_lock);
+    if (socket >= 0 && (size_t)socket < by_socket_size)
+    {
+        id = by_socket[socket];
+    }
+    pthread_mutex_unlock(&table_lock);
+    return id;
+}
+
+int peer_table_get(Peer_id id, Peer *peer)
+{
+    pthread_mutex_lock(&table_lock);
+    int slot = id_slot(id);
+    if (slot >= 0)
+    {
+        *peer = slots[slot].peer;
+    }
+    pthread_mutex_unlock(&table_lock);
+    return slot < 0;
+}
+
+int peer_table_list(Peer *peers, int max)
+{
+    int count = 0;
+    pthread_mutex_lock(&table_lock);
+    for (int i = 0; i < nslots && count < max; i++)
+    {
+        if (slots[i].used)
+        {
+            peers[count++] = slots[i].peer;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+    return count;
+}
@@ -0,0 +1,587 @@
+#define _POSIX_C_SOURCE 200809L
+#include <chk/pkgchk.h>
+#include <chk/bpkgbin.h>
+#include <crypt/sha256.h>
+#include <pool/threadpool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SHA256_HEX_LEN (64)
+#define DEFAULT_OUTPUT "default.bpkg"
+// chunk size the default mode aims for, as in pkgmake
+#define DEFAULT_CHUNK_SIZE (4096)
+// pkgmake draws one more character than it keeps
+#define IDENT_LENGTH (1023)
+// bytes read per pread while hashing a chunk
+#define READ_BUFFER_SIZE (1 << 20)
+// chunks, tree nodes or generated blocks handled by one pool task
+#define CHUNKS_PER_TASK (256)
+#define NODES_PER_TASK (4096)
+#define GENERATE_BLOCK_SIZE (1 << 22)
+// levels narrower than this are hashed on the calling thread
+#define MIN_PARALLEL_NODES (1024)
+
+enum build_mode
+{
+	MODE_DEFAULT,
+	MODE_CHUNK_SIZE,
+	MODE_NCHUNKS
+};
+
+typedef struct
+{
+	const char *path;
+	const char *output;
+	const char *binary;
+	enum build_mode mode;
+	long long chunksz;
+	long long nchunks;
+	unsigned int seed;
+	int seeded;
+	int threads;
+	long long generate;
+} Build_args;
+
+typedef struct
+{
+	bpkg_obj *obj;
+	int fd;
+	uint32_t first;
+	uint32_t last;
+	int failed;
+} Chunk_task;
+
+typedef struct
+{
+	bpkg_obj *obj;
+	uint32_t first;
+	uint32_t last;
+} Node_task;
+
+typedef struct
+{
+	int fd;
+	uint64_t seed;
+	uint64_t offset;
+	size_t length;
+	int failed;
+} Generate_task;
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: pkgbuild <file> [options]\n\n"
+		"--chunksz <chunk size>\n"
+		"--nchunks <number of chunks>\n"
+		"--output <filename>       text manifest, default " DEFAULT_OUTPUT
+		"\n"
+		"--binary <filename>       also write a compiled manifest\n"
+		"--seed <n>                identifier seed, default the time\n"
+		"--threads <n>             hashing threads, default one per cpu\n"
+		"--generate <size>[K|M|G]  first write <file> with size random "
+		"bytes\n\n"
+		"Example: pkgbuild data.dat --nchunks 32 --output data.bpkg\n");
+}
+
+// parses a whole decimal argument, returns 0 on success
+static int parse_number(const char *arg, long long *out)
+{
+	char *end;
+	errno = 0;
+	long long value = strtoll(arg, &end, 10);
+	if (end == arg || errno != 0)
+	{
+		return 1;
+	}
+	if (*end == 'K' || *end == 'M' || *end == 'G')
+	{
+		value <<= *end == 'K' ? 10 : *end == 'M' ? 20 : 30;
+		end++;
+	}
+	*out = value;
+	return *end != '\0';
+}
+
+static int parse_args(int argc, char **argv, Build_args *args)
+{
+	memset(args, 0, sizeof(*args));
+	args->output = DEFAULT_OUTPUT;
+	args->mode = MODE_DEFAULT;
+	if (argc < 2 || strcmp(argv[1], "--help") == 0)
+	{
+		return 1;
+	}
+	args->path = argv[1];
+	for (int i = 2; i < argc; i++)
+	{
+		const char *opt = argv[i];
+		if (i + 1 >= argc)
+		{
+			fprintf(stderr, "Missing value for %s\n", opt);
+			return 1;
+		}
+		const char *value = argv[++i];
+		long long n = 0;
+		if (strcmp(opt, "--output") == 0)
+		{
+			args->output = value;
+		}
+		else if (strcmp(opt, "--binary") == 0)
+		{
+			args->binary = value;
+		}
+		else if (parse_number(value, &n))
+		{
+			fprintf(stderr, "Unable to parse %s\n", opt);
+			return 1;
+		}
+		// like pkgmake the last of --chunksz and --nchunks wins
+		else if (strcmp(opt, "--chunksz") == 0)
+		{
+			args->chunksz = n;
+			args->mode = MODE_CHUNK_SIZE;
+		}
+		else if (strcmp(opt, "--nchunks") == 0)
+		{
+			args->nchunks = n;
+			args->mode = MODE_NCHUNKS;
+		}
+		else if (strcmp(opt, "--seed") == 0)
+		{
+			args->seed = (unsigned int)n;
+			args->seeded = 1;
+		}
+		else if (strcmp(opt, "--threads") == 0)
+		{
+			args->threads = (int)n;
+		}
+		else if (strcmp(opt, "--generate") == 0)
+		{
+			args->generate = n;
+		}
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", opt);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// largest power of two not above n, at least 2
+static uint32_t floor_pow2(uint64_t n)
+{
+	uint32_t best = 2;
+	while ((uint64_t)best * 2 <= n && best < (1u << 31))
+	{
+		best *= 2;
+	}
+	return best;
+}
+
+/**
+ * Picks the chunk count and base chunk size the way pkgmake does, every
+ * mode ends on a power of two chunks of size / nchunks bytes
+ * @return 0 on success, 1 if the parameters cannot make a package
+ */
+static int choose_layout(const Build_args *args, uint64_t size,
+	uint32_t *nchunks, uint32_t *chunksz)
+{
+	uint64_t n;
+	switch (args->mode)
+	{
+	case MODE_CHUNK_SIZE:
+		if (args->chunksz <= 0)
+		{
+			fprintf(stderr, "Chunk size must be positive\n");
+			return 1;
+		}
+		n = floor_pow2(size / (uint64_t)args->chunksz);
+		break;
+	case MODE_NCHUNKS:
+		if (args->nchunks < 2)
+		{
+			fprintf(stderr, "A package needs at least 2 chunks\n");
+			return 1;
+		}
+		n = floor_pow2((uint64_t)args->nchunks);
+		break;
+	default:
+		// pkgmake cannot package files of 3 default chunks or less, this
+		// splits them in two instead
+		n = floor_pow2(size / DEFAULT_CHUNK_SIZE);
+		break;
+	}
+	if (n > size)
+	{
+		fprintf(stderr, "More chunks than bytes in the file\n");
+		return 1;
+	}
+	*nchunks = (uint32_t)n;
+	*chunksz = (uint32_t)(size / n);
+	return 0;
+}
+
+/**
+ * Allocates a package with sections laid out like a loaded text manifest
+ * and fills in the chunk table, the first size % nchunks chunks get the
+ * extra bytes
+ */
+static bpkg_obj *create_package(const Build_args *args, uint32_t size,
+	uint32_t nchunks, uint32_t chunksz)
+{
+	bpkg_obj *obj = calloc(1, sizeof(bpkg_obj));
+	if (!obj)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		return NULL;
+	}
+	pthread_mutex_init(&obj->sections_lock, NULL);
+	atomic_init(&obj->sections_state, BPKG_SECTIONS_LOADED);
+	obj->size = size;
+	obj->nhashes = nchunks - 1;
+	obj->nchunks = nchunks;
+	obj->hashes = malloc((size_t)obj->nhashes * SHA256_DIGEST_SZ);
+	obj->chunk_digests = malloc((size_t)nchunks *
+		(SHA256_DIGEST_SZ + 2 * sizeof(uint32_t)));
+	if (!obj->hashes || !obj->chunk_digests)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		bpkg_obj_destroy(obj);
+		return NULL;
+	}
+	obj->chunk_offsets = (uint32_t *)(obj->chunk_digests
+		+ (size_t)nchunks * SHA256_DIGEST_SZ);
+	obj->chunk_sizes = obj->chunk_offsets + nchunks;
+
+	// the identifier is drawn the same way as pkgmake
+	srand(args->seeded ? args->seed : (unsigned int)time(NULL));
+	char ident[IDENT_LENGTH];
+	for (int i = 0; i < IDENT_LENGTH; i++)
+	{
+		ident[i] = "0123456789abcdef"[rand() % 16];
+	}
+	if (bpkg_set_ident(obj, ident, IDENT_LENGTH)
+		|| bpkg_set_filename(obj, args->path, strlen(args->path)))
+	{
+		bpkg_obj_destroy(obj);
+		return NULL;
+	}
+
+	uint32_t remainder = size - nchunks * chunksz;
+	uint32_t offset = 0;
+	for (uint32_t i = 0; i < nchunks; i++)
+	{
+		obj->chunk_offsets[i] = offset;
+		obj->chunk_sizes[i] = chunksz + (i < remainder);
+		offset += obj->chunk_sizes[i];
+	}
+	return obj;
+}
+
+// hashes the chunks [first, last) of the data file
+static void hash_chunks(void *arg)
+{
+	Chunk_task *task = (Chunk_task *)arg;
+	bpkg_obj *obj = task->obj;
+	uint8_t *buffer = malloc(READ_BUFFER_SIZE);
+	if (!buffer)
+	{
+		task->failed = 1;
+		return;
+	}
+	for (uint32_t i = task->first; i < task->last && !task->failed; i++)
+	{
+		struct sha256_compute_data cdata;
+		sha256_compute_data_init(&cdata);
+		off_t pos = bpkg_chunk_offset(obj, i);
+		uint32_t left = bpkg_chunk_size(obj, i);
+		while (left > 0)
+		{
+			size_t want = left < READ_BUFFER_SIZE ? left : READ_BUFFER_SIZE;
+			ssize_t got = pread(task->fd, buffer, want, pos);
+			if (got <= 0)
+			{
+				task->failed = 1;
+				break;
+			}
+			sha256_update(&cdata, buffer, (uint32_t)got);
+			pos += got;
+			left -= (uint32_t)got;
+		}
+		uint8_t hashout[SHA256_INT_SZ];
+		sha256_finalize(&cdata, hashout);
+		sha256_output(&cdata, obj->chunk_digests
+			+ (size_t)i * SHA256_DIGEST_SZ);
+	}
+	free(buffer);
+}
+
+// digest of node i of the tree in level order, chunks follow the hashes
+static const uint8_t *node_digest(const bpkg_obj *obj, uint32_t i)
+{
+	return i < obj->nhashes ? bpkg_hash_digest(obj, i)
+		: bpkg_chunk_digest(obj, i - obj->nhashes);
+}
+
+// hashes the non leaf nodes [first, last), whose children are done
+static void hash_nodes(void *arg)
+{
+	Node_task *task = (Node_task *)arg;
+	bpkg_obj *obj = task->obj;
+	// same input as compute_parent_hash, the children's hex back to back
+	char hex[2 * SHA256_HEX_LEN];
+	for (uint32_t i = task->first; i < task->last; i++)
+	{
+		sha256_digest_to_hex(node_digest(obj, 2 * i + 1), hex);
+		sha256_digest_to_hex(node_digest(obj, 2 * i + 2),
+			hex + SHA256_HEX_LEN);
+		struct sha256_compute_data cdata;
+		sha256_compute_data_init(&cdata);
+		sha256_update(&cdata, hex, sizeof(hex));
+		uint8_t hashout[SHA256_INT_SZ];
+		sha256_finalize(&cdata, hashout);
+		sha256_output(&cdata, obj->hashes + (size_t)i * SHA256_DIGEST_SZ);
+	}
+}
+
+static int hash_package(Thread_pool *pool, bpkg_obj *obj, int fd)
+{
+	uint32_t ntasks = (obj->nchunks + CHUNKS_PER_TASK - 1) / CHUNKS_PER_TASK;
+	Chunk_task *chunk_tasks = calloc(ntasks, sizeof(Chunk_task));
+	Node_task *node_tasks = calloc((obj->nchunks + NODES_PER_TASK - 1)
+		/ NODES_PER_TASK, sizeof(Node_task));
+	if (!chunk_tasks || !node_tasks)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		free(chunk_tasks);
+		free(node_tasks);
+		return 1;
+	}
+	for (uint32_t t = 0; t < ntasks; t++)
+	{
+		chunk_tasks[t].obj = obj;
+		chunk_tasks[t].fd = fd;
+		chunk_tasks[t].first = t * CHUNKS_PER_TASK;
+		chunk_tasks[t].last = t + 1 == ntasks ? obj->nchunks
+			: (t + 1) * CHUNKS_PER_TASK;
+		if (pool_submit(pool, hash_chunks, &chunk_tasks[t]))
+		{
+			chunk_tasks[t].failed = 1;
+			break;
+		}
+	}
+	pool_wait(pool);
+	int failed = 0;
+	for (uint32_t t = 0; t < ntasks; t++)
+	{
+		failed |= chunk_tasks[t].failed;
+	}
+	if (failed)
+	{
+		fprintf(stderr, "Error reading data file\n");
+	}
+
+	// the tree is complete with nchunks a power of two, level d holds the
+	// nodes [2^d - 1, 2^(d+1) - 1), so hash level by level from the bottom
+	for (uint32_t width = obj->nchunks / 2; !failed && width > 0; width /= 2)
+	{
+		uint32_t first = width - 1;
+		if (width < MIN_PARALLEL_NODES)
+		{
+			Node_task task = {obj, first, first + width};
+			hash_nodes(&task);
+			continue;
+		}
+		uint32_t nnode_tasks = (width + NODES_PER_TASK - 1) / NODES_PER_TASK;
+		for (uint32_t t = 0; t < nnode_tasks; t++)
+		{
+			node_tasks[t].obj = obj;
+			node_tasks[t].first = first + t * NODES_PER_TASK;
+			node_tasks[t].last = t + 1 == nnode_tasks ? first + width
+				: node_tasks[t].first + NODES_PER_TASK;
+			if (pool_submit(pool, hash_nodes, &node_tasks[t]))
+			{
+				// finish the rest of the level here
+				node_tasks[t].last = first + width;
+				hash_nodes(&node_tasks[t]);
+				break;
+			}
+		}
+		pool_wait(pool);
+	}
+	free(chunk_tasks);
+	free(node_tasks);
+	return failed;
+}
+
+// splitmix64, each block of the generated file has its own stream
+static uint64_t next_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static void generate_block(void *arg)
+{
+	Generate_task *task = (Generate_task *)arg;
+	uint8_t *buffer = malloc(GENERATE_BLOCK_SIZE);
+	if (!buffer)
+	{
+		task->failed = 1;
+		return;
+	}
+	uint64_t state = task->seed ^ (task->offset * 0xd1342543de82ef95ull);
+	for (size_t i = 0; i < task->length; i += sizeof(uint64_t))
+	{
+		uint64_t r = next_random(&state);
+		size_t n = task->length - i < sizeof(r) ? task->length - i
+			: sizeof(r);
+		memcpy(buffer + i, &r, n);
+	}
+	size_t done = 0;
+	while (done < task->length)
+	{
+		ssize_t wrote = pwrite(task->fd, buffer + done, task->length - done,
+			task->offset + done);
+		if (wrote <= 0)
+		{
+			task->failed = 1;
+			break;
+		}
+		done += wrote;
+	}
+	free(buffer);
+}
+
+/**
+ * Writes size pseudo random bytes to path, the content only depends on
+ * the seed so datasets can be regenerated
+ */
+static int generate_data(Thread_pool *pool, const char *path, uint64_t size,
+	uint64_t seed)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Unable to create file: %s\n", path);
+		return 1;
+	}
+	size_t ntasks = (size + GENERATE_BLOCK_SIZE - 1) / GENERATE_BLOCK_SIZE;
+	Generate_task *tasks = calloc(ntasks, sizeof(Generate_task));
+	if (!tasks)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		close(fd);
+		return 1;
+	}
+	for (size_t t = 0; t < ntasks; t++)
+	{
+		tasks[t].fd = fd;
+		tasks[t].seed = seed;
+		tasks[t].offset = t * (uint64_t)GENERATE_BLOCK_SIZE;
+		tasks[t].length = t + 1 == ntasks ? size - tasks[t].offset
+			: GENERATE_BLOCK_SIZE;
+		if (pool_submit(pool, generate_block, &tasks[t]))
+		{
+			tasks[t].failed = 1;
+			break;
+		}
+	}
+	pool_wait(pool);
+	int failed = 0;
+	for (size_t t = 0; t < ntasks; t++)
+	{
+		failed |= tasks[t].failed;
+	}
+	free(tasks);
+	if (close(fd) != 0 || failed)
+	{
+		fprintf(stderr, "Error writing file: %s\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+static int build(Thread_pool *pool, const Build_args *args)
+{
+	if (strlen(args->path) >= BPKG_FILENAME_SIZE)
+	{
+		fprintf(stderr, "Filename too long\n");
+		return 1;
+	}
+	if (args->generate > 0 && generate_data(pool, args->path,
+		(uint64_t)args->generate, args->seeded ? args->seed : 0))
+	{
+		return 1;
+	}
+	int fd = open(args->path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "Unable to open file: %s\n", args->path);
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return 1;
+	}
+	// sizes and offsets are 32 bit in the manifest
+	if (st.st_size == 0 || st.st_size > UINT32_MAX)
+	{
+		fprintf(stderr, "File size must be between 1 byte and 4 GiB\n");
+		close(fd);
+		return 1;
+	}
+	uint32_t nchunks, chunksz;
+	if (choose_layout(args, (uint64_t)st.st_size, &nchunks, &chunksz))
+	{
+		close(fd);
+		return 1;
+	}
+	bpkg_obj *obj = create_package(args, (uint32_t)st.st_size, nchunks,
+		chunksz);
+	if (!obj)
+	{
+		close(fd);
+		return 1;
+	}
+	int failed = hash_package(pool, obj, fd);
+	close(fd);
+	if (!failed)
+	{
+		failed = bpkg_text_write(obj, args->output)
+			|| (args->binary && bpkg_bin_write(obj, args->binary));
+	}
+	bpkg_obj_destroy(obj);
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	Build_args args;
+	if (parse_args(argc, argv, &args))
+	{
+		print_usage();
+		return 1;
+	}
+	Thread_pool *pool = pool_create(args.threads);
+	if (!pool)
+	{
+		return 1;
+	}
+	int failed = build(pool, &args);
+	pool_destroy(pool);
+	if (failed)
+	{
+		fprintf(stderr, "Unable to produce a package\n");
+	}
+	return failed;
+}
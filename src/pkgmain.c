@@ -1,13 +1,22 @@
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 #include <chk/pkgchk.h>
+#include <chk/bpkgbin.h>
 #include <crypt/sha256.h>
+#include <pool/threadpool.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #define SHA256_HEX_LEN (64)
+#define MAXBATCHQUERIES 16
+#define MAXPATHLENGTH 4096
 
 int arg_select(int argc, char **argv, int *asel, char *harg)
 {
@@ -46,6 +55,19 @@ int arg_select(int argc, char **argv, int *asel, char *harg)
 	{
 		*asel = 5;
 	}
+	if (strcmp(cursor, "-batch") == 0)
+	{
+		*asel = 6;
+	}
+	if (strcmp(cursor, "-compile") == 0 || strcmp(cursor, "-decompile") == 0)
+	{
+		if (argc < 4)
+		{
+			puts("output file not provided");
+			exit(1);
+		}
+		*asel = cursor[1] == 'c' ? 7 : 8;
+	}
 	return *asel;
 }
 
@@ -57,6 +79,441 @@ void bpkg_print_hashes(bpkg_query *qry)
 	}
 }
 
+// build job of the single package mode, cancelled by SIGINT
+static Merkle_build_job progress_job;
+
+void progress_sigint(int signum)
+{
+	merkle_job_cancel(&progress_job);
+}
+
+typedef struct
+{
+	bpkg_obj *obj;
+	int result;
+	atomic_int done;
+} Progress_build;
+
+void *progress_build_thread(void *arg)
+{
+	Progress_build *build = (Progress_build *)arg;
+	build->result = bpkg_intialise_merkle_job(build->obj, &progress_job);
+	atomic_store(&build->done, 1);
+	return NULL;
+}
+
+void print_progress(FILE *out, Merkle_build_job *job)
+{
+	Merkle_progress p;
+	merkle_job_progress(job, &p);
+	fprintf(out, "\rHashed %u/%u chunks, %.1f/%.1f MiB", p.chunks_hashed,
+		p.chunks_total, p.bytes_hashed / (1024.0 * 1024.0),
+		p.bytes_total / (1024.0 * 1024.0));
+	if (p.eta >= 0)
+	{
+		fprintf(out, ", ETA %.1fs ", p.eta);
+	}
+	fflush(out);
+}
+
+/**
+ * Builds the tree, with -progress the build runs on its own thread while
+ * this one reports progress on stderr and Ctrl-C cancels it cleanly
+ * Returns 1 on failure, in which case obj has been destroyed
+ */
+int build_tree(bpkg_obj *obj, int show_progress)
+{
+	if (!show_progress)
+	{
+		return bpkg_intialise_merkle(obj);
+	}
+	merkle_job_init(&progress_job, obj);
+	struct sigaction sa = {0};
+	sa.sa_handler = progress_sigint;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+
+	Progress_build build = {.obj = obj, .result = 1};
+	atomic_init(&build.done, 0);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, progress_build_thread, &build) != 0)
+	{
+		return bpkg_intialise_merkle_job(obj, &progress_job);
+	}
+	struct timespec interval = {0, 250 * 1000 * 1000};
+	while (!atomic_load(&build.done))
+	{
+		print_progress(stderr, &progress_job);
+		nanosleep(&interval, NULL);
+	}
+	pthread_join(thread, NULL);
+	print_progress(stderr, &progress_job);
+	fputc('\n', stderr);
+	if (merkle_job_cancelled(&progress_job))
+	{
+		fputs("Build cancelled\n", stderr);
+	}
+	signal(SIGINT, SIG_DFL);
+	return build.result;
+}
+
+int has_flag(int argc, char **argv, const char *flag)
+{
+	for (int i = 3; i < argc; i++)
+	{
+		if (strcmp(argv[i], flag) == 0)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// one query flag of a batch run, hash only used by -hashes_of
+typedef struct
+{
+	int asel;
+	char hash[SHA256_HEX_LEN + 1];
+} Batch_query;
+
+// a single package of the batch, output holds its result section
+typedef struct
+{
+	char path[MAXPATHLENGTH];
+	const Batch_query *queries;
+	int nqueries;
+	char *output;
+	size_t output_len;
+	int failed;
+	uint64_t bytes;
+} Batch_job;
+
+// prints the hashes of a query into a result section
+void batch_print_hashes(FILE *out, bpkg_query *qry)
+{
+	for (size_t i = 0; i < qry->len; i++)
+	{
+		fprintf(out, "%.64s\n", qry->hashes[i]);
+	}
+}
+
+// data files are relative to the .bpkg rather than the working directory
+// so packages from different folders can be verified in one run
+int batch_resolve_filename(bpkg_obj *obj, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (obj->filename[0] == '/' || slash == NULL)
+	{
+		return 0;
+	}
+	char resolved[BPKG_FILENAME_SIZE];
+	int n = snprintf(resolved, sizeof(resolved), "%.*s/%s",
+		(int)(slash - path), path, obj->filename);
+	if (n < 0 || n >= (int)sizeof(resolved))
+	{
+		return 1;
+	}
+	return bpkg_set_filename(obj, resolved, n);
+}
+
+// worker task, loads the package, builds the tree once and runs every query
+// against it; the exiting bpkg_* wrappers are avoided so one bad package
+// cannot take down the whole batch
+void batch_verify(void *arg)
+{
+	Batch_job *job = (Batch_job *)arg;
+	FILE *out = open_memstream(&job->output, &job->output_len);
+	if (!out)
+	{
+		job->failed = 1;
+		return;
+	}
+	fprintf(out, "== %s ==\n", job->path);
+	bpkg_obj *obj = bpkg_load(job->path);
+	// sections first, a malformed manifest must not create the data file
+	if (!obj || batch_resolve_filename(obj, job->path) 
+		|| bpkg_load_sections(obj))
+	{
+		bpkg_obj_destroy(obj);
+		fputs("Error: Unable to parse the '.bpkg' file. Check file integrity"
+			" and completeness.\n", out);
+		job->failed = 1;
+		fclose(out);
+		return;
+	}
+	// file check has to run first since it may create the data file
+	bpkg_query check = {0};
+	for (int i = 0; i < job->nqueries; i++)
+	{
+		if (job->queries[i].asel == 5 && check.hashes == NULL)
+		{
+			check = bpkg_file_check(obj);
+		}
+	}
+	// on failure this already destroys obj
+	if (bpkg_intialise_merkle(obj))
+	{
+		bpkg_query_destroy(&check);
+		fputs("Error: Unable to parse the '.bpkg' file. Check file "
+			"integrity and completeness.\n", out);
+		job->failed = 1;
+		fclose(out);
+		return;
+	}
+	job->bytes = obj->size;
+	for (int i = 0; i < job->nqueries; i++)
+	{
+		const Batch_query *q = &job->queries[i];
+		bpkg_query qry = {0};
+		if (q->asel == 1)
+		{
+			qry.hashes = levelOrderTraversal(obj);
+			qry.len = qry.hashes ? obj->merkle->n_nodes : 0;
+		}
+		else if (q->asel == 2)
+		{
+			qry = get_complete_chunks(obj, 0, "");
+		}
+		else if (q->asel == 3)
+		{
+			qry = get_complete_chunks(obj, 1, "");
+		}
+		else if (q->asel == 4)
+		{
+			qry = get_complete_chunks(obj, 2, (char *)q->hash);
+		}
+		else if (q->asel == 5)
+		{
+			qry = check;
+			check.hashes = NULL;
+		}
+		batch_print_hashes(out, &qry);
+		bpkg_query_destroy(&qry);
+	}
+	bpkg_query_destroy(&check);
+	bpkg_obj_destroy(obj);
+	fclose(out);
+}
+
+int ends_with(const char *s, const char *suffix)
+{
+	size_t len = strlen(s);
+	size_t slen = strlen(suffix);
+	return len >= slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+int compare_jobs(const void *a, const void *b)
+{
+	return strcmp(((const Batch_job *)a)->path, ((const Batch_job *)b)->path);
+}
+
+// appends a path to the job list, growing it when full
+int batch_add_job(Batch_job **jobs, size_t *njobs, size_t *cap,
+	const char *path)
+{
+	if (*njobs == *cap)
+	{
+		size_t new_cap = *cap ? *cap * 2 : 64;
+		Batch_job *new_jobs = realloc(*jobs, new_cap * sizeof(Batch_job));
+		if (!new_jobs)
+		{
+			fprintf(stderr, "Memory allocation failed\n");
+			return 1;
+		}
+		*jobs = new_jobs;
+		*cap = new_cap;
+	}
+	Batch_job *job = &(*jobs)[(*njobs)++];
+	memset(job, 0, sizeof(Batch_job));
+	snprintf(job->path, sizeof(job->path), "%s", path);
+	return 0;
+}
+
+// a directory contributes every .bpkg inside it (sorted so the output is
+// stable), anything else is read as a list file with one path per line
+Batch_job *batch_collect(const char *source, size_t *njobs)
+{
+	Batch_job *jobs = NULL;
+	size_t cap = 0;
+	*njobs = 0;
+	struct stat st;
+	if (stat(source, &st) != 0)
+	{
+		fprintf(stderr, "Unable to open %s\n", source);
+		return NULL;
+	}
+	if (S_ISDIR(st.st_mode))
+	{
+		DIR *dir = opendir(source);
+		if (!dir)
+		{
+			fprintf(stderr, "Unable to open %s\n", source);
+			return NULL;
+		}
+		size_t dlen = strlen(source);
+		int need_slash = dlen > 0 && source[dlen - 1] != '/';
+		struct dirent *entry;
+		char path[MAXPATHLENGTH];
+		while ((entry = readdir(dir)) != NULL)
+		{
+			if (!ends_with(entry->d_name, ".bpkg"))
+			{
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s%s%s", source,
+				need_slash ? "/" : "", entry->d_name);
+			if (batch_add_job(&jobs, njobs, &cap, path))
+			{
+				closedir(dir);
+				free(jobs);
+				return NULL;
+			}
+		}
+		closedir(dir);
+		if (*njobs > 0)
+		{
+			qsort(jobs, *njobs, sizeof(Batch_job), compare_jobs);
+		}
+		return jobs;
+	}
+	FILE *file = fopen(source, "r");
+	if (!file)
+	{
+		fprintf(stderr, "Unable to open %s\n", source);
+		return NULL;
+	}
+	char line[MAXPATHLENGTH];
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == '\0')
+		{
+			continue;
+		}
+		if (batch_add_job(&jobs, njobs, &cap, line))
+		{
+			fclose(file);
+			free(jobs);
+			return NULL;
+		}
+	}
+	fclose(file);
+	return jobs;
+}
+
+/**
+ * Batch mode: ./pkgmain <directory|list file> -batch [-j N] <flag> [flag...]
+ * Every package is verified on a shared worker pool, result sections are
+ * printed in input order on stdout and the aggregate throughput on stderr
+ */
+int batch_main(int argc, char **argv)
+{
+	Batch_query queries[MAXBATCHQUERIES];
+	int nqueries = 0;
+	int nthreads = 0;
+	for (int i = 3; i < argc; i++)
+	{
+		int asel = 0;
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+		{
+			nthreads = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "-all_hashes") == 0)
+		{
+			asel = 1;
+		}
+		else if (strcmp(argv[i], "-chunk_check") == 0)
+		{
+			asel = 2;
+		}
+		else if (strcmp(argv[i], "-min_hashes") == 0)
+		{
+			asel = 3;
+		}
+		else if (strcmp(argv[i], "-hashes_of") == 0 && i + 1 < argc)
+		{
+			asel = 4;
+		}
+		else if (strcmp(argv[i], "-file_check") == 0)
+		{
+			asel = 5;
+		}
+		if (asel == 0 || nqueries == MAXBATCHQUERIES)
+		{
+			puts("Argument is invalid");
+			return 1;
+		}
+		queries[nqueries].asel = asel;
+		queries[nqueries].hash[0] = '\0';
+		if (asel == 4)
+		{
+			snprintf(queries[nqueries].hash, sizeof(queries[nqueries].hash),
+				"%s", argv[++i]);
+		}
+		nqueries++;
+	}
+	if (nqueries == 0)
+	{
+		puts("No query flags provided for batch");
+		return 1;
+	}
+
+	size_t njobs = 0;
+	Batch_job *jobs = batch_collect(argv[1], &njobs);
+	if (!jobs)
+	{
+		puts("No packages found for batch");
+		return 1;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	Thread_pool *pool = pool_create(nthreads);
+	if (!pool)
+	{
+		free(jobs);
+		return 1;
+	}
+	for (size_t i = 0; i < njobs; i++)
+	{
+		jobs[i].queries = queries;
+		jobs[i].nqueries = nqueries;
+		if (pool_submit(pool, batch_verify, &jobs[i]))
+		{
+			// run it inline rather than dropping the package
+			batch_verify(&jobs[i]);
+		}
+	}
+	pool_wait(pool);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	int failed = 0;
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < njobs; i++)
+	{
+		if (jobs[i].output)
+		{
+			fwrite(jobs[i].output, 1, jobs[i].output_len, stdout);
+			free(jobs[i].output);
+		}
+		failed += jobs[i].failed;
+		bytes += jobs[i].bytes;
+	}
+	double elapsed = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (elapsed <= 0)
+	{
+		elapsed = 1e-9;
+	}
+	fprintf(stderr, "Batch: %zu packages, %d failed, %d threads, %.3f s, "
+		"%.1f packages/s, %.2f MiB/s\n", njobs, failed, pool->nthreads,
+		elapsed, njobs / elapsed, bytes / (1024.0 * 1024.0) / elapsed);
+	pool_destroy(pool);
+	free(jobs);
+	return failed ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
 
@@ -81,9 +538,15 @@ int main(int argc, char **argv)
 
 	int argselect = 0;
 	char hash[SHA256_HEX_LEN];
+	// report build progress on stderr, e.g. ./pkgmain a.bpkg -all_hashes -progress
+	int show_progress = has_flag(argc, argv, "-progress");
 
 	if (arg_select(argc, argv, &argselect, hash))
 	{
+		if (argselect == 6)
+		{
+			return batch_main(argc, argv);
+		}
 		bpkg_query qry = {0};
 		bpkg_obj *obj = bpkg_load(argv[1]);
 
@@ -96,7 +559,7 @@ int main(int argc, char **argv)
 
 		if (argselect == 1)
 		{
-			if (bpkg_intialise_merkle(obj))
+			if (build_tree(obj, show_progress))
 			{
 				puts("Error: Unable to parse the '.bpkg' file. Check file "
 					"integrity and completeness.");
@@ -108,7 +571,7 @@ int main(int argc, char **argv)
 		}
 		else if (argselect == 2)
 		{
-			if (bpkg_intialise_merkle(obj))
+			if (build_tree(obj, show_progress))
 			{
 				puts("Error: Unable to parse the '.bpkg' file. Check file "
 					"integrity and completeness.");
@@ -120,7 +583,7 @@ int main(int argc, char **argv)
 		}
 		else if (argselect == 3)
 		{
-			if (bpkg_intialise_merkle(obj))
+			if (build_tree(obj, show_progress))
 			{
 				puts("Error: Unable to parse the '.bpkg' file. Check file "
 					"integrity and completeness.");
@@ -132,7 +595,7 @@ int main(int argc, char **argv)
 		}
 		else if (argselect == 4)
 		{
-			if (bpkg_intialise_merkle(obj))
+			if (build_tree(obj, show_progress))
 			{
 				puts("Error: Unable to parse the '.bpkg' file. Check file "
 					"integrity and completeness.");
@@ -147,8 +610,15 @@ int main(int argc, char **argv)
 			// print_bpkg_obj(obj, obj->filename);
 			// debug(obj->merkle);
 			// char** q = levelOrderTraversal(obj);
+			// a malformed manifest must not create the data file
+			if (bpkg_load_sections(obj))
+			{
+				puts("Error: Unable to parse the '.bpkg' file. Check file "
+					"integrity and completeness.");
+				exit(1);
+			}
 			qry = bpkg_file_check(obj);
-			if (bpkg_intialise_merkle(obj))
+			if (build_tree(obj, show_progress))
 			{
 				puts("Error: Unable to parse the '.bpkg' file. Check file "
 					"integrity and completeness.");
@@ -157,6 +627,15 @@ int main(int argc, char **argv)
 			bpkg_print_hashes(&qry);
 			bpkg_query_destroy(&qry);
 		}
+		else if (argselect == 7 || argselect == 8)
+		{
+			// ./pkgmain <in> -compile <out.bpkgb> or -decompile <out.bpkg>
+			// the input can be either format
+			int failed = argselect == 7 ? bpkg_bin_write(obj, argv[3])
+				: bpkg_text_write(obj, argv[3]);
+			bpkg_obj_destroy(obj);
+			return failed;
+		}
 		else
 		{
 			puts("Argument is invalid");
@@ -0,0 +1,68 @@
+#define _POSIX_C_SOURCE 200112L
+#include "pool/epoch.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sched.h>
+
+// a cache line per slot, so readers never write to a line another uses
+typedef struct
+{
+    // epoch the reader entered in, 0 while it is outside
+    _Atomic uint64_t epoch;
+    char pad[64 - sizeof(uint64_t)];
+} Epoch_slot;
+
+static _Atomic uint64_t global_epoch = 1;
+static Epoch_slot slots[EPOCH_SLOTS];
+static atomic_int slots_used = 0;
+// readers that found no free slot
+static atomic_int overflow_readers = 0;
+// this thread's slot, EPOCH_SLOTS once none was left
+static _Thread_local int own_slot = -1;
+
+void epoch_enter(void)
+{
+    if (own_slot < 0)
+    {
+        int slot = atomic_fetch_add(&slots_used, 1);
+        own_slot = slot < EPOCH_SLOTS ? slot : EPOCH_SLOTS;
+    }
+    if (own_slot == EPOCH_SLOTS)
+    {
+        atomic_fetch_add(&overflow_readers, 1);
+        return;
+    }
+    // seq_cst, so the store is ordered before the reads it protects
+    atomic_store(&slots[own_slot].epoch, atomic_load(&global_epoch));
+}
+
+void epoch_exit(void)
+{
+    if (own_slot == EPOCH_SLOTS)
+    {
+        atomic_fetch_sub(&overflow_readers, 1);
+        return;
+    }
+    atomic_store_explicit(&slots[own_slot].epoch, 0, memory_order_release);
+}
+
+void epoch_synchronize(void)
+{
+    // readers entering from here on see what was published before
+    uint64_t now = atomic_fetch_add(&global_epoch, 1) + 1;
+    int used = atomic_load(&slots_used);
+    used = used < EPOCH_SLOTS ? used : EPOCH_SLOTS;
+    for (int i = 0; i < used; i++)
+    {
+        uint64_t entered;
+        while ((entered = atomic_load(&slots[i].epoch)) != 0
+            && entered < now)
+        {
+            sched_yield();
+        }
+    }
+    while (atomic_load(&overflow_readers) > 0)
+    {
+        sched_yield();
+    }
+}
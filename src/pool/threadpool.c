@@ -0,0 +1,149 @@
+#define _POSIX_C_SOURCE 200112L
+#include "pool/threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// number of online cpus, at least 1
+int pool_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// worker loop, takes tasks off the queue until shutdown and queue is empty
+static void *pool_worker(void *arg)
+{
+    Thread_pool *pool = (Thread_pool *)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == NULL && !pool->shutdown)
+        {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->head == NULL)
+        {
+            // shutdown and nothing left to do
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        Pool_task *task = pool->head;
+        pool->head = task->next;
+        if (pool->head == NULL)
+        {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        task->fn(task->arg);
+        free(task);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+        {
+            pthread_cond_broadcast(&pool->all_done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+Thread_pool *pool_create(int nthreads)
+{
+    if (nthreads <= 0)
+    {
+        nthreads = pool_default_threads();
+    }
+    Thread_pool *pool = calloc(1, sizeof(Thread_pool));
+    if (!pool)
+    {
+        fprintf(stderr, "Error allocating memory\n");
+        return NULL;
+    }
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if (!pool->threads)
+    {
+        fprintf(stderr, "Error allocating memory\n");
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+    for (int i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0)
+        {
+            fprintf(stderr, "Failed to create pool thread\n");
+            // keep the ones that started so they can be joined
+            break;
+        }
+        pool->nthreads++;
+    }
+    if (pool->nthreads == 0)
+    {
+        pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int pool_submit(Thread_pool *pool, pool_task_fn fn, void *arg)
+{
+    Pool_task *task = malloc(sizeof(Pool_task));
+    if (!task)
+    {
+        fprintf(stderr, "Error allocating memory\n");
+        return 1;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+    {
+        pool->tail->next = task;
+    }
+    else
+    {
+        pool->head = task;
+    }
+    pool->tail = task;
+    pool->pending++;
+    pthread_cond_signal(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void pool_wait(Thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+    {
+        pthread_cond_wait(&pool->all_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(Thread_pool *pool)
+{
+    if (!pool)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool->threads);
+    free(pool);
+}
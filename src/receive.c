@@ -0,0 +1,323 @@
+#include "package/receive.h"
+#include "package/package.h"
+#include "package/download.h"
+#include "crypt/sha256.h"
+#include "pool/threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// sockets sharing a stripe share the lock of their assemblies
+#define RECEIVE_STRIPES 64
+
+// a chunk part way through arriving from one peer
+typedef struct Assembly
+{
+    bpkg_obj *obj;
+    int socket;
+    uint32_t chunk;
+    uint32_t size;
+    // bytes in so far, the next slice starts there
+    uint32_t received;
+    struct sha256_compute_data sha;
+    uint8_t *data;
+    struct Assembly *next;
+} Assembly;
+
+// a chunk that matched, waiting for a writer
+typedef struct
+{
+    bpkg_obj *obj;
+    int socket;
+    uint32_t chunk;
+    uint8_t digest[SHA256_DIGEST_SZ];
+    uint8_t *data;
+} Write_task;
+
+static pthread_mutex_t stripe_locks[RECEIVE_STRIPES] = {
+    [0 ... RECEIVE_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static Assembly *stripes[RECEIVE_STRIPES];
+
+// NULL until receive_start and after receive_stop
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static Thread_pool *writers = NULL;
+// bytes handed to the writers and not yet written
+static atomic_size_t queued_bytes = 0;
+
+static unsigned stripe_of(int socket)
+{
+    return (unsigned)socket % RECEIVE_STRIPES;
+}
+
+static void assembly_free(Assembly *a)
+{
+    free(a->data);
+    free(a);
+}
+
+// takes the assembly of chunk from socket out of its stripe, NULL if none
+static Assembly *take(unsigned stripe, const bpkg_obj *obj, int socket,
+    uint32_t chunk)
+{
+    for (Assembly **link = &stripes[stripe]; *link != NULL;
+        link = &(*link)->next)
+    {
+        Assembly *a = *link;
+        if (a->obj == obj && a->socket == socket && a->chunk == chunk)
+        {
+            *link = a->next;
+            return a;
+        }
+    }
+    return NULL;
+}
+
+int receive_start(void)
+{
+    Thread_pool *pool = pool_create(RECEIVE_WRITERS);
+    if (!pool)
+    {
+        return 1;
+    }
+    pthread_mutex_lock(&writer_lock);
+    writers = pool;
+    pthread_mutex_unlock(&writer_lock);
+    return 0;
+}
+
+void receive_stop(void)
+{
+    pthread_mutex_lock(&writer_lock);
+    Thread_pool *pool = writers;
+    writers = NULL;
+    pthread_mutex_unlock(&writer_lock);
+    // no chunk is queued once it is NULL, the queued ones are written first
+    if (pool)
+    {
+        pool_destroy(pool);
+    }
+}
+
+// writer task, commits a chunk and tells the download how it went
+static void write_chunk(void *arg)
+{
+    Write_task *task = (Write_task *)arg;
+    int written = package_commit_chunk(task->obj, task->chunk, task->data,
+        task->digest);
+    atomic_fetch_sub(&queued_bytes, bpkg_chunk_size(task->obj, task->chunk));
+    download_chunk_received(task->obj, task->socket, task->chunk, written);
+    package_put(task->obj);
+    free(task->data);
+    free(task);
+}
+
+/**
+ * Hands a chunk that matched to a writer, taking over *owned if it is not
+ * NULL and copying data otherwise
+ * @return 0 if it was queued, 1 if the caller has to write it
+ */
+static int queue_write(bpkg_obj *obj, int socket, uint32_t chunk,
+    const uint8_t *digest, const uint8_t *data, uint8_t **owned)
+{
+    uint32_t size = bpkg_chunk_size(obj, chunk);
+    // once the disk falls this far behind the reactors wait on it
+    if (atomic_fetch_add(&queued_bytes, size) + size > RECEIVE_QUEUE_MAX)
+    {
+        atomic_fetch_sub(&queued_bytes, size);
+        return 1;
+    }
+    Write_task *task = malloc(sizeof(Write_task));
+    uint8_t *buffer = owned ? *owned : malloc(size);
+    if (!task || !buffer)
+    {
+        perror("Malloc failed");
+        free(task);
+        if (!owned)
+        {
+            free(buffer);
+        }
+        atomic_fetch_sub(&queued_bytes, size);
+        return 1;
+    }
+    if (!owned)
+    {
+        memcpy(buffer, data, size);
+    }
+    *task = (Write_task){
+        .obj = obj,
+        .socket = socket,
+        .chunk = chunk,
+        .data = buffer
+    };
+    memcpy(task->digest, digest, SHA256_DIGEST_SZ);
+    package_hold(obj);
+    pthread_mutex_lock(&writer_lock);
+    int failed = !writers || pool_submit(writers, write_chunk, task) != 0;
+    pthread_mutex_unlock(&writer_lock);
+    if (failed)
+    {
+        package_put(obj);
+        if (!owned)
+        {
+            free(buffer);
+        }
+        free(task);
+        atomic_fetch_sub(&queued_bytes, size);
+        return 1;
+    }
+    if (owned)
+    {
+        *owned = NULL;
+    }
+    return 0;
+}
+
+/**
+ * Hashes a whole chunk, one that matches goes to a writer or, if none
+ * takes it, is committed here
+ */
+static int finish(bpkg_obj *obj, int socket, uint32_t chunk,
+    struct sha256_compute_data *sha, const uint8_t *data, uint8_t **owned)
+{
+    uint8_t hashout[32];
+    sha256_finalize(sha, hashout);
+    uint8_t digest[SHA256_DIGEST_SZ];
+    sha256_output(sha, digest);
+    if (memcmp(digest, bpkg_chunk_digest(obj, chunk), SHA256_DIGEST_SZ) != 0)
+    {
+        return RECEIVE_CORRUPT;
+    }
+    if (queue_write(obj, socket, chunk, digest, data, owned) == 0)
+    {
+        return RECEIVE_QUEUED;
+    }
+    return package_commit_chunk(obj, chunk, data, digest)
+        ? RECEIVE_COMMITTED : RECEIVE_CORRUPT;
+}
+
+int receive_slice(bpkg_obj *obj, int socket, uint32_t chunk,
+    uint32_t offset, const uint8_t *data, uint32_t size)
+{
+    uint32_t start = bpkg_chunk_offset(obj, chunk);
+    uint32_t length = bpkg_chunk_size(obj, chunk);
+    if (offset < start || size > length || offset - start > length - size)
+    {
+        return RECEIVE_PENDING;
+    }
+    // a jumbo frame can carry the whole chunk, it needs no copy
+    if (offset == start && size == length)
+    {
+        unsigned stripe = stripe_of(socket);
+        pthread_mutex_lock(&stripe_locks[stripe]);
+        Assembly *stale = take(stripe, obj, socket, chunk);
+        pthread_mutex_unlock(&stripe_locks[stripe]);
+        if (stale)
+        {
+            assembly_free(stale);
+        }
+        struct sha256_compute_data sha;
+        sha256_compute_data_init(&sha);
+        sha256_update(&sha, (void *)data, size);
+        // the frame is the reactor's, a writer gets a copy
+        return finish(obj, socket, chunk, &sha, data, NULL);
+    }
+
+    unsigned stripe = stripe_of(socket);
+    pthread_mutex_lock(&stripe_locks[stripe]);
+    Assembly *a = take(stripe, obj, socket, chunk);
+    // the first slice starts the chunk over, e.g. when it is requested again
+    if (a && offset == start)
+    {
+        a->received = 0;
+        sha256_compute_data_init(&a->sha);
+    }
+    if (!a && offset == start)
+    {
+        a = calloc(1, sizeof(Assembly));
+        uint8_t *buffer = a ? malloc(length) : NULL;
+        if (!buffer)
+        {
+            perror("Malloc failed");
+            free(a);
+            pthread_mutex_unlock(&stripe_locks[stripe]);
+            return RECEIVE_PENDING;
+        }
+        *a = (Assembly){
+            .obj = obj,
+            .socket = socket,
+            .chunk = chunk,
+            .size = length,
+            .data = buffer
+        };
+        sha256_compute_data_init(&a->sha);
+    }
+    if (a && offset - start != a->received)
+    {
+        // a gap or a repeat, what came before can no longer be hashed
+        assembly_free(a);
+        a = NULL;
+    }
+    if (!a)
+    {
+        pthread_mutex_unlock(&stripe_locks[stripe]);
+        return RECEIVE_PENDING;
+    }
+    memcpy(a->data + a->received, data, size);
+    sha256_update(&a->sha, (void *)data, size);
+    a->received += size;
+    if (a->received < a->size)
+    {
+        a->next = stripes[stripe];
+        stripes[stripe] = a;
+        pthread_mutex_unlock(&stripe_locks[stripe]);
+        return RECEIVE_PENDING;
+    }
+    pthread_mutex_unlock(&stripe_locks[stripe]);
+    // out of the stripe, hashing the rest does not hold up other sockets
+    int result = finish(obj, socket, chunk, &a->sha, a->data, &a->data);
+    assembly_free(a);
+    return result;
+}
+
+void receive_drop_socket(int socket)
+{
+    unsigned stripe = stripe_of(socket);
+    pthread_mutex_lock(&stripe_locks[stripe]);
+    Assembly **link = &stripes[stripe];
+    while (*link != NULL)
+    {
+        Assembly *a = *link;
+        if (a->socket == socket)
+        {
+            *link = a->next;
+            assembly_free(a);
+            continue;
+        }
+        link = &a->next;
+    }
+    pthread_mutex_unlock(&stripe_locks[stripe]);
+}
+
+void receive_drop_package(bpkg_obj *obj)
+{
+    for (unsigned stripe = 0; stripe < RECEIVE_STRIPES; stripe++)
+    {
+        pthread_mutex_lock(&stripe_locks[stripe]);
+        Assembly **link = &stripes[stripe];
+        while (*link != NULL)
+        {
+            Assembly *a = *link;
+            if (a->obj == obj)
+            {
+                *link = a->next;
+                assembly_free(a);
+                continue;
+            }
+            link = &a->next;
+        }
+        pthread_mutex_unlock(&stripe_locks[stripe]);
+    }
+}
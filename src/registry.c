@@ -0,0 +1,591 @@
+#define _DEFAULT_SOURCE
+#include "package/registry.h"
+#include "package/package.h"
+#include "package/datafile.h"
+#include "crypt/sha256.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define STATE_MAGIC "BTSTATE"
+#define STATE_VERSION 3
+// chars of the ident's sha256 used to name its state file
+#define STATE_NAME_LENGTH 32
+// room left in a path for the names inside the state directory
+#define STATE_DIR_LENGTH (PATH_MAX - 64)
+
+/**
+ * Start of a state file, followed by the verified bitmap
+ * The data file's size, inode, mtime and ctime are stamped when the state
+ * file is created and again after each sync of the node's own writes, set
+ * bits are only trusted while all four still match. Any other change to the
+ * file, an edit in place included, has every chunk hashed again
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nchunks;
+    uint32_t size;
+    uint32_t reserved;
+    // root hash of the manifest, ties the state to one package
+    uint8_t root[SHA256_DIGEST_SZ];
+    uint64_t data_size;
+    uint64_t data_inode;
+    // nanoseconds since the epoch
+    uint64_t data_mtime;
+    uint64_t data_ctime;
+} State_header;
+
+typedef struct Registry_entry
+{
+    // NULL while a saved package has not been restored yet
+    bpkg_obj *obj;
+    char *manifest;
+    char state_path[PATH_MAX];
+    int fd;
+    uint8_t *bitmap;
+    uint32_t nchunks;
+    // verified chunks whose bits wait for the data file to be synced
+    uint32_t *unsynced;
+    uint32_t nunsynced;
+    uint32_t unsynced_size;
+    struct Registry_entry *next;
+} Registry_entry;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static int enabled = 0;
+static char state_dir[STATE_DIR_LENGTH];
+static char list_path[PATH_MAX];
+// in the order the packages were added
+static Registry_entry *entries = NULL;
+
+static size_t bitmap_size(uint32_t nchunks)
+{
+    return ((size_t)nchunks + 7) / 8;
+}
+
+// state files are named after the ident's hash, idents can be 1023 chars
+static void state_path(const bpkg_obj *obj, char out[PATH_MAX])
+{
+    struct sha256_compute_data cdata;
+    sha256_compute_data_init(&cdata);
+    sha256_update(&cdata, (void *)obj->ident, strlen(obj->ident));
+    uint8_t hashout[32];
+    sha256_finalize(&cdata, hashout);
+    uint8_t digest[SHA256_DIGEST_SZ];
+    sha256_output(&cdata, digest);
+    char hex[2 * SHA256_DIGEST_SZ];
+    sha256_digest_to_hex(digest, hex);
+    snprintf(out, PATH_MAX, "%s/%.*s.state", state_dir, STATE_NAME_LENGTH,
+        hex);
+}
+
+// fills in the data file fields of the header
+static int data_stamp(const char *filename, State_header *h)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+    {
+        return 1;
+    }
+    h->data_size = st.st_size;
+    h->data_inode = st.st_ino;
+    h->data_mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000
+        + st.st_mtim.tv_nsec;
+    h->data_ctime = (uint64_t)st.st_ctim.tv_sec * 1000000000
+        + st.st_ctim.tv_nsec;
+    return 0;
+}
+
+// the data file fields are the last ones of the header
+#define STAMP_OFFSET offsetof(State_header, data_size)
+#define STAMP_LENGTH (sizeof(State_header) - STAMP_OFFSET)
+
+/**
+ * Stamps the data file as it is now, so the node's own writes up to here
+ * do not count as a change, called with registry_lock held
+ */
+static int restamp(Registry_entry *entry)
+{
+    State_header h;
+    if (data_stamp(entry->obj->filename, &h))
+    {
+        return 1;
+    }
+    return pwrite(entry->fd, (uint8_t *)&h + STAMP_OFFSET, STAMP_LENGTH,
+        STAMP_OFFSET) != (ssize_t)STAMP_LENGTH;
+}
+
+static Registry_entry *find_entry(const bpkg_obj *obj)
+{
+    for (Registry_entry *entry = entries; entry; entry = entry->next)
+    {
+        if (entry->obj == obj)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void free_entry(Registry_entry *entry)
+{
+    if (entry->fd >= 0)
+    {
+        close(entry->fd);
+    }
+    free(entry->manifest);
+    free(entry->bitmap);
+    free(entry->unsynced);
+    free(entry);
+}
+
+static Registry_entry *append_entry(const char *manifest)
+{
+    Registry_entry *entry = calloc(1, sizeof(Registry_entry));
+    if (!entry || !(entry->manifest = strdup(manifest)))
+    {
+        perror("Calloc failed");
+        free(entry);
+        return NULL;
+    }
+    entry->fd = -1;
+    Registry_entry **cursor = &entries;
+    while (*cursor)
+    {
+        cursor = &(*cursor)->next;
+    }
+    *cursor = entry;
+    return entry;
+}
+
+// rewrites the package list, renamed into place so a crash leaves either
+// the old or the new list
+static void write_list(void)
+{
+    char tmp_path[PATH_MAX + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", list_path);
+    FILE *file = fopen(tmp_path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Error saving package registry\n");
+        return;
+    }
+    for (Registry_entry *entry = entries; entry; entry = entry->next)
+    {
+        fprintf(file, "%s\n", entry->manifest);
+    }
+    if (ferror(file) | fclose(file) || rename(tmp_path, list_path) != 0)
+    {
+        fprintf(stderr, "Error saving package registry\n");
+        remove(tmp_path);
+    }
+}
+
+int registry_open(const char *directory)
+{
+    int need_slash = directory[strlen(directory) - 1] != '/';
+    snprintf(state_dir, sizeof(state_dir), "%s%s%s", directory,
+        need_slash ? "/" : "", REGISTRY_DIRECTORY);
+    if (mkdir(state_dir, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Failed to create registry directory\n");
+        return 1;
+    }
+    snprintf(list_path, sizeof(list_path), "%s/packages", state_dir);
+    // the saved packages wait for the startup scan to restore them
+    FILE *file = fopen(list_path, "r");
+    if (file)
+    {
+        char line[PATH_MAX];
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0')
+            {
+                append_entry(line);
+            }
+        }
+        fclose(file);
+    }
+    enabled = 1;
+    return 0;
+}
+
+const char *registry_manifests(void)
+{
+    pthread_mutex_lock(&registry_lock);
+    int pending = 0;
+    for (Registry_entry *entry = entries; entry; entry = entry->next)
+    {
+        pending |= entry->obj == NULL;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return enabled && pending ? list_path : NULL;
+}
+
+uint8_t *registry_verified_chunks(bpkg_obj *obj)
+{
+    uint8_t root[SHA256_DIGEST_SZ];
+    if (!enabled || bpkg_root_digest(obj, root))
+    {
+        return NULL;
+    }
+    char path[PATH_MAX];
+    state_path(obj, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    State_header h;
+    State_header now;
+    int valid = pread(fd, &h, sizeof(h), 0) == sizeof(h)
+        && memcmp(h.magic, STATE_MAGIC, sizeof(STATE_MAGIC)) == 0
+        && h.version == STATE_VERSION && h.nchunks == obj->nchunks
+        && h.size == obj->size
+        && memcmp(h.root, root, SHA256_DIGEST_SZ) == 0
+        && data_stamp(obj->filename, &now) == 0
+        && memcmp((uint8_t *)&now + STAMP_OFFSET,
+            (uint8_t *)&h + STAMP_OFFSET, STAMP_LENGTH) == 0;
+    size_t length = bitmap_size(obj->nchunks);
+    uint8_t *bitmap = valid ? malloc(length) : NULL;
+    if (bitmap && pread(fd, bitmap, length, sizeof(h)) != (ssize_t)length)
+    {
+        free(bitmap);
+        bitmap = NULL;
+    }
+    close(fd);
+    return bitmap;
+}
+
+// writes the whole state file for a package whose tree was just built
+static int write_state(Registry_entry *entry)
+{
+    bpkg_obj *obj = entry->obj;
+    State_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+    h.version = STATE_VERSION;
+    h.nchunks = obj->nchunks;
+    h.size = obj->size;
+    // a root that is not hex never matches when the state is read back
+    if (bpkg_root_digest(obj, h.root))
+    {
+        memset(h.root, 0, SHA256_DIGEST_SZ);
+    }
+    if (data_stamp(obj->filename, &h))
+    {
+        return 1;
+    }
+    size_t length = bitmap_size(obj->nchunks);
+    entry->fd = open(entry->state_path, O_RDWR | O_CREAT, 0644);
+    if (entry->fd < 0
+        || pwrite(entry->fd, &h, sizeof(h), 0) != sizeof(h)
+        || pwrite(entry->fd, entry->bitmap, length, sizeof(h))
+            != (ssize_t)length
+        || ftruncate(entry->fd, sizeof(h) + length) != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+void registry_add(bpkg_obj *obj, const char *manifest)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    uint8_t *bitmap = calloc(bitmap_size(obj->nchunks), 1);
+    if (!bitmap)
+    {
+        perror("Calloc failed");
+        return;
+    }
+    // taken before registry_lock, the tree is read under its own lock
+    if (package_verified_chunks(obj, bitmap))
+    {
+        free(bitmap);
+        return;
+    }
+    char resolved[PATH_MAX];
+    if (!realpath(manifest, resolved))
+    {
+        snprintf(resolved, sizeof(resolved), "%s", manifest);
+    }
+    pthread_mutex_lock(&registry_lock);
+    // a saved package being restored keeps its place in the list
+    Registry_entry *entry = NULL;
+    for (Registry_entry *cursor = entries; cursor; cursor = cursor->next)
+    {
+        if (!cursor->obj && strcmp(cursor->manifest, resolved) == 0)
+        {
+            entry = cursor;
+            break;
+        }
+    }
+    if (!entry && !(entry = append_entry(resolved)))
+    {
+        pthread_mutex_unlock(&registry_lock);
+        free(bitmap);
+        return;
+    }
+    entry->obj = obj;
+    entry->nchunks = obj->nchunks;
+    state_path(obj, entry->state_path);
+    entry->bitmap = bitmap;
+    if (write_state(entry))
+    {
+        fprintf(stderr, "Error saving package state\n");
+    }
+    write_list();
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void registry_remove(bpkg_obj *obj)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&registry_lock);
+    Registry_entry **cursor = &entries;
+    while (*cursor && (*cursor)->obj != obj)
+    {
+        cursor = &(*cursor)->next;
+    }
+    Registry_entry *entry = *cursor;
+    if (entry)
+    {
+        *cursor = entry->next;
+        // the same package can be added more than once
+        int shared = 0;
+        for (Registry_entry *other = entries; other; other = other->next)
+        {
+            shared |= other->obj
+                && strcmp(other->state_path, entry->state_path) == 0;
+        }
+        if (!shared)
+        {
+            unlink(entry->state_path);
+        }
+        free_entry(entry);
+        write_list();
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void registry_drop_pending(void)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&registry_lock);
+    int dropped = 0;
+    Registry_entry **cursor = &entries;
+    while (*cursor)
+    {
+        Registry_entry *entry = *cursor;
+        if (entry->obj)
+        {
+            cursor = &entry->next;
+            continue;
+        }
+        *cursor = entry->next;
+        free_entry(entry);
+        dropped = 1;
+    }
+    if (dropped)
+    {
+        write_list();
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// makes room for more unsynced chunks, called with registry_lock held
+static int grow_unsynced(Registry_entry *entry)
+{
+    uint32_t grown = entry->unsynced_size ? 2 * entry->unsynced_size : 16;
+    uint32_t *unsynced = realloc(entry->unsynced, grown * sizeof(uint32_t));
+    if (!unsynced)
+    {
+        perror("Realloc failed");
+        return 1;
+    }
+    entry->unsynced = unsynced;
+    entry->unsynced_size = grown;
+    return 0;
+}
+
+// writes the byte holding a chunk's bit
+static int write_bit(Registry_entry *entry, uint32_t chunk)
+{
+    return pwrite(entry->fd, &entry->bitmap[chunk / 8], 1,
+        sizeof(State_header) + chunk / 8) != 1;
+}
+
+void registry_chunk_written(bpkg_obj *obj, uint32_t chunk)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&registry_lock);
+    Registry_entry *entry = find_entry(obj);
+    if (entry && entry->fd >= 0 && chunk < entry->nchunks
+        && (entry->bitmap[chunk / 8] >> (chunk % 8)) & 1)
+    {
+        entry->bitmap[chunk / 8] &= ~(1 << (chunk % 8));
+        // must reach the disk before the new data does
+        if (write_bit(entry, chunk) || fdatasync(entry->fd) != 0)
+        {
+            fprintf(stderr, "Error saving package state\n");
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/**
+ * Syncs the data file of a held package, then sets and writes the bits of
+ * the chunks that were waiting for it
+ * The sync runs without registry_lock so other packages are not held up
+ */
+static void sync_package(bpkg_obj *obj)
+{
+    pthread_mutex_lock(&registry_lock);
+    Registry_entry *entry = find_entry(obj);
+    if (!entry || entry->nunsynced == 0)
+    {
+        pthread_mutex_unlock(&registry_lock);
+        return;
+    }
+    uint32_t *batch = entry->unsynced;
+    uint32_t count = entry->nunsynced;
+    entry->unsynced = NULL;
+    entry->nunsynced = 0;
+    entry->unsynced_size = 0;
+    pthread_mutex_unlock(&registry_lock);
+
+    Package_file *file = datafile_get(obj);
+    int synced = file && fdatasync(file->fd) == 0;
+    datafile_put(file);
+
+    pthread_mutex_lock(&registry_lock);
+    entry = find_entry(obj);
+    int failed = !synced;
+    for (uint32_t i = 0; entry && entry->fd >= 0 && synced && i < count; i++)
+    {
+        entry->bitmap[batch[i] / 8] |= 1 << (batch[i] % 8);
+        failed |= write_bit(entry, batch[i]);
+    }
+    // written after the bits, a crash in between leaves the old stamp
+    if (entry && entry->fd >= 0 && synced)
+    {
+        failed |= restamp(entry);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    if (failed)
+    {
+        fprintf(stderr, "Error saving package state\n");
+    }
+    free(batch);
+}
+
+void registry_chunk_checked(bpkg_obj *obj, uint32_t chunk, int verified)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&registry_lock);
+    Registry_entry *entry = find_entry(obj);
+    int full = 0;
+    if (entry && entry->fd >= 0 && chunk < entry->nchunks)
+    {
+        if (!verified)
+        {
+            entry->bitmap[chunk / 8] &= ~(1 << (chunk % 8));
+            if (write_bit(entry, chunk))
+            {
+                fprintf(stderr, "Error saving package state\n");
+            }
+        }
+        else if (entry->nunsynced < entry->unsynced_size
+            || grow_unsynced(entry) == 0)
+        {
+            entry->unsynced[entry->nunsynced++] = chunk;
+            full = entry->nunsynced >= REGISTRY_SYNC_CHUNKS;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    if (full)
+    {
+        sync_package(obj);
+    }
+}
+
+void registry_sync(void)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    // held so none is freed while its file is synced
+    bpkg_obj **objs = NULL;
+    size_t count = 0;
+    pthread_mutex_lock(&registry_lock);
+    for (Registry_entry *entry = entries; entry; entry = entry->next)
+    {
+        count += entry->obj && entry->nunsynced > 0;
+    }
+    objs = count ? malloc(count * sizeof(bpkg_obj *)) : NULL;
+    count = 0;
+    for (Registry_entry *entry = entries; objs && entry; entry = entry->next)
+    {
+        if (entry->obj && entry->nunsynced > 0)
+        {
+            package_hold(entry->obj);
+            objs[count++] = entry->obj;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    for (size_t i = 0; i < count; i++)
+    {
+        sync_package(objs[i]);
+        package_put(objs[i]);
+    }
+    free(objs);
+}
+
+void registry_close(void)
+{
+    // the packages are still managed, so their last chunks can be recorded
+    registry_sync();
+    pthread_mutex_lock(&registry_lock);
+    for (Registry_entry *entry = entries; entry; entry = entry->next)
+    {
+        // nothing writes to the data files any more
+        if (entry->obj && entry->fd >= 0 && restamp(entry))
+        {
+            fprintf(stderr, "Error saving package state\n");
+        }
+    }
+    while (entries)
+    {
+        Registry_entry *entry = entries;
+        entries = entry->next;
+        free_entry(entry);
+    }
+    enabled = 0;
+    pthread_mutex_unlock(&registry_lock);
+}
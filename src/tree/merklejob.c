@@ -0,0 +1,77 @@
+#define _POSIX_C_SOURCE 200112L
+#include "chk/pkgchk.h"
+#include "tree/merkletree.h"
+#include <string.h>
+
+// shared by merkletree.c and merkletree_parallel.c
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// reset the counters and record the totals for the package
+void merkle_job_init(Merkle_build_job *job, bpkg_obj *obj)
+{
+    atomic_init(&job->bytes_hashed, 0);
+    atomic_init(&job->chunks_hashed, 0);
+    atomic_init(&job->cancelled, 0);
+    job->bytes_total = 0;
+    job->verified = NULL;
+    job->chunks_total = obj ? obj->nchunks : 0;
+    // a package whose sections fail to load fails its build anyway
+    if (obj && bpkg_load_sections(obj))
+    {
+        job->chunks_total = 0;
+    }
+    for (uint32_t i = 0; i < job->chunks_total; i++)
+    {
+        job->bytes_total += bpkg_chunk_size(obj, i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+}
+
+void merkle_job_cancel(Merkle_build_job *job)
+{
+    atomic_store(&job->cancelled, 1);
+}
+
+int merkle_job_cancelled(Merkle_build_job *job)
+{
+    return job != NULL && atomic_load(&job->cancelled);
+}
+
+void merkle_job_chunk_done(Merkle_build_job *job, uint32_t size)
+{
+    if (job)
+    {
+        atomic_fetch_add(&job->bytes_hashed, size);
+        atomic_fetch_add(&job->chunks_hashed, 1);
+    }
+}
+
+int merkle_job_chunk_verified(Merkle_build_job *job, uint32_t i)
+{
+    return job != NULL && job->verified != NULL 
+        && (job->verified[i / 8] >> (i % 8)) & 1;
+}
+
+// eta is extrapolated from the byte rate so far
+void merkle_job_progress(Merkle_build_job *job, Merkle_progress *progress)
+{
+    memset(progress, 0, sizeof(Merkle_progress));
+    progress->bytes_hashed = atomic_load(&job->bytes_hashed);
+    progress->chunks_hashed = atomic_load(&job->chunks_hashed);
+    progress->bytes_total = job->bytes_total;
+    progress->chunks_total = job->chunks_total;
+    progress->elapsed = seconds_since(&job->started);
+    progress->eta = -1;
+    if (progress->bytes_hashed > 0)
+    {
+        progress->eta = progress->elapsed *
+            (double)(progress->bytes_total - progress->bytes_hashed) /
+            (double)progress->bytes_hashed;
+    }
+}
@@ -0,0 +1,589 @@
+#include "chk/pkgchk.h"
+#include "crypt/sha256.h"
+#include "tree/merkletree.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// shared by merkletree.c and merkletree_parallel.c, which only differ in
+// how the leaves are hashed
+
+Merkle_tree *merkle_tree_alloc(uint32_t nchunks)
+{
+    Merkle_tree *tree = calloc(1, sizeof(Merkle_tree));
+    if (!tree)
+    {
+        fprintf(stderr, "Error allocating memory\n");
+        return NULL;
+    }
+    tree->nodes_size = 2 * (size_t)nchunks - 1;
+    tree->nodes = malloc(tree->nodes_size * sizeof(Merkle_tree_node));
+    if (!tree->nodes)
+    {
+        fprintf(stderr, "Error allocating memory\n");
+        free(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+// function to take a node given its expected hash, and whether its a leaf
+Merkle_tree_node *merkle_tree_node(Merkle_tree *tree, uint32_t expected,
+    int is_leaf)
+{
+    Merkle_tree_node *node = &tree->nodes[tree->nodes_used++];
+    memset(node, 0, sizeof(*node));
+    node->expected = expected;
+    node->is_leaf = is_leaf;
+    return node;
+}
+
+// calculate the parent hash given left, and right hash
+void compute_parent_hash(Merkle_tree_node *node)
+{
+    if (node && node->left && node->right)
+    {
+        // the hex strings of both children back to back
+        char concat_hash[2 * SHA256_HEXLEN];
+        sha256_digest_to_hex(node->left->computed_hash, concat_hash);
+        sha256_digest_to_hex(node->right->computed_hash,
+            concat_hash + SHA256_HEXLEN);
+
+        struct sha256_compute_data cdata;
+        sha256_compute_data_init(&cdata);
+        sha256_update(&cdata, (uint8_t *)concat_hash, sizeof(concat_hash));
+        uint8_t hashout[32];
+        sha256_finalize(&cdata, hashout);
+        sha256_output(&cdata, node->computed_hash);
+    }
+}
+
+int merkle_tree_link(Merkle_tree *tree, bpkg_obj *obj)
+{
+    // the leaves take the first nchunks nodes of the block
+    Merkle_tree_node **level = malloc(obj->nchunks
+        * sizeof(Merkle_tree_node *));
+    if (!level)
+    {
+        fprintf(stderr, "Error allocating memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < obj->nchunks; i++)
+    {
+        level[i] = &tree->nodes[i];
+    }
+    size_t total_nodes = obj->nchunks;
+
+    // build tree from down up
+    size_t current_level_count = obj->nchunks;
+    while (current_level_count > 1)
+    {
+        size_t next_level_count = 0;
+        for (size_t i = 0; i < current_level_count; i += 2)
+        {
+            // for every 2 pair, create a new parent and replace value in array
+            if (i + 1 < current_level_count)
+            {
+                Merkle_tree_node *parent = merkle_tree_node(tree,
+                    MERKLE_NO_EXPECTED, 0);
+                parent->left = level[i];
+                parent->right = level[i + 1];
+                compute_parent_hash(parent);
+                level[next_level_count++] = parent;
+            }
+            else
+            {
+                // odd case
+                level[next_level_count++] = level[i];
+            }
+            total_nodes++;
+        }
+        // move up
+        current_level_count = next_level_count;
+    }
+    // set root and number of nodes
+    tree->root = level[0];
+    tree->n_nodes = total_nodes;
+
+    // level order over the block, the level array is reused as the queue
+    // since the tree has at most nodes_size nodes
+    Merkle_tree_node **queue = realloc(level, tree->nodes_size
+        * sizeof(Merkle_tree_node *));
+    if (!queue)
+    {
+        free(level);
+        fprintf(stderr, "Error allocating memory\n");
+        return 1;
+    }
+    size_t head = 0, tail = 0;
+    queue[tail++] = tree->root;
+    for (uint32_t i = 0; head < tail; i++)
+    {
+        Merkle_tree_node *current = queue[head++];
+        // update level order hashes unless index exceeded then its the base
+        if (i < obj->nhashes)
+        {
+            current->expected = i;
+        }
+        if (current->left != NULL)
+        {
+            queue[tail++] = current->left;
+        }
+        if (current->right != NULL)
+        {
+            queue[tail++] = current->right;
+        }
+    }
+    free(queue);
+    return 0;
+}
+
+Merkle_tree *merkle_tree_from_digests(bpkg_obj *obj)
+{
+    if (bpkg_load_sections(obj))
+    {
+        fprintf(stderr, "Error loading package sections\n");
+        return NULL;
+    }
+    Merkle_tree *tree = merkle_tree_alloc(obj->nchunks);
+    if (!tree)
+    {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < obj->nchunks; i++)
+    {
+        Merkle_tree_node *leaf = merkle_tree_node(tree, obj->nhashes + i, 1);
+        memcpy(leaf->computed_hash, bpkg_chunk_digest(obj, i),
+            MERKLE_DIGEST_SZ);
+    }
+    if (merkle_tree_link(tree, obj))
+    {
+        destroy_merkle_tree(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+void merkle_expected_hex(const bpkg_obj *obj, const Merkle_tree_node *node,
+    char out[SHA256_HEXLEN + 1])
+{
+    if (node->expected == MERKLE_NO_EXPECTED)
+    {
+        out[0] = '\0';
+    }
+    else if (node->expected < obj->nhashes)
+    {
+        bpkg_hash_hex(obj, node->expected, out);
+    }
+    else
+    {
+        bpkg_chunk_hash_hex(obj, node->expected - obj->nhashes, out);
+    }
+}
+
+// hashes that were not hex have a zeroed digest, which no sha256 output
+// matches, so comparing digests agrees with comparing the hex strings
+int merkle_node_complete(const bpkg_obj *obj, const Merkle_tree_node *node)
+{
+    if (node->expected == MERKLE_NO_EXPECTED)
+    {
+        return 0;
+    }
+    const uint8_t *expected = node->expected < obj->nhashes
+        ? bpkg_hash_digest(obj, node->expected)
+        : bpkg_chunk_digest(obj, node->expected - obj->nhashes);
+    return memcmp(expected, node->computed_hash, MERKLE_DIGEST_SZ) == 0;
+}
+
+// the leaves under a node are a contiguous run of the block, as they are
+// paired left to right, so the rightmost one bounds the left subtree
+static size_t last_leaf(const Merkle_tree *tree, const Merkle_tree_node *node)
+{
+    while (!node->is_leaf)
+    {
+        node = node->right;
+    }
+    return node - tree->nodes;
+}
+
+void merkle_tree_set_leaf(Merkle_tree *tree, uint32_t i, 
+    const uint8_t digest[MERKLE_DIGEST_SZ])
+{
+    memcpy(tree->nodes[i].computed_hash, digest, MERKLE_DIGEST_SZ);
+    // at most one level per bit of the chunk count
+    Merkle_tree_node *path[64];
+    int depth = 0;
+    Merkle_tree_node *node = tree->root;
+    while (!node->is_leaf)
+    {
+        path[depth++] = node;
+        node = i <= last_leaf(tree, node->left) ? node->left : node->right;
+    }
+    while (depth > 0)
+    {
+        compute_parent_hash(path[--depth]);
+    }
+}
+
+Merkle_tree_node *merkle_tree_find(const bpkg_obj *obj, Merkle_tree *tree,
+    const char *hash)
+{
+    uint8_t digest[MERKLE_DIGEST_SZ];
+    if (sha256_hex_to_digest(hash, digest) != 0)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < tree->nodes_used; i++)
+    {
+        Merkle_tree_node *node = &tree->nodes[i];
+        if (node->expected == MERKLE_NO_EXPECTED)
+        {
+            continue;
+        }
+        const uint8_t *expected = node->expected < obj->nhashes
+            ? bpkg_hash_digest(obj, node->expected)
+            : bpkg_chunk_digest(obj, node->expected - obj->nhashes);
+        if (memcmp(expected, digest, MERKLE_DIGEST_SZ) == 0)
+        {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+uint32_t merkle_tree_missing(const bpkg_obj *obj, const Merkle_tree *tree,
+    const Merkle_tree_node *node, uint32_t *chunks)
+{
+    const Merkle_tree_node *first = node;
+    while (!first->is_leaf)
+    {
+        first = first->left;
+    }
+    size_t last = last_leaf(tree, node);
+    uint32_t count = 0;
+    for (size_t i = first - tree->nodes; i <= last; i++)
+    {
+        if (!merkle_node_complete(obj, &tree->nodes[i]))
+        {
+            chunks[count++] = i;
+        }
+    }
+    return count;
+}
+
+void merkle_tree_leaves(const Merkle_tree *tree, const Merkle_tree_node *node,
+    uint32_t *first, uint32_t *last)
+{
+    *last = last_leaf(tree, node);
+    while (!node->is_leaf)
+    {
+        node = node->left;
+    }
+    *first = node - tree->nodes;
+}
+
+int merkle_tree_have(const bpkg_obj *obj, const Merkle_tree *tree,
+    const Merkle_tree_node *node)
+{
+    if (merkle_node_complete(obj, node))
+    {
+        return MERKLE_HAVE_FULL;
+    }
+    uint32_t first;
+    uint32_t last;
+    merkle_tree_leaves(tree, node, &first, &last);
+    int seen[2] = { 0, 0 };
+    for (uint32_t i = first; i <= last; i++)
+    {
+        seen[merkle_node_complete(obj, &tree->nodes[i]) ? 1 : 0] = 1;
+        if (seen[0] && seen[1])
+        {
+            return MERKLE_HAVE_PARTIAL;
+        }
+    }
+    // a node without a manifest hash can still have every leaf
+    return seen[1] ? MERKLE_HAVE_FULL : MERKLE_HAVE_NONE;
+}
+
+size_t merkle_tree_memory(const Merkle_tree *tree)
+{
+    return tree ? sizeof(Merkle_tree)
+        + tree->nodes_size * sizeof(Merkle_tree_node) : 0;
+}
+
+void destroy_merkle_tree(Merkle_tree *tree)
+{
+    if (tree)
+    {
+        free(tree->nodes);
+        free(tree);
+    }
+}
+
+// level order traversal
+// wrapper to have a next attribute
+typedef struct NodeQueue
+{
+    Merkle_tree_node *node;
+    struct NodeQueue *next;
+} NodeQueue;
+
+// enqueue method
+void enqueue(NodeQueue **head, NodeQueue **tail, Merkle_tree_node *node)
+{
+    NodeQueue *new_node = (NodeQueue *)malloc(sizeof(NodeQueue));
+    new_node->node = node;
+    new_node->next = NULL;
+    if (*tail != NULL)
+    {
+        (*tail)->next = new_node;
+    }
+    *tail = new_node;
+    if (*head == NULL)
+    {
+        *head = new_node;
+    }
+}
+
+// dequeue method returns new pointer to head
+Merkle_tree_node *dequeue(NodeQueue **head, NodeQueue **tail)
+{
+    if (*head == NULL)
+        return NULL;
+    NodeQueue *temp = *head;
+    Merkle_tree_node *result = temp->node;
+    *head = temp->next;
+    if (*head == NULL)
+    {
+        *tail = NULL;
+    }
+    free(temp);
+    return result;
+}
+
+// for debugging, print out the entire tree
+void debug(bpkg_obj *obj)
+{
+    if (obj->merkle == NULL || obj->merkle->root == NULL)
+        return;
+
+    NodeQueue *head = NULL, *tail = NULL;
+    enqueue(&head, &tail, obj->merkle->root);
+
+    while (head != NULL)
+    {
+        Merkle_tree_node *current = dequeue(&head, &tail);
+
+        char expected[SHA256_HEXLEN + 1];
+        char computed[SHA256_HEXLEN + 1];
+        merkle_expected_hex(obj, current, expected);
+        sha256_digest_to_hex(current->computed_hash, computed);
+        computed[SHA256_HEXLEN] = '\0';
+        printf("Expected hash: %s Computed hash: %s\n", expected, computed);
+
+        // Enqueue children if they exist
+        if (current->left != NULL)
+        {
+            enqueue(&head, &tail, current->left);
+        }
+        if (current->right != NULL)
+        {
+            enqueue(&head, &tail, current->right);
+        }
+    }
+}
+
+// for bpkg get all hashes very similar to one used inside intialise
+char **levelOrderTraversal(bpkg_obj *bpkg)
+{
+    Merkle_tree *tree = bpkg_merkle(bpkg);
+    if (tree == NULL || tree->root == NULL)
+        return NULL;
+
+    char **hashes = malloc(tree->n_nodes * sizeof(char *));
+    if (hashes == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    NodeQueue *head = NULL, *tail = NULL;
+    enqueue(&head, &tail, tree->root);
+
+    size_t hash_count = 0;
+
+    while (head != NULL && hash_count < tree->n_nodes)
+    {
+        Merkle_tree_node *current = dequeue(&head, &tail);
+
+        // Allocate memory for the hash string
+        hashes[hash_count] = malloc((SHA256_HEXLEN + 1) * sizeof(char));
+        if (hashes[hash_count] == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            for (size_t i = 0; i < hash_count; ++i)
+                free(hashes[i]);
+            free(hashes);
+            return NULL;
+        }
+        merkle_expected_hex(bpkg, current, hashes[hash_count]);
+        ++hash_count;
+
+        if (current->left != NULL)
+        {
+            enqueue(&head, &tail, current->left);
+        }
+        if (current->right != NULL)
+        {
+            enqueue(&head, &tail, current->right);
+        }
+    }
+    return hashes;
+}
+
+// appends a copy of hex to the query list
+static void add_hash(char ***hashes, size_t *len, const char *hex)
+{
+    (*hashes)[*len] = malloc((SHA256_HEXLEN + 1) * sizeof(char));
+    if ((*hashes)[*len] != NULL)
+    {
+        strcpy((*hashes)[*len], hex);
+        (*len)++;
+    }
+}
+
+// preorder traversal for function 1 of get_complete_chunks
+void collect_matching_leaf_hashes(bpkg_obj *obj, Merkle_tree_node *node,
+char ***hashes, size_t *len)
+{
+    if (node == NULL)
+        return;
+
+    if (node->is_leaf)
+    {
+        if (merkle_node_complete(obj, node))
+        {
+            char hex[SHA256_HEXLEN + 1];
+            sha256_digest_to_hex(node->computed_hash, hex);
+            hex[SHA256_HEXLEN] = '\0';
+            add_hash(hashes, len, hex);
+        }
+    }
+    else
+    {
+        collect_matching_leaf_hashes(obj, node->left, hashes, len);
+        collect_matching_leaf_hashes(obj, node->right, hashes, len);
+    }
+}
+
+// preorder traversal for function 2 of get_complete_chunks
+void collect_min_hashes(bpkg_obj *obj, Merkle_tree_node *node,
+char ***hashes, size_t *len)
+{
+    if (node == NULL)
+        return;
+
+    if (merkle_node_complete(obj, node))
+    {
+        char hex[SHA256_HEXLEN + 1];
+        merkle_expected_hex(obj, node, hex);
+        add_hash(hashes, len, hex);
+        return;
+    } else {
+        collect_min_hashes(obj, node->left, hashes, len);
+        collect_min_hashes(obj, node->right, hashes, len);
+    }
+}
+
+// preorder traversal for function 3 of get_complete_chunks
+void collect_leaf_hashes(bpkg_obj *obj, Merkle_tree_node *node,
+char ***hashes, size_t *len)
+{
+    if (node == NULL)
+        return;
+    if (node->is_leaf)
+    {
+        char hex[SHA256_HEXLEN + 1];
+        merkle_expected_hex(obj, node, hex);
+        add_hash(hashes, len, hex);
+    }
+    else
+    {
+        collect_leaf_hashes(obj, node->left, hashes, len);
+        collect_leaf_hashes(obj, node->right, hashes, len);
+    }
+}
+
+// preorder traversal for function 3 of get_complete_chunks
+void collect_matching_chunk_hash(bpkg_obj *obj, Merkle_tree_node *node,
+char ***hashes, size_t *len, char *hash)
+{
+    if (node == NULL)
+        return;
+    // hash is not null terminated
+    char hex[SHA256_HEXLEN + 1];
+    merkle_expected_hex(obj, node, hex);
+    if (strncmp(hex, hash, 64) == 0)
+    {
+        // if its the leaf then there are no children left, add hash and return
+        if (node->is_leaf) {
+            add_hash(hashes, len, hex);
+            return;
+        }
+        collect_leaf_hashes(obj, node->left, hashes, len);
+        collect_leaf_hashes(obj, node->right, hashes, len);
+    } else {
+        collect_matching_chunk_hash(obj, node->left, hashes, len, hash);
+        collect_matching_chunk_hash(obj, node->right, hashes, len, hash);
+    }
+}
+
+// function to get completed chunks which have same expected + computed hash
+bpkg_query get_complete_chunks(bpkg_obj *obj, int flag, char* hash)
+{
+    bpkg_query qy = {0};
+    Merkle_tree *tree = bpkg_merkle(obj);
+    if (tree == NULL || tree->root == NULL) {
+        fprintf(stderr, "Error with bpkg_obj merkle tree\n");
+        qy.hashes = NULL;
+        return qy;
+    }
+
+    // at most nchunks of hashes will be needed
+    char **hashes = malloc(obj->nchunks * sizeof(char *));
+    if (hashes == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        qy.hashes = NULL;
+        return qy;
+    }
+
+    size_t len = 0;
+    // bpkg_get_completed_chunks
+    if (flag == 0) {
+        collect_matching_leaf_hashes(obj, tree->root, &hashes, &len);
+    // bpkg_get_min_completed_hashes
+    } else if (flag == 1) {
+        collect_min_hashes(obj, tree->root, &hashes, &len);
+    // bpkg_get_all_chunk_hashes_from_hash
+    } else if (flag == 2) {
+        collect_matching_chunk_hash(obj, tree->root, &hashes, &len, hash);
+    } else {
+        // should never happen
+        fprintf(stderr, "Invalid flag provided to get_complete_chunks\n");
+        free(hashes);
+        qy.hashes = NULL;
+        return qy;
+    }
+    if (len == 0)
+    {
+        free(hashes);
+        qy.hashes = NULL;
+        fprintf(stderr, "No hashes collected\n");
+    }
+    else
+    {
+        qy.hashes = hashes;
+        qy.len = len;
+    }
+    return qy;
+}